@@ -0,0 +1,910 @@
+//
+// Write-back block buffer cache sitting between the filesystem and the
+// software disk.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "softwaredisk.h"
+#include "blockcache.h"
+
+// one cached block
+typedef struct CacheEntry {
+  unsigned long blocknum;
+  int valid;
+  int dirty;
+  int pending;                    // being read by a prefetch still in flight
+  struct CacheEntry *hashNext;    // bucket chain
+  struct CacheEntry *lruPrev;     // towards most recently used
+  struct CacheEntry *lruNext;     // towards least recently used
+  char *data;
+} CacheEntry;
+
+// internals of block cache implementation
+typedef struct BlockCacheInternals {
+  unsigned long capacity;
+  unsigned long blockSize;        // software disk block size at init
+  SDDevice *device;               // software disk the cached blocks belong to
+				  // (selected when they were cached)
+  unsigned long bucketMask;       // number of buckets - 1 (power of two)
+  CacheEntry *entries;
+  CacheEntry **buckets;
+  CacheEntry *lruHead;            // most recently used
+  CacheEntry *lruTail;            // least recently used, next victim
+  char *data;
+  SDRequest *prefetch;            // reads of the prefetch in flight, if any
+  unsigned long prefetchCount;
+  char *prefetchData;             // where they land, copied into the entries
+  unsigned long prefetchBlocks;   //  once settled
+} BlockCacheInternals;
+
+//
+// GLOBALS
+//
+
+static BlockCacheInternals bc;
+
+// held by every public function; dropped while the missing blocks of a batch
+// are read or its large runs written, so other threads use the cache meanwhile
+static pthread_mutex_t cacheLock = PTHREAD_MUTEX_INITIALIZER;
+
+static CacheObserver observer = NULL;
+
+// the missing blocks of a read_runs() being read with the cache lock dropped
+typedef struct InFlightRead {
+  SDRequest *misses;
+  unsigned long count;
+  char *written;                  // per block of 'misses', in order: written
+				  //  meanwhile, so what is read is stale
+  struct InFlightRead *next;
+} InFlightRead;
+
+// reads in flight (kept apart from 'bc', which init_cache() may reset while
+// they are)
+static InFlightRead *inFlight = NULL;
+
+static int init_cache(unsigned long capacity);
+static int flush_cache(void);
+
+
+static void lru_unlink(CacheEntry *e) {
+
+  if (e->lruPrev) {
+    e->lruPrev->lruNext=e->lruNext;
+  }
+  else {
+    bc.lruHead=e->lruNext;
+  }
+  if (e->lruNext) {
+    e->lruNext->lruPrev=e->lruPrev;
+  }
+  else {
+    bc.lruTail=e->lruPrev;
+  }
+  e->lruPrev=e->lruNext=NULL;
+}
+
+static void lru_push_front(CacheEntry *e) {
+
+  e->lruPrev=NULL;
+  e->lruNext=bc.lruHead;
+  if (bc.lruHead) {
+    bc.lruHead->lruPrev=e;
+  }
+  bc.lruHead=e;
+  if (! bc.lruTail) {
+    bc.lruTail=e;
+  }
+}
+
+static void hash_remove(CacheEntry *e) {
+  CacheEntry **pp;
+
+  for (pp=&bc.buckets[e->blocknum & bc.bucketMask]; *pp; pp=&(*pp)->hashNext) {
+    if (*pp == e) {
+      *pp=e->hashNext;
+      break;
+    }
+  }
+  e->hashNext=NULL;
+}
+
+static CacheEntry *find(unsigned long blocknum) {
+  CacheEntry *e;
+
+  for (e=bc.buckets[blocknum & bc.bucketMask]; e; e=e->hashNext) {
+    if (e->blocknum == blocknum) {
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// tells the reads in flight that 'count' blocks from 'blocknum' were written,
+// so they do not install what they read of them
+static void mark_written(unsigned long blocknum, unsigned long count) {
+  InFlightRead *r;
+  unsigned long i, k, from, to;
+
+  for (r=inFlight; r; r=r->next) {
+    for (i=0, k=0; i < r->count; k += r->misses[i].count, i++) {
+      from=blocknum > r->misses[i].blocknum ? blocknum : r->misses[i].blocknum;
+      to=r->misses[i].blocknum + r->misses[i].count;
+      if (blocknum + count < to) {
+	to=blocknum + count;
+      }
+      for (; from < to; from++) {
+	r->written[k + from - r->misses[i].blocknum]=1;
+      }
+    }
+  }
+}
+
+// waits for the prefetch in flight, if any, copies what it read into the
+// entries waiting for it and drops those it failed to read
+static void settle_prefetch(void) {
+  unsigned long i, j;
+  CacheEntry *e;
+  char *p;
+  int ok;
+
+  if (! bc.prefetchCount) {
+    return;
+  }
+  // completions of the ring are reaped by whichever thread waits on it
+  for (i=0; i < bc.prefetchCount && __atomic_load_n(&bc.prefetch[i].done, __ATOMIC_ACQUIRE); i++)
+    ;
+  if (i < bc.prefetchCount) {
+    wait_sd_requests();
+  }
+  for (i=0; i < bc.prefetchCount; i++) {
+    ok=__atomic_load_n(&bc.prefetch[i].done, __ATOMIC_ACQUIRE) && bc.prefetch[i].result;
+    p=bc.prefetch[i].buf;
+    for (j=0; j < bc.prefetch[i].count; j++) {
+      e=find(bc.prefetch[i].blocknum + j);
+      if (! e || ! e->pending) {
+	continue;
+      }
+      e->pending=0;
+      if (ok) {
+	memcpy(e->data, p + j * bc.blockSize, bc.blockSize);
+	continue;
+      }
+      // nothing valid arrived; the entry is the next one reused
+      hash_remove(e);
+      e->valid=0;
+      lru_unlink(e);
+      e->lruPrev=bc.lruTail;
+      if (bc.lruTail) {
+	bc.lruTail->lruNext=e;
+      }
+      else {
+	bc.lruHead=e;
+      }
+      bc.lruTail=e;
+    }
+  }
+  free(bc.prefetch);
+  sd_free_buffer(bc.prefetchData, bc.prefetchBlocks * bc.blockSize);
+  bc.prefetch=NULL;
+  bc.prefetchCount=0;
+  bc.prefetchData=NULL;
+  bc.prefetchBlocks=0;
+}
+
+// returns the entry caching 'blocknum', or NULL.  A block still arriving from
+// a prefetch is waited for first.
+static CacheEntry *lookup(unsigned long blocknum) {
+  CacheEntry *e=find(blocknum);
+
+  if (e && e->pending) {
+    settle_prefetch();
+    e=find(blocknum);
+  }
+  return e;
+}
+
+static void release_cache(void) {
+
+  settle_prefetch();
+  free(bc.entries);
+  free(bc.buckets);
+  sd_free_buffer(bc.data, bc.capacity * bc.blockSize);
+  memset(&bc, 0, sizeof(bc));
+}
+
+// returns 1 if the cache holds blocks of the selected software disk as it is
+// addressed now
+static int cache_matches_disk(void) {
+
+  return bc.capacity && bc.blockSize == SOFTWARE_DISK_BLOCK_SIZE &&
+    bc.device == software_disk_device();
+}
+
+static void flush_at_exit(void) {
+
+  flush_block_cache();
+}
+
+// lazily sets up the default cache
+static int ensure_cache(void) {
+  static int registered=0;
+
+  if (! registered) {
+    // dirty blocks of a program that never calls flush still reach the disk
+    atexit(flush_at_exit);
+    registered=1;
+  }
+  if (cache_matches_disk()) {
+    return 1;
+  }
+  // first use, or another disk or block size is in use (dirty blocks go back
+  // to the disk they belong to first)
+  return init_cache(bc.capacity ? bc.capacity : DEFAULT_CACHE_BLOCKS);
+}
+
+// takes the least recently used entry for reuse as 'blocknum', writing it back
+// first if dirty.  Returns NULL if the write-back fails.
+static CacheEntry *claim_entry(unsigned long blocknum) {
+  CacheEntry *e;
+
+  if (bc.lruTail->pending) {
+    settle_prefetch();
+  }
+  e=bc.lruTail;
+  if (e->valid) {
+    if (e->dirty && ! write_sd_block(e->data, e->blocknum)) {
+      return NULL;
+    }
+    hash_remove(e);
+  }
+  lru_unlink(e);
+  e->blocknum=blocknum;
+  e->valid=1;
+  e->dirty=0;
+  e->hashNext=bc.buckets[blocknum & bc.bucketMask];
+  bc.buckets[blocknum & bc.bucketMask]=e;
+  lru_push_front(e);
+  return e;
+}
+
+// marks 'e' most recently used
+static void touch(CacheEntry *e) {
+
+  if (bc.lruHead != e) {
+    lru_unlink(e);
+    lru_push_front(e);
+  }
+}
+
+// init_block_cache() with the cache lock held
+static int init_cache(unsigned long capacity) {
+  unsigned long i, buckets;
+
+  if (capacity == 0) {
+    return 0;
+  }
+  if (bc.capacity && ! flush_cache()) {
+    return 0;
+  }
+  release_cache();
+
+  buckets=1;
+  while (buckets < capacity * 2) {
+    buckets <<= 1;
+  }
+  bc.entries=calloc(capacity, sizeof(CacheEntry));
+  bc.buckets=calloc(buckets, sizeof(CacheEntry *));
+  bc.data=sd_alloc_buffer(capacity * SOFTWARE_DISK_BLOCK_SIZE);
+  if (! bc.entries || ! bc.buckets || ! bc.data) {
+    release_cache();
+    return 0;
+  }
+  bc.capacity=capacity;
+  bc.blockSize=SOFTWARE_DISK_BLOCK_SIZE;
+  bc.device=software_disk_device();
+  bc.bucketMask=buckets - 1;
+  for (i=0; i < capacity; i++) {
+    bc.entries[i].data=bc.data + i * SOFTWARE_DISK_BLOCK_SIZE;
+    lru_push_front(&bc.entries[i]);
+  }
+  return 1;
+}
+
+// (re)initializes the cache to hold 'capacity' blocks, flushing and dropping
+// anything currently cached.  Returns 1 on success, otherwise 0.
+int init_block_cache(unsigned long capacity) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  ret=init_cache(capacity);
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+// makes the cache hold blocks of the selected software disk, writing back
+// those of the disk it held before.  Returns 1 on success, otherwise 0.
+int switch_block_cache_disk(void) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  ret=ensure_cache();
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+// tells the observer, if any, about a request
+static void observe(int write, unsigned long blocknum, unsigned long count, unsigned long hits) {
+
+  if (observer) {
+    observer(write, blocknum, count, hits);
+  }
+}
+
+// installs 'newObserver' (NULL removes it).  Returns the previous one.
+CacheObserver set_block_cache_observer(CacheObserver newObserver) {
+  CacheObserver prev=observer;
+
+  observer=newObserver;
+  return prev;
+}
+
+// cache_read_block() with the cache lock held
+static int read_block(void *buf, unsigned long blocknum) {
+  CacheEntry *e;
+
+  if (! ensure_cache()) {
+    observe(0, blocknum, 1, 0);
+    return read_sd_block(buf, blocknum);
+  }
+  e=lookup(blocknum);
+  observe(0, blocknum, 1, e != NULL);
+  if (e) {
+    touch(e);
+    memcpy(buf, e->data, SOFTWARE_DISK_BLOCK_SIZE);
+    return 1;
+  }
+  if (! read_sd_block(buf, blocknum)) {
+    return 0;
+  }
+  e=claim_entry(blocknum);
+  if (e) {
+    memcpy(e->data, buf, SOFTWARE_DISK_BLOCK_SIZE);
+  }
+  return 1;
+}
+
+// reads block 'blocknum' into 'buf', from the cache if resident.  Returns 1 on
+// success or 0 on failure.
+int cache_read_block(void *buf, unsigned long blocknum) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  ret=read_block(buf, blocknum);
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+// writes 'buf' as block 'blocknum', marking the cached copy dirty.  Returns 1
+// on success or 0 on failure.
+static int store_block(void *buf, unsigned long blocknum) {
+  CacheEntry *e;
+
+  if (! ensure_cache()) {
+    return write_sd_block(buf, blocknum);
+  }
+  if (blocknum >= software_disk_size()) {
+    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+    return 0;
+  }
+  mark_written(blocknum, 1);
+  e=lookup(blocknum);
+  if (e) {
+    touch(e);
+  }
+  else {
+    e=claim_entry(blocknum);
+    if (! e) {
+      return write_sd_block(buf, blocknum);
+    }
+  }
+  memcpy(e->data, buf, SOFTWARE_DISK_BLOCK_SIZE);
+  e->dirty=1;
+  return 1;
+}
+
+// writes 'buf' as block 'blocknum'.  Returns 1 on success or 0 on failure.
+int cache_write_block(void *buf, unsigned long blocknum) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  observe(1, blocknum, 1, 0);
+  ret=store_block(buf, blocknum);
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+// cache_read_blocks() with the cache lock held
+static int read_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  unsigned long i, missStart, hits=0;
+  char *p=buf;
+  CacheEntry *e;
+  int install;
+
+  if (! ensure_cache()) {
+    observe(0, blocknum, count, 0);
+    return read_sd_blocks(buf, blocknum, count);
+  }
+  if (observer) {
+    for (i=0; i < count; i++) {
+      hits += lookup(blocknum + i) != NULL;
+    }
+    observe(0, blocknum, count, hits);
+  }
+  // large scans would only push hot metadata out of the cache
+  install=(count <= bc.capacity / 4);
+
+  i=0;
+  while (i < count) {
+    e=lookup(blocknum + i);
+    if (e) {
+      touch(e);
+      memcpy(p + i * SOFTWARE_DISK_BLOCK_SIZE, e->data, SOFTWARE_DISK_BLOCK_SIZE);
+      i++;
+      continue;
+    }
+    missStart=i;
+    while (i < count && ! lookup(blocknum + i)) {
+      i++;
+    }
+    if (! read_sd_blocks(p + missStart * SOFTWARE_DISK_BLOCK_SIZE, blocknum + missStart, i - missStart)) {
+      return 0;
+    }
+    for (; install && missStart < i; missStart++) {
+      e=claim_entry(blocknum + missStart);
+      if (e) {
+	memcpy(e->data, p + missStart * SOFTWARE_DISK_BLOCK_SIZE, SOFTWARE_DISK_BLOCK_SIZE);
+      }
+    }
+  }
+  return 1;
+}
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf'.  Returns 1
+// on success or 0 on failure.
+int cache_read_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  ret=read_blocks(buf, blocknum, count);
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf'.  Returns
+// 1 on success or 0 on failure.
+static int store_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  unsigned long i;
+  char *p=buf;
+  CacheEntry *e;
+
+  if (! ensure_cache()) {
+    return write_sd_blocks(buf, blocknum, count);
+  }
+  if (count > bc.capacity / 4) {
+    // write through, keeping any resident copies identical to the disk
+    if (! write_sd_blocks(buf, blocknum, count)) {
+      return 0;
+    }
+    mark_written(blocknum, count);
+    for (i=0; i < count; i++) {
+      e=lookup(blocknum + i);
+      if (e) {
+	memcpy(e->data, p + i * SOFTWARE_DISK_BLOCK_SIZE, SOFTWARE_DISK_BLOCK_SIZE);
+	e->dirty=0;
+      }
+    }
+    return 1;
+  }
+  for (i=0; i < count; i++) {
+    if (! store_block(p + i * SOFTWARE_DISK_BLOCK_SIZE, blocknum + i)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf'.  Returns
+// 1 on success or 0 on failure.
+int cache_write_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  observe(1, blocknum, count, 0);
+  ret=store_blocks(buf, blocknum, count);
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+// submits 'reqs' and waits for all of them.  Returns 1 if every request
+// succeeded.
+static int submit_and_wait(SDRequest *reqs, unsigned long n) {
+  unsigned long i;
+
+  if (! submit_sd_requests(reqs, n) || ! wait_sd_requests()) {
+    wait_sd_requests();
+    return 0;
+  }
+  for (i=0; i < n; i++) {
+    if (! reqs[i].result) {
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// submit_and_wait() for requests on the caller's buffers, which need nothing
+// of the cache: other threads may use it until they are done
+static int transfer_unlocked(SDRequest *reqs, unsigned long n) {
+  int ret;
+
+  pthread_mutex_unlock(&cacheLock);
+  ret=submit_and_wait(reqs, n);
+  pthread_mutex_lock(&cacheLock);
+  return ret;
+}
+
+// cache_read_runs() with the cache lock held.  The missing blocks are read
+// with it dropped; another thread may have cached or written one of them
+// meanwhile, or switched the cache to another disk, so they are installed only
+// where none of that happened.
+static int read_runs(SDRequest *runs, unsigned long count) {
+  SDRequest *misses;
+  InFlightRead read, **pp;
+  unsigned long r, i, j, k, n=0, total=0, hits;
+  char *p;
+  CacheEntry *e;
+  int ok;
+
+  if (! ensure_cache()) {
+    return 0;
+  }
+  for (r=0; r < count; r++) {
+    total += runs[r].count;
+  }
+  misses=malloc(total * sizeof(SDRequest));
+  if (! misses) {
+    return 0;
+  }
+
+  // copy what is resident, collect the rest as runs of missing blocks
+  for (r=0; r < count; r++) {
+    p=runs[r].buf;
+    i=0;
+    hits=0;
+    while (i < runs[r].count) {
+      e=lookup(runs[r].blocknum + i);
+      if (e) {
+	touch(e);
+	memcpy(p + i * SOFTWARE_DISK_BLOCK_SIZE, e->data, SOFTWARE_DISK_BLOCK_SIZE);
+	hits++;
+	i++;
+	continue;
+      }
+      misses[n].write=0;
+      misses[n].blocknum=runs[r].blocknum + i;
+      misses[n].buf=p + i * SOFTWARE_DISK_BLOCK_SIZE;
+      while (i < runs[r].count && ! lookup(runs[r].blocknum + i)) {
+	i++;
+      }
+      misses[n].count=runs[r].blocknum + i - misses[n].blocknum;
+      n++;
+    }
+    observe(0, runs[r].blocknum, runs[r].count, hits);
+  }
+  if (! n) {
+    free(misses);
+    return 1;
+  }
+
+  // writes made while the lock is dropped mark the blocks they hit
+  read.misses=misses;
+  read.count=n;
+  read.written=calloc(total, 1);
+  if (! read.written) {
+    free(misses);
+    return 0;
+  }
+  read.next=inFlight;
+  inFlight=&read;
+  ok=transfer_unlocked(misses, n);
+  for (pp=&inFlight; *pp != &read; pp=&(*pp)->next)
+    ;
+  *pp=read.next;
+
+  // large scans would only push hot metadata out of the cache
+  for (i=0, k=0; ok && i < n && cache_matches_disk(); k += misses[i].count, i++) {
+    if (misses[i].count > bc.capacity / 4) {
+      continue;
+    }
+    for (j=0; j < misses[i].count; j++) {
+      if (read.written[k + j] || find(misses[i].blocknum + j)) {
+	continue;
+      }
+      e=claim_entry(misses[i].blocknum + j);
+      if (e) {
+	memcpy(e->data, (char *)misses[i].buf + j * SOFTWARE_DISK_BLOCK_SIZE, SOFTWARE_DISK_BLOCK_SIZE);
+      }
+    }
+  }
+  free(read.written);
+  free(misses);
+  return ok;
+}
+
+// reads several runs of consecutive blocks.  Returns 1 on success or 0 on
+// failure.
+int cache_read_runs(SDRequest *runs, unsigned long count) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  ret=read_runs(runs, count);
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+// cache_prefetch_runs() with the cache lock held
+static int prefetch_runs(SDRequest *runs, unsigned long count) {
+  SDRequest *reqs;
+  unsigned long r, i, n=0, k=0, total=0, limit, hits;
+  CacheEntry *e;
+  char *staging;
+
+  if (! ensure_cache()) {
+    return 0;
+  }
+  // the synchronous engine would read the blocks right here with the cache
+  // lock held, stalling every other thread for reads the caller makes itself
+  // next anyway
+  if (software_disk_engine() == SD_ENGINE_SYNC) {
+    return 1;
+  }
+  // one prefetch in flight at a time
+  settle_prefetch();
+
+  for (r=0; r < count; r++) {
+    total += runs[r].count;
+  }
+  // a prefetch may not push out much of what is cached
+  limit=bc.capacity / 4;
+  if (total > limit) {
+    total=limit;
+  }
+  if (! total) {
+    return 1;
+  }
+  reqs=malloc(total * sizeof(SDRequest));
+  staging=sd_alloc_buffer(total * SOFTWARE_DISK_BLOCK_SIZE);
+  if (! reqs || ! staging) {
+    free(reqs);
+    if (staging) {
+      sd_free_buffer(staging, total * SOFTWARE_DISK_BLOCK_SIZE);
+    }
+    return 0;
+  }
+
+  // the entries' buffers are not consecutive: consecutive missing blocks are
+  // read as one request into the staging buffer, settle_prefetch() copies them
+  for (r=0; r < count && k < total; r++) {
+    hits=0;
+    for (i=0; i < runs[r].count && k < total; i++) {
+      if (find(runs[r].blocknum + i)) {
+	hits++;
+	continue;
+      }
+      e=claim_entry(runs[r].blocknum + i);
+      if (! e) {
+	break;
+      }
+      e->pending=1;
+      if (! n || reqs[n - 1].blocknum + reqs[n - 1].count != runs[r].blocknum + i) {
+	reqs[n].write=0;
+	reqs[n].blocknum=runs[r].blocknum + i;
+	reqs[n].count=0;
+	reqs[n].buf=staging + k * SOFTWARE_DISK_BLOCK_SIZE;
+	reqs[n].done=0;
+	reqs[n].result=0;
+	n++;
+      }
+      reqs[n - 1].count++;
+      k++;
+    }
+    observe(0, runs[r].blocknum, i, hits);
+  }
+  if (! n) {
+    free(reqs);
+    sd_free_buffer(staging, total * SOFTWARE_DISK_BLOCK_SIZE);
+    return 1;
+  }
+  bc.prefetch=reqs;
+  bc.prefetchCount=n;
+  bc.prefetchData=staging;
+  bc.prefetchBlocks=total;
+  if (! submit_sd_requests(reqs, n)) {
+    settle_prefetch();
+    return 0;
+  }
+  return 1;
+}
+
+// starts reading the blocks of 'runs' that are not resident into the cache.
+// Returns 1 if they were submitted (or nothing was missing), otherwise 0.
+int cache_prefetch_runs(SDRequest *runs, unsigned long count) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  ret=prefetch_runs(runs, count);
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+// cache_write_runs() with the cache lock held.  The runs written through go
+// out with it dropped.
+static int write_runs(SDRequest *runs, unsigned long count) {
+  SDRequest *direct;
+  unsigned long r, i, n=0;
+  CacheEntry *e;
+  int ret;
+
+  if (! ensure_cache()) {
+    return 0;
+  }
+  direct=malloc(count * sizeof(SDRequest));
+  if (! direct) {
+    return 0;
+  }
+  for (r=0; r < count; r++) {
+    observe(1, runs[r].blocknum, runs[r].count, 0);
+    if (runs[r].count > bc.capacity / 4) {
+      direct[n]=runs[r];
+      direct[n].write=1;
+      n++;
+    }
+    else if (! store_blocks(runs[r].buf, runs[r].blocknum, runs[r].count)) {
+      free(direct);
+      return 0;
+    }
+  }
+  // keep resident copies identical to what is written through, and clean
+  // before the lock is dropped so no eviction writes an older copy over it
+  for (r=0; r < n; r++) {
+    mark_written(direct[r].blocknum, direct[r].count);
+    for (i=0; i < direct[r].count; i++) {
+      e=lookup(direct[r].blocknum + i);
+      if (e) {
+	memcpy(e->data, (char *)direct[r].buf + i * SOFTWARE_DISK_BLOCK_SIZE, SOFTWARE_DISK_BLOCK_SIZE);
+	e->dirty=0;
+      }
+    }
+  }
+  ret=! n || transfer_unlocked(direct, n);
+  free(direct);
+  return ret;
+}
+
+// writes several runs of consecutive blocks.  Returns 1 on success or 0 on
+// failure.
+int cache_write_runs(SDRequest *runs, unsigned long count) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  ret=write_runs(runs, count);
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
+
+static int compare_blocknum(const void *a, const void *b) {
+  unsigned long x=(*(SDBlockVec *)a).blocknum, y=(*(SDBlockVec *)b).blocknum;
+
+  return (x > y) - (x < y);
+}
+
+// writes every dirty block to the selected software disk, which they belong
+// to, coalescing consecutive blocks, and syncs it.  Returns 1 on success or 0
+// on failure.
+static int write_back(void) {
+  SDBlockVec *vec;
+  unsigned long i, n=0;
+
+  // the disk is addressed with another block size than the blocks were cached
+  // with; nothing can be written safely
+  if (bc.blockSize != SOFTWARE_DISK_BLOCK_SIZE) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  vec=malloc(bc.capacity * sizeof(SDBlockVec));
+  if (! vec) {
+    return 0;
+  }
+  for (i=0; i < bc.capacity; i++) {
+    if (bc.entries[i].valid && bc.entries[i].dirty) {
+      vec[n].blocknum=bc.entries[i].blocknum;
+      vec[n].buf=bc.entries[i].data;
+      n++;
+    }
+  }
+  qsort(vec, n, sizeof(SDBlockVec), compare_blocknum);
+  if (software_disk_engine() == SD_ENGINE_SYNC) {
+    if (! writev_sd_blocks(vec, n)) {
+      free(vec);
+      return 0;
+    }
+  }
+  else {
+    // one request per block, all in flight together
+    SDRequest *reqs=malloc((n ? n : 1) * sizeof(SDRequest));
+
+    if (! reqs) {
+      free(vec);
+      return 0;
+    }
+    for (i=0; i < n; i++) {
+      reqs[i].write=1;
+      reqs[i].blocknum=vec[i].blocknum;
+      reqs[i].count=1;
+      reqs[i].buf=vec[i].buf;
+    }
+    if (n && ! submit_and_wait(reqs, n)) {
+      free(reqs);
+      free(vec);
+      return 0;
+    }
+    free(reqs);
+  }
+  free(vec);
+  for (i=0; i < bc.capacity; i++) {
+    bc.entries[i].dirty=0;
+  }
+  return sync_software_disk();
+}
+
+// flush_block_cache() with the cache lock held
+static int flush_cache(void) {
+  SDDevice *selected;
+  unsigned long i;
+  int ok;
+
+  if (! bc.capacity) {
+    return sync_software_disk();
+  }
+  for (i=0; i < bc.capacity && ! (bc.entries[i].valid && bc.entries[i].dirty); i++)
+    ;
+  if (i == bc.capacity) {
+    // nothing to write; the disk the blocks belong to may be gone
+    return sync_software_disk();
+  }
+  if (bc.device == software_disk_device()) {
+    return write_back();
+  }
+  // switching back and forth; the filesystem never gets here as it switches
+  // the cache over (switch_block_cache_disk) while nothing else runs
+  selected=select_software_disk(bc.device);
+  ok=write_back();
+  select_software_disk(selected);
+  return ok && sync_software_disk();
+}
+
+// writes every dirty block back to the software disk and syncs it.  Blocks of
+// a disk that is no longer selected go back to that disk.  Returns 1 on
+// success or 0 on failure.
+int flush_block_cache(void) {
+  int ret;
+
+  pthread_mutex_lock(&cacheLock);
+  ret=flush_cache();
+  pthread_mutex_unlock(&cacheLock);
+  return ret;
+}
@@ -0,0 +1,79 @@
+//
+// Write-back block buffer cache sitting between the filesystem and the
+// software disk.  Blocks are kept in LRU order; dirty blocks are written to
+// the software disk when evicted or when the cache is flushed.  Cached blocks
+// belong to the software disk selected when they were cached; they are written
+// back there before blocks of another one are cached.  Flush before destroying
+// a software disk.  The functions may be called from several threads at once;
+// a batch's disk transfers do not keep other threads out of the cache.
+//
+
+#define DEFAULT_CACHE_BLOCKS 1024
+
+// called for every request made of the cache with its direction, first block,
+// number of blocks and how many of them were served from the cache
+typedef void (*CacheObserver)(int write, unsigned long blocknum, unsigned long count,
+			      unsigned long hits);
+
+// function prototypes for block cache API
+
+// (re)initializes the cache to hold 'capacity' blocks, flushing and dropping
+// anything currently cached.  The cache initializes itself with
+// DEFAULT_CACHE_BLOCKS on first use if this is never called.  Returns 1 on
+// success, otherwise 0.
+int init_block_cache(unsigned long capacity);
+
+// makes the cache hold blocks of the selected software disk (it follows the
+// selection by itself on its next use otherwise), writing back the dirty
+// blocks of the disk selected before.  Writing those back selects that disk
+// for a moment, so no other thread may be using the software disk meanwhile.
+// Returns 1 on success, otherwise 0.
+int switch_block_cache_disk(void);
+
+// reads block 'blocknum' into 'buf' (SOFTWARE_DISK_BLOCK_SIZE bytes), from the
+// cache if resident.  Returns 1 on success or 0 on failure; 'sderror' holds
+// the cause of a failed software disk access.
+int cache_read_block(void *buf, unsigned long blocknum);
+
+// writes 'buf' as block 'blocknum'.  The block is only marked dirty; it
+// reaches the software disk on eviction or flush.  Returns 1 on success or 0
+// on failure.
+int cache_write_block(void *buf, unsigned long blocknum);
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf'.  Resident
+// blocks are copied, runs of missing blocks are read with one read_sd_blocks.
+// Returns 1 on success or 0 on failure.
+int cache_read_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf'.  Runs
+// too large to cache usefully are written straight through.  Returns 1 on
+// success or 0 on failure.
+int cache_write_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// reads several runs of consecutive blocks described by 'runs' (their 'write'
+// fields are ignored).  Resident blocks are copied; all missing blocks are
+// submitted to the software disk in one batch, so an asynchronous engine keeps
+// them in flight together.  Returns 1 on success or 0 on failure.
+int cache_read_runs(SDRequest *runs, unsigned long count);
+
+// starts reading the blocks of 'runs' that are not resident into the cache (their
+// 'buf' and 'write' fields are ignored), at most a quarter of the cache.  The
+// reads complete in the background, consecutive blocks in one request; a block
+// still in flight is waited for when it is used.  With the synchronous engine
+// nothing is read.  Returns 1 if the reads were submitted (or none were due),
+// otherwise 0.
+int cache_prefetch_runs(SDRequest *runs, unsigned long count);
+
+// writes several runs of consecutive blocks described by 'runs'.  Runs too large
+// to cache usefully are submitted to the software disk in one batch.  Returns
+// 1 on success or 0 on failure.
+int cache_write_runs(SDRequest *runs, unsigned long count);
+
+// installs 'observer' to be told about every request (NULL removes it).
+// Returns the previous observer.
+CacheObserver set_block_cache_observer(CacheObserver observer);
+
+// writes every dirty block back to the software disk it belongs to, coalescing
+// consecutive blocks, and syncs the selected one.  Returns 1 on success or 0 on
+// failure.
+int flush_block_cache(void);
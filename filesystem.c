@@ -9,48 +9,92 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "softwaredisk.h"
+#include "blockcache.h"
 #include "filesystem.h"
 
 // GLOBALS
-FSError Error;
+//  ~~ The error code is per thread, 'Error' throughout this file
+_Thread_local FSError fserror;
+#define Error fserror
+
+// Block I/O statistics (counted atomically), and per thread the call I/O is
+//  attributed to and the layout telling regions apart (that of the volume in use)
+FSStats IOStats;
+_Thread_local FSOp IOStatsOp = FS_OP_NONE;
+_Thread_local FSInfo IOStatsLayout;
+
+// Mounted volumes, at most one per software disk
+Volume* Volumes = NULL;
+pthread_mutex_t VolumesLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The selected software disk is shared: the threads holding it (hold_disk) all
+//  use the same one, and those waiting to select another count in DiskWaiters
+pthread_mutex_t DiskLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t DiskReleased = PTHREAD_COND_INITIALIZER;
+unsigned long DiskHolders = 0;
+unsigned long DiskWaiters = 0;
 
 // create and open new file with pathname 'name' and access mode 'mode'.  Current file
 // position is set at byte 0.  Returns NULL on error. Always sets 'fserror' global.
 File create_file(char *name, FileMode mode)
 {
+	FS_STATS_SCOPE(FS_OP_CREATE);
+
 	Error = FS_NONE;
 
+	Volume* volume = current_volume();
+	if(volume == NULL)
+		return NULL;
+
+	FS_DISK_SCOPE(volume);
+	FS_VOLUME_SCOPE(volume);
+
 	// Check IF file already exists
-	if(file_exists(name))
+	if(find_file(volume, name) != NO_RECORD)
 	{
 		Error = FS_FILE_ALREADY_EXISTS;
 		return NULL;
 	}
 
-	// Find Free Data Block
-	unsigned int firstBlock = get_free_data_block();
-	if(Error == FS_OUT_OF_SPACE)
-		return NULL;
-
 	// Write File Record (sets Error if error)
-	unsigned int recordIndex = write_record_entry(name, firstBlock);
-	if(Error == FS_OUT_OF_SPACE)
+	//  ~~ An empty file takes nothing but its name records: its first bytes get
+	//     inline records after them, or a data block when they do not fit
+	unsigned long recordIndex = write_record_entry(volume, name);
+	if(recordIndex == NO_RECORD)
 		return NULL;
 
-	// Allocate Data Block
-	allocate_data_block(NULL, firstBlock);
-
-
 	// Construct the FileInternals
 	FileInternals* f = malloc(sizeof(FileInternals));
 
+	(*f).volume = volume;
 	(*f).recordNumber = recordIndex;
 	(*f).fileSize = 0;
 	(*f).filePos = 0;
-	(*f).startingBlock = firstBlock;
-	(*f).currentBlock = firstBlock;
+	(*f).startingBlock = FAT_END_OF_CHAIN;
+	(*f).currentBlock = FAT_END_OF_CHAIN;
 	(*f).mode = mode;
+	(*f).extentMap = NULL;
+	(*f).blockMap = NULL;
+	(*f).mappedBlocks = 0;
+	(*f).blockMapCapacity = 0;
+	(*f).inlineRecord = recordIndex + records_for_name(name);
+	(*f).inlineRecords = 0;
+	(*f).writeBuffer = NULL;
+	(*f).bufferedBytes = 0;
+	(*f).bufferStart = 0;
+	(*f).reservedBlocks = 0;
+	(*f).readAheadPos = 0;
+	(*f).readAheadBlocks = 0;
+	(*f).readAheadEnd = 0;
+	pthread_rwlock_init(&(*f).lock, NULL);
+	(*f).references = 1;
+
+	(*volume).openTable[recordIndex].refCount++;
+	(*volume).openTable[recordIndex].mode = mode;
+	(*volume).openTable[recordIndex].handle = f;
+	(*volume).openFiles++;
 
 	// Success!
 	return f;
@@ -60,149 +104,142 @@ File create_file(char *name, FileMode mode)
 // position is set at byte 0.  Returns NULL on error. Always sets 'fserror' global.
 File open_file(char *name, FileMode mode)
 {
-	Error = FS_NONE;
+	FS_STATS_SCOPE(FS_OP_OPEN);
 
-	#define numRecordBlocks info.numRecordBlocks
-	#define firstRecordBlock info.firstRecordBlock
+	Error = FS_NONE;
 
-	FSInfo info = get_fs_info();
+	Volume* volume = current_volume();
+	if(volume == NULL)
+		return NULL;
 
-	char* blockData;
+	FS_DISK_SCOPE(volume);
+	FS_VOLUME_SCOPE(volume);
 
 	// ========== RECORD CHECKING ==========
 	// =====================================
 
-	unsigned int nameLength = strlen(name);
-	unsigned char recordsRequired = (char)ceil(nameLength/23.0);
+	unsigned long recordNumber = find_file(volume, name);
 
-	unsigned int recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
+	// FILE NOT FOUND
+	if(recordNumber == NO_RECORD)
+	{
+		//printf("File Not Found: %s\n", name);
+		Error = FS_FILE_NOT_FOUND;
+		return NULL;
+	}
 
-	for(unsigned int blockIndex = 0; blockIndex < numRecordBlocks; blockIndex++)
+	// IF FILE IS OPEN
+	if(is_record_open(volume, recordNumber))
 	{
-		unsigned int absBlockNumber = blockIndex + firstRecordBlock;
+		Error = FS_FILE_OPEN;
+		printf("File Already Open: %s\n", name);
+		return NULL;
+	}
 
-		blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-		read_sd_block(blockData, absBlockNumber);
+	unsigned long absBlockNumber, entryOffset;
+	locate_record(&(*volume).info, recordNumber, &absBlockNumber, &entryOffset);
 
-		for(unsigned int recordIndex = 0; recordIndex < recordsPerBlock; recordIndex++)
-		{
-			unsigned int entryOffset = recordIndex * SIZE_OF_RECORD_ENTRY;
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	cache_read_block(blockData, absBlockNumber);
 
-			unsigned char fileAttr;
-			memcpy(&fileAttr, blockData + entryOffset, sizeof(char));
+	// Read Record Information into local vars
+	unsigned long firstBlock;
+	memcpy(&firstBlock, blockData + entryOffset + RECORD_FIRST_BLOCK_OFFSET, sizeof(unsigned long));
 
-			// END OF RECORDS, FILE NOT FOUND
-			if(fileAttr == 0)
-			{
-				//printf("File Not Found: %s\n", name);
-				Error = FS_FILE_NOT_FOUND;
-				return NULL;
-			}
+	unsigned long fileSize;
+	memcpy(&fileSize, blockData + entryOffset + RECORD_SIZE_OFFSET, sizeof(unsigned long));
 
-			// IF RECORD PRESENT
-			if(isNthBitSet(fileAttr, 0))
-			{
-				// IF RECORD IS PARENT
-				if(isNthBitSet(fileAttr, 1))
-				{
-					unsigned char numRecordsCurrent = fileAttr & 15;
-					if(numRecordsCurrent == recordsRequired)
-					{
-						unsigned char fileName[numRecordsCurrent*23];
-
-						for(unsigned int internalIndex = 0; internalIndex < numRecordsCurrent; internalIndex++)
-						{
-							memcpy((fileName + (internalIndex*23)), (blockData + entryOffset + (internalIndex*32) + 9), 23*sizeof(char));
-						}
-
-						// IF NAMES MATCH, FILE FOUND
-						if(!strcmp(fileName, name))
-						{
-							// IF FILE IS OPEN
-							if(isNthBitSet(fileAttr, 2))
-							{
-								Error = FS_FILE_OPEN;
-								printf("File Already Open: %s\n", name);
-								return NULL;
-							}
-
-
-							// Read Record Information into local vars
-							unsigned int firstBlock;
-							memcpy(&firstBlock, blockData + entryOffset + 1, sizeof(int));
-
-							unsigned int fileSize;
-							memcpy(&fileSize, blockData + entryOffset + 5, sizeof(int));
-
-							// Set Open Flag on this record
-							fileAttr |= 32;
-							memcpy(blockData + entryOffset, &fileAttr, sizeof(char));
-							write_sd_block(blockData, absBlockNumber);
-
-							// CONSTRUCT FILEINTERNALS
-							FileInternals* f = malloc(sizeof(FileInternals));
-
-							(*f).recordNumber = recordIndex + (blockIndex * recordsPerBlock);
-							(*f).fileSize = fileSize;
-							(*f).filePos = 0;
-							(*f).startingBlock = firstBlock;
-							(*f).currentBlock = firstBlock;
-							(*f).mode = mode;
-
-							// Return FileInternal
-							printf("File Opened: %s\n", name);
-							return f;
-						}
-					}
-				}
-			}
-		}
-	
-		// FREE THE BUFFER!
-		free(blockData);
+	unsigned char fileAttr;
+	memcpy(&fileAttr, blockData + entryOffset, sizeof(char));
+
+	// Inline File: firstBlock is its number of inline data records (none while empty)
+	unsigned long inlineRecords = 0;
+	unsigned long inlineRecord = 0;
+
+	if(fileAttr & RECORD_INLINE_FLAG)
+	{
+		inlineRecords = firstBlock;
+		inlineRecord = recordNumber + name_records_of(blockData + entryOffset);
+		firstBlock = FAT_END_OF_CHAIN;
 	}
 
-	#undef numRecordBlocks
-	#undef firstRecordBlock
-}
+	// Extent File: firstBlock is the root of its tree
+	ExtentMap* extentMap = NULL;
+	unsigned long currentBlock = firstBlock;
 
-// close 'file'.  Always sets 'fserror' global.
-void close_file(File file)
-{
-	Error = FS_NONE;
+	if(firstBlock != FAT_END_OF_CHAIN && ((*volume).info.features & FS_FEATURE_EXTENTS))
+	{
+		extentMap = load_extent_map(volume, firstBlock);
+		if(extentMap == NULL)
+		{
+			printf("Internal FileSystem Error - Failed to Read Extent Tree: %s\n", name);
+			sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+			return NULL;
+		}
 
-	#define firstRecordBlock info.firstRecordBlock
-	FSInfo info = get_fs_info();
+		currentBlock = extent_lookup(extentMap, 0);
+	}
 
-	unsigned int recordNumber = (*file).recordNumber;
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
 
-	unsigned int recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
-	unsigned int blockIndex = recordNumber / recordsPerBlock;
-	unsigned int recordIndex = recordNumber - (blockIndex * recordsPerBlock);
-	unsigned int recordOffset = recordIndex * SIZE_OF_RECORD_ENTRY;
+	// CONSTRUCT FILEINTERNALS
+	FileInternals* f = malloc(sizeof(FileInternals));
 
-	// Read Block with recordNumber in it
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-	read_sd_block(blockData, blockIndex + firstRecordBlock);
+	(*f).volume = volume;
+	(*f).recordNumber = recordNumber;
+	(*f).fileSize = fileSize;
+	(*f).filePos = 0;
+	(*f).startingBlock = firstBlock;
+	(*f).currentBlock = currentBlock;
+	(*f).mode = mode;
+	(*f).extentMap = extentMap;
+	(*f).blockMap = NULL;
+	(*f).mappedBlocks = 0;
+	(*f).blockMapCapacity = 0;
+	(*f).inlineRecord = inlineRecord;
+	(*f).inlineRecords = inlineRecords;
+	(*f).writeBuffer = NULL;
+	(*f).bufferedBytes = 0;
+	(*f).bufferStart = 0;
+	(*f).reservedBlocks = 0;
+	(*f).readAheadPos = 0;
+	(*f).readAheadBlocks = 0;
+	(*f).readAheadEnd = 0;
+	pthread_rwlock_init(&(*f).lock, NULL);
+	(*f).references = 1;
+
+	if(firstBlock != FAT_END_OF_CHAIN && extentMap == NULL)
+		append_block_map(f, firstBlock);
+
+	// Open in the table only, the record is not written
+	(*volume).openTable[recordNumber].refCount++;
+	(*volume).openTable[recordNumber].mode = mode;
+	(*volume).openTable[recordNumber].handle = f;
+	(*volume).openFiles++;
+
+	// Return FileInternal
+	printf("File Opened: %s\n", name);
+	return f;
+}
 
-	unsigned char fileAttr;
-	memcpy(&fileAttr, blockData + recordOffset, sizeof(char));
+// close 'file', writing the appends it buffered first.  If they cannot all be
+// written the file is closed anyway and 'fserror' says why.  'file' is invalid
+// once this returns.  Always sets 'fserror' global.
+void close_file(File file)
+{
+	FS_STATS_SCOPE(FS_OP_CLOSE);
 
-	// IF FILE IS OPEN
-	if(isNthBitSet(fileAttr, 2))
-	{
-		fileAttr = fileAttr & ~(32);
-		memcpy(blockData + recordOffset, &fileAttr, sizeof(char));
+	Error = FS_NONE;
 
-		write_sd_block(blockData, blockIndex + firstRecordBlock);
-	}
-	else
+	if(file == NULL)
 	{
 		Error = FS_FILE_NOT_OPEN;
+		return;
 	}
 
-	free(blockData);
-	#undef firstRecordBlock
+	// The opener's reference, the handle goes once sync_volumes is done with it too
+	if(close_handle((*file).volume, file) == 1)
+		release_file(file);
 }
 
 // read at most 'numbytes' of data from 'file' into 'buf', starting at the 
@@ -211,16 +248,22 @@ void close_file(File file)
 // 'fserror' global.
 unsigned long read_file(File file, void *buf, unsigned long numbytes)
 {
-	#define firstDataBlock info.firstDataBlock
-
-	FSInfo info = get_fs_info();
-
+	FS_STATS_SCOPE(FS_OP_READ);
 
 	Error = FS_NONE;
 
-	unsigned int recordNumber = (*file).recordNumber;
+	if(file == NULL)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
+	}
+
+	// The position, read-ahead and block map of the handle move, nothing of the volume
+	Volume* volume = (*file).volume;
+	FS_DISK_SCOPE(volume);
+	FS_FILE_SCOPE(file, 1);
 
-	if(is_open(recordNumber) == 0)
+	if(is_open(volume, file) == 0)
 	{
 		Error = FS_FILE_NOT_OPEN;
 		return 0;
@@ -228,356 +271,316 @@ unsigned long read_file(File file, void *buf, unsigned long numbytes)
 
 	// IF READ REQUEST IS BIGGER THAN FILE
 	//  READ TO END OF FILE.
-	if((*file).fileSize < ((*file).filePos + numbytes));
+	if((*file).filePos >= (*file).fileSize)
+		return 0;
+	if((*file).fileSize < ((*file).filePos + numbytes))
 		numbytes = (*file).fileSize - (*file).filePos;
 
-	// Position in Current Block
-	unsigned int relativePos = (*file).filePos % SOFTWARE_DISK_BLOCK_SIZE;
-
-	unsigned int bytesRead = 0;
-
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-
-	// READ CURRENT DATA BLOCK
-	unsigned int currentBlockIndex = (*file).currentBlock;
-	read_sd_block(blockData, currentBlockIndex + firstDataBlock);
-
-	// NEXT BLOCK VALUE
-	unsigned int nextBlock = get_next_data_block(currentBlockIndex);
-
-	// More than 1 Read?
-	int readOverflow = numbytes - (SOFTWARE_DISK_BLOCK_SIZE - relativePos);
-
-	// SINGLE READ
-	if(readOverflow <= 0) {
-		// COPY TO BUF, FROM BLOCKDATA+RELATIVEPOS, NUMBYTES
-		memcpy(buf, blockData + relativePos, numbytes);
-
-		// UPDATE BYTES WRITTEN
-		bytesRead += numbytes;
-	}
-	// MULTIPLE READS
-	else
+	// INLINE FILE, THE BYTES ARE IN ITS RECORDS
+	if(is_inline(file))
 	{
-		unsigned int numReads = (int)ceil(readOverflow / SOFTWARE_DISK_BLOCK_SIZE);
-
-		// ========== FIRST READ ==========
-		// =================================
-			// COPY TO BUF, FROM BLOCKDATA+RELATIVEPOS, (SDBS - RELATIVEPOS) BYTES
-			memcpy(buf, blockData + relativePos, (SOFTWARE_DISK_BLOCK_SIZE - relativePos));
-
-			// UPDATE BYTES WRITTEN
-			bytesRead += (SOFTWARE_DISK_BLOCK_SIZE - relativePos);
-
-
-		// =========== LOOPING READ ===========
-		// =====================================
-			for(int i = 1; i < numReads; i++)
-			{
-
-			// ========== CONTEXT SWITCHING ==========
-			// =======================================
-				// IS END-OF-FILE
-				if(nextBlock == 0xFFFFFFFF)
-				{
-					// DO NOT READ PAST EOF
-					break;
-				}
-				// NOT END-OF-FILE
-				else
-				{
-					// SWITCH CONTEXT TO NEXT BLOCK
-					currentBlockIndex = nextBlock;
-					nextBlock = get_next_data_block(currentBlockIndex);
-				}
-
-			// ========== DATA READING ==========
-			// ==================================
-				// READ NEW DATA BLOCK INTO BUFFER
-				read_sd_block(blockData, currentBlockIndex + firstDataBlock);
-
-					// MORE THAN FULL BLOCK LEFT
-					if((numbytes - bytesRead) > SOFTWARE_DISK_BLOCK_SIZE)
-					{
-						// COPY SW_D_BLK_SIZE TO BUF
-						memcpy(buf, blockData, SOFTWARE_DISK_BLOCK_SIZE);
-
-						// INCREMENT BYTES WRITTEN
-						bytesRead += SOFTWARE_DISK_BLOCK_SIZE;
-					}
-					// LESS THAN FULL BLOCK LEFT
-					else
-					{
-						// COPY (NUMBYTES - BYTESWRITTEN) TO BUFFER
-						memcpy(buf, blockData, (numbytes - bytesRead));
-
-						// INCREMENT BYTES WRITTEN
-						bytesRead += (numbytes - bytesRead);
-					}
-			}
+		transfer_inline(volume, file, buf, (*file).filePos, numbytes, 0);
+		(*file).filePos += numbytes;
+		return numbytes;
 	}
 
-	free(blockData);
+	unsigned long startPos = (*file).filePos;
+	unsigned long bytesRead = read_blocks(volume, file, buf, numbytes, startPos, &(*file).currentBlock);
+
+	read_ahead(volume, file, startPos, block_index_of(startPos + bytesRead), (*file).currentBlock);
 
 	(*file).filePos += bytesRead;
+	(*file).readAheadPos = (*file).filePos;
 
 	return bytesRead;
-
-	#undef firstDataBlock
 }
 
+
 // write 'numbytes' of data from 'buf' into 'file' at the current file position. 
 // Returns the number of bytes written. On an out of space error, the return value may be
 // less than 'numbytes'.  Always sets 'fserror' global.
 unsigned long write_file(File file, void *buf, unsigned long numbytes)
 {
+	FS_STATS_SCOPE(FS_OP_WRITE);
+
 	Error = FS_NONE;
 
-	if((*file).mode == READ_ONLY)
+	if(file == NULL)
 	{
-		Error = FS_FILE_READ_ONLY;
+		Error = FS_FILE_NOT_OPEN;
 		return 0;
 	}
 
-	#define firstDataBlock info.firstDataBlock
-	#define firstRecordBlock info.firstRecordBlock
-	#define firstFatBlock info.firstFatBlock
+	Volume* volume = (*file).volume;
+	FS_DISK_SCOPE(volume);
+	FS_FILE_SCOPE(file, 1);
+	FS_VOLUME_SCOPE(volume);
 
-	FSInfo info = get_fs_info();
+	if(is_open(volume, file) == 0)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
+	}
 
-	unsigned int recordNumber = (*file).recordNumber;
+	if((*file).mode == READ_ONLY)
+	{
+		Error = FS_FILE_READ_ONLY;
+		return 0;
+	}
 
-	// ======== GET METADATA =========
-	// ===============================
+	// DELAYED ALLOCATION: APPENDS COLLECT IN THE HANDLE'S BUFFER
+	if(buffer_write(volume, file, buf, numbytes) == 1)
+		return numbytes;
 
-		// READ FILE RECORD BLOCK
-		unsigned int recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
-		unsigned int blockIndex = recordNumber / recordsPerBlock;
-		unsigned int recordIndex = recordNumber - (blockIndex * recordsPerBlock);
-		unsigned int recordOffset = recordIndex * SIZE_OF_RECORD_ENTRY;
+	// ANYTHING ELSE GOES TO THE FILE, AFTER WHAT WAS BUFFERED
+	if(flush_write_buffer(volume, file) != 1)
+		return 0;
 
-		char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-		read_sd_block(blockData, blockIndex + firstRecordBlock);
+	return write_through(volume, file, buf, numbytes);
+}
 
-		// GET FILE ATTRIBUTES
-		unsigned int fileAttr;
-		memcpy(&fileAttr, blockData + recordOffset, sizeof(char));
+// writes the appends 'file' has buffered to it, allocating their blocks (at
+// once, so they can be contiguous) and updating its size once.  Returns 1 on
+// success, 0 on failure. Always sets 'fserror' global.
+int flush_file(File file)
+{
+	FS_STATS_SCOPE(FS_OP_FLUSH);
 
-		// IF -- FILE IS NOT OPEN
-		if(!isNthBitSet(fileAttr, 2))
-		{
-			Error = FS_FILE_NOT_OPEN;
-			return 0;
-		}
+	Error = FS_NONE;
 
-	// Position in Current Block
-	unsigned int relativePos = (*file).filePos % SOFTWARE_DISK_BLOCK_SIZE;
+	if(file == NULL)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
+	}
 
-	unsigned int bytesWritten = 0;
+	Volume* volume = (*file).volume;
+	FS_DISK_SCOPE(volume);
+	FS_FILE_SCOPE(file, 1);
+	FS_VOLUME_SCOPE(volume);
 
-	// READ CURRENT DATA BLOCK
-	unsigned int currentBlockIndex = (*file).currentBlock;
-	read_sd_block(blockData, currentBlockIndex + firstDataBlock);
+	if(is_open(volume, file) == 0)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
+	}
 
-	// NEXT BLOCK VALUE
-	unsigned int currentVal = get_next_data_block(currentBlockIndex);
+	if(flush_write_buffer(volume, file) != 1)
+		return 0;
 
-	// More than 1 Write?
-	int writeOverflow = numbytes - (SOFTWARE_DISK_BLOCK_SIZE - relativePos);
+	return flush_volume(volume);
+}
 
-	// SINGLE WRITE
-	if(writeOverflow <= 0) {
-		// COPY TO BLOCKDATA+RELATIVEPOS, FROM *BUF, NUMBYTES
-		memcpy(blockData + relativePos, buf, numbytes);
+// read at most 'numbytes' of data from 'file' into 'buf', starting at byte 'offset'.
+// The current file position is neither used nor changed.  Returns the number of
+// bytes read. Always sets 'fserror' global.
+unsigned long read_file_at(File file, void *buf, unsigned long numbytes, unsigned long offset)
+{
+	FS_STATS_SCOPE(FS_OP_READ_AT);
 
-		// WRITE THE BLOCK
-		write_sd_block(blockData, currentBlockIndex + firstDataBlock);
+	Error = FS_NONE;
 
-		// UPDATE BYTES WRITTEN
-		bytesWritten += numbytes;
+	if(file == NULL)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
 	}
-	// MULTIPLE WRITES
-	else {
-	
-		unsigned int numWrites = (int)ceil(writeOverflow / SOFTWARE_DISK_BLOCK_SIZE);
 
-		// ========== FIRST WRITE ==========
-		// =================================
-			// COPY TO BLOCKDATA+RELATIVEPOS, FROM *BUF, (SDBS - RELATIVEPOS) BYTES
-			memcpy(blockData + relativePos, buf, (SOFTWARE_DISK_BLOCK_SIZE - relativePos));
+	// SHARED WITH OTHER READERS UNLESS THE HANDLE HAS TO CHANGE
+	Volume* volume = (*file).volume;
+	FS_DISK_SCOPE(volume);
+	FS_FILE_SCOPE(file, 0);
 
-			// WRITE THE BLOCK
-			write_sd_block(blockData, currentBlockIndex + firstDataBlock);
+	if(reads_in_place(file, offset, numbytes) == 0)
+	{
+		pthread_rwlock_unlock(&(*file).lock);
+		pthread_rwlock_wrlock(&(*file).lock);
+	}
 
-			// UPDATE BYTES WRITTEN
-			bytesWritten += (SOFTWARE_DISK_BLOCK_SIZE - relativePos);
+	if(is_open(volume, file) == 0)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
+	}
 
+	// BUFFERED APPENDS ARE NOT IN THE FILE YET
+	if((*file).bufferedBytes != 0 && offset + numbytes > (*file).bufferStart)
+	{
+		FS_VOLUME_SCOPE(volume);
 
-		// =========== LOOPING WRITE ===========
-		// =====================================
-			for(int i = 1; i < numWrites; i++)
-			{
+		if(flush_write_buffer(volume, file) != 1)
+			return 0;
+	}
 
-			// ========== CONTEXT SWITCHING ==========
-			// =======================================
-				// IS END-OF-FILE
-				if(currentVal == 0xFFFFFFFF)
-				{
-					// ATTEMPT TO FIND A FREE BLOCK
-					unsigned int nextBlockIndex = get_free_data_block();
-						if(nextBlockIndex = 0xFFFFFFFF)
-						{
-							Error = FS_OUT_OF_SPACE;
-							break;
-						}
-
-					// ATTEMPT TO ALLOCATE A DATA BLOCK WITH CURRENTBLOCK AS PARENT
-					unsigned int success = allocate_data_block(&currentBlockIndex, nextBlockIndex);
-						if(success != 1)
-						{
-							printf("Internal FileSystem Error - Failed to Allocate Next Block\n");
-							break;
-						}
-
-					// SWITCH CURRENTBLOCK CONTEXT TO NEWLY ALLOCATED BLOCK
-					currentBlockIndex = nextBlockIndex;
-					currentVal = get_next_data_block(currentBlockIndex);
-				}
-				// NOT END-OF-FILE
-				else
-				{
-					// SWITCH CONTEXT TO NEXT BLOCK
-					currentBlockIndex = currentVal;
-					currentVal = get_next_data_block(currentBlockIndex);
-				}
+	// READ TO END OF FILE AT MOST
+	if(offset >= (*file).fileSize)
+		return 0;
+	if((*file).fileSize < (offset + numbytes))
+		numbytes = (*file).fileSize - offset;
 
-			// ========== DATA WRITING ==========
-			// ==================================
-				// READ NEW DATA BLOCK INTO BUFFER
-				read_sd_block(blockData, currentBlockIndex + firstDataBlock);
+	// INLINE FILE, THE BYTES ARE IN ITS RECORDS
+	if(is_inline(file))
+	{
+		transfer_inline(volume, file, buf, offset, numbytes, 0);
+		return numbytes;
+	}
 
-					// MORE THAN FULL BLOCK LEFT
-					if((numbytes - bytesWritten) > SOFTWARE_DISK_BLOCK_SIZE)
-					{
-						// COPY SW_D_BLK_SIZE TO BUFFER
-						memcpy(blockData, buf, SOFTWARE_DISK_BLOCK_SIZE);
+	// Inside the file nothing is allocated, the block comes from the block map or extents
+	unsigned long blockIndex;
+	if(position_file(volume, file, offset, &blockIndex) != 1)
+		return 0;
 
-						// WRITE BLOCK
-						write_sd_block(blockData, currentBlockIndex + firstDataBlock);
+	return read_blocks(volume, file, buf, numbytes, offset, &blockIndex);
+}
 
-						// INCREMENT BYTES WRITTEN
-						bytesWritten += SOFTWARE_DISK_BLOCK_SIZE;
-					}
-					// LESS THAN FULL BLOCK LEFT
-					else
-					{
-						// COPY (NUMBYTES - BYTESWRITTEN) TO BUFFER
-						memcpy(blockData, buf, (numbytes - bytesWritten));
+// write 'numbytes' of data from 'buf' into 'file' at byte 'offset', extending the
+// file as a seek there would.  The current file position is neither used nor
+// changed.  Returns the number of bytes written. Always sets 'fserror' global.
+unsigned long write_file_at(File file, void *buf, unsigned long numbytes, unsigned long offset)
+{
+	FS_STATS_SCOPE(FS_OP_WRITE_AT);
 
-						// WRITE BLOCK
-						write_sd_block(blockData, currentBlockIndex + firstDataBlock);
+	Error = FS_NONE;
 
-						// INCREMENT BYTES WRITTEN
-						bytesWritten += (numbytes - bytesWritten);
-					}
-			}
+	if(file == NULL)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
+	}
+
+	Volume* volume = (*file).volume;
+	FS_DISK_SCOPE(volume);
+	FS_FILE_SCOPE(file, 1);
+	FS_VOLUME_SCOPE(volume);
 
+	if(is_open(volume, file) == 0)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
 	}
 
-	// CHECK FOR FILE SIZE INCREASE
-	if(((*file).filePos + bytesWritten) > (*file).fileSize)
+	if((*file).mode == READ_ONLY)
 	{
-		(*file).fileSize = (*file).filePos + bytesWritten;
-		update_file_size(recordNumber, (*file).fileSize);
+		Error = FS_FILE_READ_ONLY;
+		return 0;
 	}
 
-	(*file).filePos += bytesWritten;
+	// BUFFERED APPENDS GO FIRST, THEY MAY BE OVERWRITTEN
+	if(flush_write_buffer(volume, file) != 1)
+		return 0;
 
-	free(blockData);
-	
-	return bytesWritten;
+	// INLINE FILE: WRITTEN IN ITS RECORDS WHILE IT FITS, MOVED TO A DATA BLOCK OTHERWISE
+	if(is_inline(file))
+	{
+		if(grow_inline_file(volume, file, offset + numbytes) == 1)
+		{
+			transfer_inline(volume, file, buf, offset, numbytes, 1);
 
-	#undef firstDataBlock
-	#undef firstRecordBlock
-	#undef firstFatBlock
+			if(offset + numbytes > (*file).fileSize)
+			{
+				(*file).fileSize = offset + numbytes;
+				update_file_size(volume, (*file).recordNumber, (*file).fileSize);
+			}
+
+			return numbytes;
+		}
+
+		if(promote_inline_file(volume, file) != 1)
+			return 0;
+	}
+
+	unsigned long blockIndex;
+	if(position_file(volume, file, offset, &blockIndex) != 1)
+		return 0;
+
+	return write_blocks(volume, file, buf, numbytes, offset, &blockIndex);
 }
 
 // sets current position in file to 'bytepos', always relative to the beginning of file.
 // Seeks past the current end of file should extend the file. Always sets 'fserror'
 // global.
+//  ~~ currentBlock is the block holding the byte BEFORE filePos, so a position on a
+//     block boundary stays in the earlier block and never needs a block allocated
+//     beyond the end of the data
+//  ~~ Files are sparse: nothing is allocated, currentBlock is FAT_END_OF_CHAIN in a
+//     hole, and read_file/write_file resolve holes themselves
 void seek_file(File file, unsigned long bytepos)
 {
+	FS_STATS_SCOPE(FS_OP_SEEK);
+
 	Error = FS_NONE;
-	unsigned int recordNumber = (*file).recordNumber;
 
-	if(is_open(recordNumber) == 0)
+	if(file == NULL)
 	{
 		Error = FS_FILE_NOT_OPEN;
 		return;
 	}
 
-	unsigned int fileSize = (*file).fileSize;
+	Volume* volume = (*file).volume;
+	FS_DISK_SCOPE(volume);
+	FS_FILE_SCOPE(file, 1);
+	FS_VOLUME_SCOPE(volume);
 
-	unsigned int startingBlock = (*file).startingBlock;
-	unsigned int currentBlock = startingBlock;
+	if(is_open(volume, file) == 0)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return;
+	}
 
-	// How many blocks we are seeking into
-	unsigned int numBlocks = bytepos / SOFTWARE_DISK_BLOCK_SIZE;
+	// Buffered appends land before the position moves
+	if(flush_write_buffer(volume, file) != 1)
+		return;
 
-	// Offset into last block
-	unsigned int byteOffset = bytepos - (numBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+	unsigned long fileSize = (*file).fileSize;
 
-	// LOOP TO GET CURRENT BLOCK
-	for(int i = 0; i < numBlocks; i++)
+	// INLINE FILE: ONLY THE POSITION MOVES WHILE IT FITS (NEW RECORDS START ZEROIZED)
+	if(is_inline(file))
 	{
-		// GET CHILD BLOCK
-		unsigned int next = get_next_data_block(currentBlock);
-
-		// IF CHILD 0XFFFFFFFF (EOF)
-		if(next == 0XFFFFFFFF)
+		if(grow_inline_file(volume, file, bytepos) == 1)
 		{
-			// FIND NEXT FREE BLOCK
-			unsigned int freeBlock = get_free_data_block();
-				if(freeBlock == 0xFFFFFFFF)
-				{
-					Error = FS_OUT_OF_SPACE;
-
-					// CALCULATE TOTAL SPACE ALLOCATED VIA SEEK
-					unsigned int totalSize = (i+1) * SOFTWARE_DISK_BLOCK_SIZE;
-
-					// IF TOTAL SPACE EXCEEDED OLD FILE SIZE, UPDATE FILE SIZE
-					if(totalSize > fileSize)
-						update_file_size((*file).recordNumber, totalSize);
-
-					return;
-				}
-
-			// ALLOCATE
-			allocate_data_block(&currentBlock, freeBlock);
+			if(bytepos > fileSize)
+			{
+				(*file).fileSize = bytepos;
+				update_file_size(volume, (*file).recordNumber, bytepos);
+			}
 
-			// CONTEXT SWITCH
-			currentBlock = freeBlock;
-		}
-		else
-		{
-			// JUST CONTEXT SWITCH
-			currentBlock = next;
+			(*file).filePos = bytepos;
+			return;
 		}
+
+		if(promote_inline_file(volume, file) != 1)
+			return;
 	}
 
-	// UPDATE FILEINTERNALS
-	if(bytepos > fileSize)
-		update_file_size((*file).recordNumber, bytepos);
+	// RESOLVE (AND GROW THE FILE TO) THE TARGET, THEN MOVE THERE
+	unsigned long currentBlock;
+	if(position_file(volume, file, bytepos, &currentBlock) != 1)
+		return;
 
 	(*file).currentBlock = currentBlock;
-
 	(*file).filePos = bytepos;
 }
 
 // returns the current length of the file in bytes. Always sets 'fserror' global.
 unsigned long file_length(File file)
 {
+	FS_STATS_SCOPE(FS_OP_LENGTH);
+
+	Error = FS_NONE;
+
+	if(file == NULL)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
+	}
 
+	FS_FILE_SCOPE(file, 0);
+
+	if(is_open((*file).volume, file) == 0)
+	{
+		Error = FS_FILE_NOT_OPEN;
+		return 0;
+	}
 
 	return (*file).fileSize;
 }
@@ -587,130 +590,118 @@ unsigned long file_length(File file)
 // Always sets 'fserror' global.   
 int delete_file(char *name)
 {
-	#define numFatBlocks info.numFatBlocks
-	#define numRecordBlocks info.numRecordBlocks
-	#define firstFatBlock info.firstFatBlock
-	#define firstRecordBlock info.firstRecordBlock
-
-	FSInfo info = get_fs_info();
+	FS_STATS_SCOPE(FS_OP_DELETE);
 
 	Error = FS_NONE;
 
-	unsigned int recordNumber = find_file(name);
+	Volume* volume = current_volume();
+	if(volume == NULL)
+		return 0;
+
+	FS_DISK_SCOPE(volume);
+	FS_VOLUME_SCOPE(volume);
 
-	if (recordNumber == 0xFFFFFFFF)
+	unsigned long recordNumber = find_file(volume, name);
+
+	if (recordNumber == NO_RECORD)
 	{
 		//printf("Failed to delete %s - File Not Found\n", name);
 		Error = FS_FILE_NOT_FOUND;
 		return 0;
 	}
 
-	unsigned int recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
-	unsigned int blockIndex = recordNumber / recordsPerBlock;
-	unsigned int recordIndex = recordNumber - (blockIndex * recordsPerBlock);
-	unsigned int recordOffset = recordIndex * SIZE_OF_RECORD_ENTRY;
-
-	unsigned int absBlockNumber = blockIndex + firstRecordBlock;
-
-	// Get Record Block
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-	read_sd_block(blockData, absBlockNumber);
-
-	// Check if File is Open
-	unsigned char fileAttr;
-	memcpy(&fileAttr, blockData + recordOffset, sizeof(char));
-
 	// IF FILE IS OPEN
-	if(isNthBitSet(fileAttr, 2))
+	if(is_record_open(volume, recordNumber))
 	{
 		//printf("Failed to delete %s - File Open\n", name);
 		Error = FS_FILE_OPEN;
-		free(blockData);
 		return 0;
 	}
 
+	unsigned long absBlockNumber, recordOffset;
+	locate_record(&(*volume).info, recordNumber, &absBlockNumber, &recordOffset);
+
+	// Get Record Block
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	cache_read_block(blockData, absBlockNumber);
+
+	unsigned char fileAttr;
+	memcpy(&fileAttr, blockData + recordOffset, sizeof(char));
+
 	// Bit-Mask for number of records for this File
 	unsigned int numRecords = fileAttr & 15;
 
 	// Store Data Block index for clearing later
-	unsigned int firstBlock;
-	memcpy(&firstBlock, blockData + recordOffset + 1, sizeof(int));
-
-	// Store File Size to index data deletion
-	unsigned int fileSize;
-	memcpy(&fileSize, blockData + recordOffset + 5, sizeof(int));
-	unsigned int numBlocks = (int)ceil(fileSize + 0.001 / SOFTWARE_DISK_BLOCK_SIZE);
+	unsigned long firstBlock;
+	memcpy(&firstBlock, blockData + recordOffset + RECORD_FIRST_BLOCK_OFFSET, sizeof(unsigned long));
 
 	// Zeroizing the records (deletion)
-	char* zeroize = calloc(numRecords * SIZE_OF_RECORD_ENTRY, sizeof(char));
-	memcpy(blockData + recordOffset, zeroize, sizeof(zeroize));
+	memset(blockData + recordOffset, 0, numRecords * SIZE_OF_RECORD_ENTRY);
 
 	// Writing changes to Record Block
-	write_sd_block(blockData, absBlockNumber);
+	cache_write_block(blockData, absBlockNumber);
 
-	// Calculate block holding FAT entry
-	unsigned int entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_FAT_ENTRY;
-	blockIndex = firstBlock / entriesPerBlock;
-	unsigned int entryIndex = firstBlock - (blockIndex * entriesPerBlock);
-	unsigned int entryOffset = entryIndex * SIZE_OF_FAT_ENTRY;
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
 
-	absBlockNumber = blockIndex + firstFatBlock;
+	release_records(volume, recordNumber, numRecords);
 
-	read_sd_block(blockData, absBlockNumber);
+	if((*volume).info.numIndexBlocks != 0)
+		index_remove(volume, name, recordNumber);
 
-	unsigned int currentValue;
-	memcpy(&currentValue, blockData + entryOffset, sizeof(int));
+	// Inline File, nothing beyond its records
+	if(fileAttr & RECORD_INLINE_FLAG)
+		return 1;
 
-	for(int i = 0; i < numBlocks; i++)
+	// Free every block of the extents and their tree
+	if((*volume).info.features & FS_FEATURE_EXTENTS)
 	{
-		if(currentValue != 0xFFFFFFFF)
-		{
-			// Zeroize value of current FAT entry
-			unsigned int zero = 0x00000000;
-			memcpy(blockData + entryOffset, &zero, sizeof(int));
-			write_sd_block(blockData, absBlockNumber);
+		ExtentMap* extentMap = load_extent_map(volume, firstBlock);
 
-			// Calculate new offsets
-			blockIndex = currentValue / entriesPerBlock;
-			entryIndex = firstBlock - (blockIndex * entriesPerBlock);
-			entryOffset = entryIndex * SIZE_OF_FAT_ENTRY;
+		if(extentMap != NULL)
+			free_extent_blocks(volume, extentMap);
+		else
+			printf("Internal FileSystem Error - Failed to Read Extent Tree: %s\n", name);
 
-			absBlockNumber = blockIndex + firstFatBlock;
+		free_extent_map(extentMap);
+		return 1;
+	}
 
-			// Read FAT block with currentValue
-			read_sd_block(blockData, absBlockNumber);
+	// Free every block of the chain
+	unsigned long currentValue = firstBlock;
 
-			// Get next value
-			memcpy(&currentValue, blockData + entryOffset, sizeof(int));
-		}
-		else
-		{
-			// Zeroize value of current FAT entry
-			unsigned int zero = 0x00000000;
-			memcpy(blockData + entryOffset, &zero, sizeof(int));
-			write_sd_block(blockData, absBlockNumber);
+	while(currentValue != FAT_END_OF_CHAIN)
+	{
+		unsigned long nextValue = get_next_data_block(volume, currentValue);
 
-			//printf("Successfully deleted %s\n", name);
-			free(blockData);
-			return 1;
-		}
+		// Zeroize value of current FAT entry
+		write_fat_entry(volume, currentValue, 0);
 
-		printf("Unknown Error 600\n");
+		// Holes have no block to free
+		currentValue = fat_next(nextValue);
 	}
 
-	#undef numFatBlocks
-	#undef numRecordBlocks
-	#undef firstFatBlock
-	#undef firstRecordBlock
+	//printf("Successfully deleted %s\n", name);
+	return 1;
 }
 
 // determines if a file with 'name' exists and returns 1 if it exists, otherwise 0.
 // Always sets 'fserror' global.
 int file_exists(char *name)
 {
-	unsigned int exists = find_file(name);
+	FS_STATS_SCOPE(FS_OP_EXISTS);
 
-	if(exists != 0xFFFFFFFF)
+	Error = FS_NONE;
+
+	Volume* volume = current_volume();
+	if(volume == NULL)
+		return 0;
+
+	FS_DISK_SCOPE(volume);
+	FS_VOLUME_SCOPE(volume);
+
+	unsigned long exists = find_file(volume, name);
+
+	if(exists != NO_RECORD)
 	{
 		return 1;
 	}
@@ -720,6 +711,209 @@ int file_exists(char *name)
 	}
 }
 
+// writes the resident FAT and every dirty cached block of each volume back to
+//  its software disk and syncs it.  Returns 1 on success, 0 on failure.
+int fs_sync(void)
+{
+	FS_STATS_SCOPE(FS_OP_SYNC);
+
+	Error = FS_NONE;
+
+	return sync_volumes();
+}
+
+// sets the number of blocks kept in the block cache (flushes it first).
+//  Returns 1 on success, 0 on failure.
+int fs_set_cache_capacity(unsigned long blocks)
+{
+	Error = FS_NONE;
+
+	// Whatever the cache holds is written back first
+	SDDevice* held = hold_disk(selected_disk());
+	int success = init_block_cache(blocks);
+	release_disk(&held);
+
+	return success;
+}
+
+// mounts the filesystem on software disk 'device' (NULL: the selected one)
+//  and selects that disk.  Returns the volume already mounted there, if any
+Volume* fs_mount(struct SDDevice* device)
+{
+	Error = FS_NONE;
+
+	if(device == NULL)
+		device = selected_disk();
+
+	pthread_mutex_lock(&VolumesLock);
+
+	for(Volume* volume = Volumes; volume != NULL; volume = (*volume).next)
+	{
+		if((*volume).device == device)
+		{
+			pthread_mutex_unlock(&VolumesLock);
+			SDDevice* held = activate_volume(volume);
+			release_disk(&held);
+			return volume;
+		}
+	}
+
+	Volume* volume = mount_volume(device);
+
+	pthread_mutex_unlock(&VolumesLock);
+
+	return volume;
+}
+
+// Mounts the filesystem on 'device' (fs_mount with VolumesLock held)
+//  Returns NULL (Error set) if it holds none
+Volume* mount_volume(struct SDDevice* device)
+{
+	Volume* volume = calloc(1, sizeof(Volume));
+	if(volume == NULL)
+		return NULL;
+
+	(*volume).device = device;
+	FS_DISK_SCOPE(volume);
+
+	// The only read of block 0 for the life of the volume
+	if(get_fs_info(&(*volume).info) != 1)
+	{
+		Error = FS_NO_FILESYSTEM;
+		free(volume);
+		return NULL;
+	}
+
+	set_stats_layout(volume);
+
+	// ...and of the FAT
+	if(load_fat(volume) != 1)
+	{
+		free(volume);
+		return NULL;
+	}
+
+	// Nothing is open yet, whatever old records say
+	unsigned long numRecords = (*volume).info.numRecordBlocks * (SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY);
+	(*volume).openTable = calloc(numRecords, sizeof(OpenRecord));
+
+	if((*volume).openTable == NULL || build_used_map(volume) != 1 || build_free_runs(volume) != 1)
+	{
+		sd_free_buffer((*volume).fat, (*volume).info.numFatBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+		free((*volume).fatDirty);
+		free((*volume).usedMap);
+		free((*volume).openTable);
+		drop_free_runs(volume);
+		free(volume);
+		return NULL;
+	}
+
+	// Resident FAT changes still reach the disk if nothing syncs them
+	static int registered = 0;
+	if(!registered)
+	{
+		atexit(sync_at_exit);
+		registered = 1;
+	}
+
+	pthread_mutex_init(&(*volume).lock, NULL);
+
+	(*volume).next = Volumes;
+	Volumes = volume;
+
+	return volume;
+}
+
+// writes back and forgets 'volume', which must have no open files.
+//  Returns 1 on success, 0 on failure.
+int fs_unmount(Volume* volume)
+{
+	Error = FS_NONE;
+
+	pthread_mutex_lock(&VolumesLock);
+	SDDevice* held = activate_volume(volume);
+	pthread_mutex_lock(&(*volume).lock);
+
+	if((*volume).openFiles > 0)
+	{
+		Error = FS_FILE_OPEN;
+		pthread_mutex_unlock(&(*volume).lock);
+		release_disk(&held);
+		pthread_mutex_unlock(&VolumesLock);
+		return 0;
+	}
+
+	if(flush_volume(volume) != 1 || flush_block_cache() != 1)
+	{
+		pthread_mutex_unlock(&(*volume).lock);
+		release_disk(&held);
+		pthread_mutex_unlock(&VolumesLock);
+		return 0;
+	}
+
+	Volume** link = &Volumes;
+	while(*link != volume)
+		link = &(**link).next;
+	*link = (*volume).next;
+
+	pthread_mutex_unlock(&(*volume).lock);
+	release_disk(&held);
+	pthread_mutex_unlock(&VolumesLock);
+
+	pthread_mutex_destroy(&(*volume).lock);
+	sd_free_buffer((*volume).fat, (*volume).info.numFatBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+	free((*volume).fatDirty);
+	free((*volume).usedMap);
+	free((*volume).openTable);
+	drop_free_runs(volume);
+	free(volume);
+	return 1;
+}
+
+// copies the block I/O statistics into 'stats'
+void fs_get_stats(FSStats *stats)
+{
+	*stats = IOStats;
+}
+
+// clears the block I/O statistics
+void fs_reset_stats(void)
+{
+	memset(&IOStats, 0, sizeof(IOStats));
+}
+
+// prints the block I/O statistics, per call and region, to standard output
+void fs_print_stats(void)
+{
+	static const char* opNames[FS_NUM_OPS] = { "none", "create", "open", "close", "read", "write", "seek", "length", "delete", "exists", "sync", "flush", "read_at", "write_at" };
+	static const char* regionNames[FS_NUM_REGIONS] = { "super", "fat", "record", "index", "data" };
+
+	for(int op = 0; op < FS_NUM_OPS; op++)
+	{
+		int headerPrinted = 0;
+
+		for(int region = 0; region < FS_NUM_REGIONS; region++)
+		{
+			FSRegionStats* r = &IOStats.io[op][region];
+
+			if((*r).requests[0] + (*r).requests[1] + (*r).blocks[0] + (*r).blocks[1] == 0)
+				continue;
+
+			if(!headerPrinted)
+			{
+				printf("%-8s %lu calls\n", opNames[op], IOStats.calls[op]);
+				headerPrinted = 1;
+			}
+
+			printf("  %-6s cache r %lu w %lu (%lu hits)  disk r %lu w %lu (%lu/%lu transfers)  p50 r %.1f w %.1f us  p99 r %.1f w %.1f us\n",
+				regionNames[region], (*r).requests[0], (*r).requests[1], (*r).hits,
+				(*r).blocks[0], (*r).blocks[1], (*r).transfers[0], (*r).transfers[1],
+				latency_percentile((*r).latency[0], 0.50), latency_percentile((*r).latency[1], 0.50),
+				latency_percentile((*r).latency[0], 0.99), latency_percentile((*r).latency[1], 0.99));
+		}
+	}
+}
+
 // describe current filesystem error code by printing a descriptive message to standard
 // error.
 void fs_print_error(void)
@@ -744,6 +938,9 @@ void fs_print_error(void)
 
 	if(Error == FS_FILE_READ_ONLY)
 		fprintf(stderr, "Operation Failed - File is Read-Only\n");
+
+	if(Error == FS_NO_FILESYSTEM)
+		fprintf(stderr, "Operation Failed - No Filesystem on the Software Disk\n");
 }
 
 
@@ -752,103 +949,72 @@ void fs_print_error(void)
 // =========================================================
 
 // Searches for File Record of 'name',
-//  returns Record Index, 0xFFFFFFFF if not found
-unsigned int find_file(char *name)
+//  returns Record Index, NO_RECORD if not found
+unsigned long find_file(Volume* volume, char *name)
 {
-	#define numRecordBlocks info.numRecordBlocks
-	#define firstRecordBlock info.firstRecordBlock
+	#define numRecordBlocks (*volume).info.numRecordBlocks
+	#define firstRecordBlock (*volume).info.firstRecordBlock
 
-	FSInfo info = get_fs_info();
-
-	char* blockData;
+	// ONE PROBE SEQUENCE OF THE NAME INDEX
+	if((*volume).info.numIndexBlocks != 0)
+		return index_lookup(volume, name);
 
 	// ========== RECORD CHECKING ==========
 	// =====================================
+	// (disks formatted without a name index)
+
+	unsigned int recordsRequired = records_for_name(name);
 
-	unsigned int nameLength = strlen(name);
-	unsigned char recordsRequired = (char)ceil(nameLength/23.0);
+	unsigned long recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
 
-	unsigned int recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
 
-	for(unsigned int blockIndex = 0; blockIndex < numRecordBlocks; blockIndex++)
+	for(unsigned long blockIndex = 0; blockIndex < numRecordBlocks; blockIndex++)
 	{
-		unsigned int absBlockNumber = blockIndex + firstRecordBlock;
+		unsigned long absBlockNumber = blockIndex + firstRecordBlock;
 
-		blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-		read_sd_block(blockData, absBlockNumber);
+		cache_read_block(blockData, absBlockNumber);
 
-		for(unsigned int recordIndex = 0; recordIndex < recordsPerBlock; recordIndex++)
+		for(unsigned long recordIndex = 0; recordIndex < recordsPerBlock; recordIndex++)
 		{
-			unsigned int entryOffset = recordIndex * SIZE_OF_RECORD_ENTRY;
+			unsigned long entryOffset = recordIndex * SIZE_OF_RECORD_ENTRY;
 
 			unsigned char fileAttr;
 			memcpy(&fileAttr, blockData + entryOffset, sizeof(char));
 
-			// END OF RECORDS, FILE NOT FOUND
-			if(fileAttr == 0)
-			{
-				return 0xFFFFFFFF;
-			}
-
-			// IF RECORD PRESENT
+			// IF RECORD PRESENT (deleted files leave free records between others)
 			if(isNthBitSet(fileAttr, 0))
 			{
 				// IF RECORD IS PARENT
 				if(isNthBitSet(fileAttr, 1))
 				{
-					unsigned char numRecordsCurrent = fileAttr & 15;
-					if(numRecordsCurrent == recordsRequired)
+					unsigned int numRecordsCurrent = name_records_of(blockData + entryOffset);
+
+					// IF NAMES MATCH, FILE FOUND
+					if(numRecordsCurrent == recordsRequired && record_name_matches(blockData + entryOffset, numRecordsCurrent, name))
 					{
-						unsigned char fileName[numRecordsCurrent*23];
-
-						for(unsigned int internalIndex = 0; internalIndex < numRecordsCurrent; internalIndex++)
-						{
-							memcpy((fileName + (internalIndex*23)), (blockData + entryOffset + (internalIndex*32) + 9), 23*sizeof(char));
-						}
-
-						// IF NAMES MATCH, FILE FOUND
-						if(!strcmp(fileName, name))
-						{
-							return (recordIndex + (blockIndex * recordsPerBlock));
-						}
+						sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+						return (recordIndex + (blockIndex * recordsPerBlock));
 					}
 				}
 			}
 		}
-	
-		// FREE THE BUFFER!
-		free(blockData);
 	}
 
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+	return NO_RECORD;
+
 	#undef numRecordBlocks
 	#undef firstRecordBlock
 }
 
-// Determines if File (given Record Number) is open
+// Determines if File (given Record Number) is open, from the open-file table
 //  returns 1 for Open
 //  returns 0 for Closed
-unsigned int is_open(unsigned int recordNumber)
+unsigned int is_record_open(Volume* volume, unsigned long recordNumber)
 {
-	#define firstRecordBlock info.firstRecordBlock
-	FSInfo info = get_fs_info();
-
-	// READ FILE RECORD BLOCK
-	unsigned int recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
-	unsigned int blockIndex = recordNumber / recordsPerBlock;
-	unsigned int recordIndex = recordNumber - (blockIndex * recordsPerBlock);
-	unsigned int recordOffset = recordIndex * SIZE_OF_RECORD_ENTRY;
-
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-	read_sd_block(blockData, blockIndex + firstRecordBlock);
-
-	// GET FILE ATTRIBUTES
-	unsigned int fileAttr;
-	memcpy(&fileAttr, blockData + recordOffset, sizeof(char));
-
-	free(blockData);
-
 	// IF -- FILE IS NOT OPEN
-	if(!isNthBitSet(fileAttr, 2))
+	if((*volume).openTable[recordNumber].refCount == 0)
 	{
 		return 0;
 	}
@@ -856,342 +1022,2795 @@ unsigned int is_open(unsigned int recordNumber)
 	{
 		return 1;
 	}
-	#undef firstRecordBlock
 }
 
-// Allocates a data block, updating parent's FAT value
-unsigned int allocate_data_block(int* parentFatIndexPtr, int targetFatIndex)
+// Determines if handle 'file' is the one its record is open with
+//  ~~ A closed handle stays closed when someone else opens the file again
+//  returns 1 for Open
+//  returns 0 for Closed
+unsigned int is_open(Volume* volume, File file)
 {
-	#define firstFatBlock info.firstFatBlock
-	#define firstDataBlock info.firstDataBlock
+	return (*volume).openTable[(*file).recordNumber].handle == file;
+}
 
-	struct FSInfo info = get_fs_info();
+// ========== LOCKING ==========
+// =============================
+//  ~~ Order: VolumesLock, then the disk, then a file, then its volume, then the
+//     block cache.
+//     Readers take no volume lock: the blocks of a file are changed only under
+//     its own lock, whatever else the allocator hands out meanwhile
 
-	unsigned int entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_FAT_ENTRY;
-	unsigned int targetFatBlockNumber = targetFatIndex / entriesPerBlock;
-	unsigned int targetInternalIndex = targetFatIndex - (targetFatBlockNumber * entriesPerBlock);
+// Takes the allocation and metadata lock of 'volume' (FS_VOLUME_SCOPE)
+Volume* lock_volume(Volume* volume)
+{
+	pthread_mutex_lock(&(*volume).lock);
 
-	// Read FAT Block containing the Target Entry
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-	read_sd_block(blockData, (targetFatBlockNumber + firstFatBlock));
+	return volume;
+}
 
-	// Get Current Value of Target Entry, check it is free
-	unsigned int currentValue;
-	memcpy(&currentValue, (blockData + (targetInternalIndex * SIZE_OF_FAT_ENTRY)), sizeof(int));
+// Releases the lock of '*volume' (FS_VOLUME_SCOPE cleanup)
+void unlock_volume(Volume** volume)
+{
+	pthread_mutex_unlock(&(**volume).lock);
+}
 
-		// Block is currently allocated (ERROR)
-		if(currentValue != 0x00000000)
-		{
-			printf("Internal FileSystem Error - Allocation Failed - Block Already Allocated\n");
-			free(blockData);
-			return 0;
-		}
+// Takes the lock of 'file', for writing if 'exclusive' (FS_FILE_SCOPE)
+File lock_file(File file, unsigned int exclusive)
+{
+	if(exclusive)
+		pthread_rwlock_wrlock(&(*file).lock);
+	else
+		pthread_rwlock_rdlock(&(*file).lock);
 
-	// Write termination symbol to complete allocation
-	currentValue = 0xFFFFFFFF;
-	memcpy((blockData + (targetInternalIndex * SIZE_OF_FAT_ENTRY)), &currentValue, sizeof(int));
-	write_sd_block(blockData, (targetFatBlockNumber +firstFatBlock));
+	return file;
+}
 
-	// ZEROIZE THE DATA BLOCK
+// Releases the lock of '*file', however it was taken (FS_FILE_SCOPE cleanup)
+void unlock_file(File* file)
+{
+	pthread_rwlock_unlock(&(**file).lock);
+}
 
-		// read data block into blockData
-		read_sd_block(blockData, (targetFatIndex + firstDataBlock));
+// Drops a reference to 'file'; the last one frees it
+//  ~~ References are taken under the volume lock while the handle is in the
+//     open table, so the count cannot rise again once it reaches 0
+void release_file(File file)
+{
+	if(__atomic_sub_fetch(&(*file).references, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
 
-		// create zeroizer
-		char* zeroizer = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
+	pthread_rwlock_destroy(&(*file).lock);
+	free(file);
+}
 
-		// copy zeroizer
-		memcpy(blockData, zeroizer, SOFTWARE_DISK_BLOCK_SIZE);
-		free(zeroizer);
+// Takes 'file' out of the open table of 'volume', writing its buffered appends
+//  and dropping what it holds in memory (close_file, under the handle's locks)
+//  Returns 0 (Error set) if it was not open; 1 if it was, even if the appends failed
+unsigned int close_handle(Volume* volume, File file)
+{
+	FS_DISK_SCOPE(volume);
+	FS_FILE_SCOPE(file, 1);
+	FS_VOLUME_SCOPE(volume);
 
-		// write data block
-		write_sd_block(blockData, (targetFatIndex + firstDataBlock));
+	// IF FILE IS OPEN
+	if(is_open(volume, file))
+	{
+		// Buffered appends get their blocks now; if they cannot, the file still
+		//  closes (what did not fit is gone) but the close reports why
+		unsigned int flushed = flush_write_buffer(volume, file);
+		FSError flushError = Error;
 
+		free((*file).writeBuffer);
+		(*file).writeBuffer = NULL;
 
-	// Regular Allocation Case (WRITE, SEEK), Must Update Parent
-	if(parentFatIndexPtr != NULL)
-	{
-		unsigned int parentFatIndex = *parentFatIndexPtr;
-		unsigned int parentFatBlockNumber = parentFatIndex / entriesPerBlock;
-		unsigned int parentInternalIndex = parentFatIndex - (parentFatBlockNumber * entriesPerBlock);
+		(*volume).openTable[(*file).recordNumber].refCount--;
+		(*volume).openTable[(*file).recordNumber].handle = NULL;
+		(*volume).openFiles--;
 
-		free(blockData);
+		flush_volume(volume);
 
-		blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-		read_sd_block(blockData, (parentFatBlockNumber + firstFatBlock));
+		free_extent_map((*file).extentMap);
+		(*file).extentMap = NULL;
 
-		memcpy(&currentValue, (blockData + (parentInternalIndex * SIZE_OF_FAT_ENTRY)), sizeof(int));
+		free((*file).blockMap);
+		(*file).blockMap = NULL;
+		(*file).mappedBlocks = 0;
+		(*file).blockMapCapacity = 0;
 
-			if(currentValue != 0xFFFFFFFF)
-			{
-				printf("Internal FileSystem Error - Allocation Failed - Parent NOT End of Chain");
-				free(blockData);
-				return 0;
-			}
+		if(flushed != 1)
+			Error = flushError;
 
-		currentValue = targetFatIndex;
-		memcpy((blockData + (parentInternalIndex * SIZE_OF_FAT_ENTRY)), &currentValue, sizeof(int));
+		return 1;
 	}
 
-	free(blockData);
-	return 1;
-	#undef firstFatBlock
-	#undef firstDataBlock
+	Error = FS_FILE_NOT_OPEN;
+	return 0;
 }
 
-unsigned int update_file_size(unsigned int recordNumber, unsigned int size)
+// Whether read_file_at of 'numbytes' at 'offset' changes nothing of 'file':
+//  no buffered appends to flush first and, on a chain, no block past the block
+//  map to walk to (extents and records are all in memory already)
+//  ~~ A chain walked to its end maps all there is: the rest up to EOF is a hole
+unsigned int reads_in_place(File file, unsigned long offset, unsigned long numbytes)
 {
-	#define firstRecordBlock info.firstRecordBlock
+	if((*file).bufferedBytes != 0 && offset + numbytes > (*file).bufferStart)
+		return 0;
 
-	struct FSInfo info = get_fs_info();
+	if((*file).extentMap != NULL || is_inline(file))
+		return 1;
 
-	unsigned int recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
-	unsigned int dirBlockNumber = recordNumber / recordsPerBlock;
-	unsigned int internalIndex = recordNumber - (dirBlockNumber * recordsPerBlock);
+	unsigned long end = offset + numbytes;
+	if(end > (*file).fileSize)
+		end = (*file).fileSize;
 
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-	read_sd_block(blockData, (dirBlockNumber + firstRecordBlock));
+	if((*file).mappedBlocks > block_index_of(end))
+		return 1;
 
-	// Writing size to entry using index and 5-byte offset into entry (pointer-arithmetic is char)
-	memcpy(blockData + (internalIndex * SIZE_OF_RECORD_ENTRY) + 5, &size, sizeof(int));
-	int success = write_sd_block(blockData, (dirBlockNumber + firstRecordBlock));
+	// Only writes to this file, which hold it exclusively, extend its chain
+	return (*file).mappedBlocks != 0 &&
+		get_next_data_block((*file).volume, (*file).blockMap[(*file).mappedBlocks - 1]) == FAT_END_OF_CHAIN;
+}
 
-	free(blockData);
+// ========== I/O STATISTICS ==========
+// ====================================
 
-	#undef firstRecordBlock
+// Starts attributing block I/O of this thread to 'op', returns the op attributed so far
+FSOp begin_stats_op(FSOp op)
+{
+	static pthread_once_t observing = PTHREAD_ONCE_INIT;
+
+	pthread_once(&observing, install_stats_observers);
+
+	FSOp previousOp = IOStatsOp;
+	IOStatsOp = op;
+	__atomic_fetch_add(&IOStats.calls[op], 1, __ATOMIC_RELAXED);
+
+	return previousOp;
 }
 
-// Finds and Returns the FAT Index of the first free Data Block
-//  ~~ Must offset by +firstDataBlock to read/write block
-//  ~~ Returns 0xFFFFFFFF if FS_OUT_OF_SPACE
-unsigned int get_free_data_block()
+// Installs the observers counting block I/O (begin_stats_op, once)
+void install_stats_observers(void)
 {
-	FSInfo info = get_fs_info();
-
-	#define firstFatBlock info.firstFatBlock
-	#define numFatBlocks info.numFatBlocks
-	#define firstDataBlock info.firstDataBlock
+	set_block_cache_observer(observe_cache);
+	set_software_disk_observer(observe_disk);
+}
 
-	// Don't read past maxFatRecords
-	unsigned int entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_FAT_ENTRY;
-	unsigned int maxFatRecords = numFatBlocks * entriesPerBlock;
-	char* blockData;
+// Goes back to attributing block I/O to '*previousOp' (FS_STATS_SCOPE cleanup)
+void end_stats_op(FSOp* previousOp)
+{
+	IOStatsOp = *previousOp;
+}
 
-	for(unsigned int blockIndex = 0; blockIndex < numFatBlocks; blockIndex++)
-	{
+// Attributes the block I/O of this thread by the layout of 'volume'
+//  ~~ Only the region bounds are taken: they never change after mounting,
+//     unlike the rest of the info, which the volume lock guards
+void set_stats_layout(Volume* volume)
+{
+	IOStatsLayout.firstRecordBlock = (*volume).info.firstRecordBlock;
+	IOStatsLayout.numIndexBlocks = (*volume).info.numIndexBlocks;
+	IOStatsLayout.firstDataBlock = (*volume).info.firstDataBlock;
+}
 
-		// Read Current FAT Block
-		blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-		read_sd_block(blockData, firstFatBlock+blockIndex);
+// Region holding absolute block 'absBlockNumber'
+FSRegion region_of(unsigned long absBlockNumber)
+{
+	if(absBlockNumber == 0)
+		return FS_REGION_SUPER;
+	if(absBlockNumber < IOStatsLayout.firstRecordBlock)
+		return FS_REGION_FAT;
+	if(absBlockNumber < IOStatsLayout.firstDataBlock - IOStatsLayout.numIndexBlocks)
+		return FS_REGION_RECORD;
+	if(absBlockNumber < IOStatsLayout.firstDataBlock)
+		return FS_REGION_INDEX;
+
+	return FS_REGION_DATA;
+}
 
-		for(unsigned int entryIndex = 0; entryIndex < entriesPerBlock; entryIndex++)
-		{
-			unsigned int entryVal;
-			memcpy(&entryVal, (blockData + (SIZE_OF_FAT_ENTRY * entryIndex)), sizeof(int));
+// Block cache observer: counts requested blocks and hits per region
+//  ~~ Observers run in every thread doing I/O, the counts are added atomically
+void observe_cache(int write, unsigned long blocknum, unsigned long count, unsigned long hits)
+{
+	FSRegionStats* regions = IOStats.io[IOStatsOp];
 
-			// Found Free FAT Entry
-			if(entryVal == 0)
-			{
-				free(blockData);
-				return (blockIndex * entriesPerBlock + entryIndex);
-			}
-		}
+	if(count == 0)
+		return;
 
-		free(blockData);
+	// One region (regions are consecutive): one addition
+	if(region_of(blocknum) == region_of(blocknum + count - 1))
+		__atomic_fetch_add(&regions[region_of(blocknum)].requests[write], count, __ATOMIC_RELAXED);
+	else
+	{
+		for(unsigned long i = 0; i < count; i++)
+			__atomic_fetch_add(&regions[region_of(blocknum + i)].requests[write], 1, __ATOMIC_RELAXED);
 	}
 
-	// No Free Blocks
-	Error = FS_OUT_OF_SPACE;
-	return 0xFFFFFFFF;
-
-	#undef firstFatBlock
-	#undef numFatBlocks
-	#undef firstDataBlock
+	// hits are rare to straddle regions, credit the first block's region
+	__atomic_fetch_add(&regions[region_of(blocknum)].hits, hits, __ATOMIC_RELAXED);
 }
 
-// Returns index of child of parentIndex
-//  Returns 0xFFFFFFFF on terminating entry
-unsigned int get_next_data_block(unsigned int parentIndex)
+// Software disk observer: counts transferred blocks and transfer latency per region
+void observe_disk(int write, unsigned long blocknum, unsigned long count, unsigned long nanoseconds)
 {
-	FSInfo info = get_fs_info();
+	FSRegionStats* regions = IOStats.io[IOStatsOp];
+
+	if(region_of(blocknum) == region_of(blocknum + count - 1))
+		__atomic_fetch_add(&regions[region_of(blocknum)].blocks[write], count, __ATOMIC_RELAXED);
+	else
+	{
+		for(unsigned long i = 0; i < count; i++)
+			__atomic_fetch_add(&regions[region_of(blocknum + i)].blocks[write], 1, __ATOMIC_RELAXED);
+	}
 
-	#define firstFatBlock info.firstFatBlock
-	#define numFatBlocks info.numFatBlocks
+	int bucket = 0;
+	while(bucket < FS_LATENCY_BUCKETS - 1 && (nanoseconds >> (bucket + 1)) != 0)
+		bucket++;
 
-	unsigned int entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_FAT_ENTRY;
-	unsigned int blockIndex = parentIndex / entriesPerBlock;
-	unsigned int entryIndex = parentIndex - (blockIndex * entriesPerBlock);
-	unsigned int entryOffset = entryIndex * SIZE_OF_FAT_ENTRY;
+	__atomic_fetch_add(&regions[region_of(blocknum)].transfers[write], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&regions[region_of(blocknum)].latency[write][bucket], 1, __ATOMIC_RELAXED);
+}
 
-	// READ PARENTS FAT BLOCK
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-	read_sd_block(blockData, blockIndex + firstFatBlock);
+// Upper bound in microseconds of the bucket holding the 'fraction' percentile
+//  of a latency histogram, 0 if it is empty
+double latency_percentile(unsigned long* histogram, double fraction)
+{
+	unsigned long total = 0;
+	for(int bucket = 0; bucket < FS_LATENCY_BUCKETS; bucket++)
+		total += histogram[bucket];
 
-	// GET PARENTS FAT VALUE
-	unsigned int childIndex;
-	memcpy(&childIndex, blockData + entryOffset, sizeof(int));
+	if(total == 0)
+		return 0;
 
-	free(blockData);
-	return childIndex;
+	unsigned long seen = 0;
+	for(int bucket = 0; bucket < FS_LATENCY_BUCKETS; bucket++)
+	{
+		seen += histogram[bucket];
+		if(seen >= fraction * total)
+			return (double)(2UL << bucket) / 1000.0;
+	}
 
-	#undef firstFatBlock
-	#undef numFatBlocks
+	return (double)(2UL << (FS_LATENCY_BUCKETS - 1)) / 1000.0;
 }
 
-// Finds and Returns the Record Number of the first free contiguous Record entries of length
-//  SETS FS_OUT_OF_SPACE IF ERROR
-unsigned int get_free_record(unsigned int length)
+// Index of the chain block holding the byte just before 'pos' (block 0 for pos 0)
+unsigned long block_index_of(unsigned long pos)
 {
-	#define firstRecordBlock info.firstRecordBlock
-	#define numRecordBlocks info.numRecordBlocks
+	if(pos == 0)
+		return 0;
 
-	struct FSInfo info = get_fs_info();
+	return (pos - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+}
 
-	unsigned int entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
-	unsigned int maxRecordEntries = numRecordBlocks * entriesPerBlock;
-	char* blockData;
+// Blocks a read_file/write_file batch needs for 'numbytes' at 'relativePos'
+//  (one spare for the block boundary case), capped at MAX_BATCH_BLOCKS
+unsigned long batch_capacity(unsigned long relativePos, unsigned long numbytes)
+{
+	unsigned long blocks = ((relativePos + numbytes) / SOFTWARE_DISK_BLOCK_SIZE) + 2;
 
-	for(unsigned int blockIndex = 0; blockIndex < numRecordBlocks; blockIndex++)
-	{
+	if(blocks > MAX_BATCH_BLOCKS)
+		return MAX_BATCH_BLOCKS;
 
-		// Read current Record Block
-		blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-		read_sd_block(blockData, (firstRecordBlock + blockIndex));
+	return blocks;
+}
 
-		unsigned int counter = 0;
+// Appends absolute block 'absBlockNumber', buffered at 'blockData', to the runs
+//  of a batch; extends the last run when both the disk blocks and the buffers
+//  are consecutive
+void add_to_batch(SDRequest* runs, unsigned long* numRuns, char* blockData, unsigned long absBlockNumber)
+{
+	if(*numRuns > 0)
+	{
+		SDRequest* last = &runs[*numRuns - 1];
 
-		for(int entryIndex = 0; entryIndex < entriesPerBlock; entryIndex++)
+		if((*last).blocknum + (*last).count == absBlockNumber
+			&& (char*)(*last).buf + ((*last).count * SOFTWARE_DISK_BLOCK_SIZE) == blockData
+			&& (*last).count < MAX_RUN_BLOCKS)
 		{
-			unsigned char fileAttr;
-			memcpy(&fileAttr, blockData + (SIZE_OF_RECORD_ENTRY * entryIndex), sizeof(char));
-
-			if(fileAttr == 0)
-			{
-				counter++;
-
-				if(counter == length)
-				{
-					free(blockData);
-					return ((blockIndex * entriesPerBlock + entryIndex) - (length - 1));
-				}
-			}
-			else
-			{
-				counter = 0;
-			}
+			(*last).count++;
+			return;
 		}
 	}
 
-	// No Free Records of suitable size
-	Error = FS_OUT_OF_SPACE;
-
-	#undef firstRecordBlock
-	#undef numRecordBlocks
+	runs[*numRuns].write = 0;
+	runs[*numRuns].blocknum = absBlockNumber;
+	runs[*numRuns].count = 1;
+	runs[*numRuns].buf = blockData;
+	(*numRuns)++;
 }
 
-// Creates a new file record
-//  Returns the index number of the File Record created
-unsigned int write_record_entry(char* name, unsigned int dataBlock)
+// Whether block 'batchIndex' of a batch lies wholly inside the 'remaining' bytes
+//  transferred from 'relativePos' (in its first block) on
+//  ~~ Only the head and tail blocks of a batch can be partial
+unsigned int batch_block_direct(unsigned long batchIndex, unsigned long relativePos, unsigned long remaining)
 {
-	struct FSInfo info = get_fs_info();
-	#define firstRecordBlock info.firstRecordBlock
+	unsigned long blockStart = batchIndex * SOFTWARE_DISK_BLOCK_SIZE;
 
-	// Calculate number of records needed for File Name
-	unsigned int length = strlen(name);
-	unsigned int recordsRequired = (int)ceil(length/23.0);
+	return blockStart >= relativePos && blockStart + SOFTWARE_DISK_BLOCK_SIZE <= relativePos + remaining;
+}
 
-	// Get record we're going to write into
-	unsigned int parentRecordIndex = get_free_record(recordsRequired);
-	if(Error == FS_OUT_OF_SPACE)
-		return 0;
+// Buffer of block 'batchIndex' of a batch: the caller's own bytes ('user' holds
+//  those from 'relativePos' on) when the block is whole, so full blocks move
+//  straight between the caller and the cache, otherwise its block of 'batchData'
+char* batch_block_buffer(char* batchData, char* user, unsigned long batchIndex, unsigned long relativePos, unsigned long remaining)
+{
+	if(batch_block_direct(batchIndex, relativePos, remaining))
+		return user + (batchIndex * SOFTWARE_DISK_BLOCK_SIZE) - relativePos;
 
-	// Indexing
-	unsigned int recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
-	unsigned int parentRecordBlockNumber = parentRecordIndex / recordsPerBlock;
-	unsigned int parentInternalIndex = parentRecordIndex - (parentRecordBlockNumber * recordsPerBlock);
+	return batchData + (batchIndex * SOFTWARE_DISK_BLOCK_SIZE);
+}
 
-	// Read Block of Parent Record
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-	read_sd_block(blockData, (parentRecordBlockNumber + firstRecordBlock));
+// Prefetches the blocks of 'file' that follow block 'fileBlock' (data block
+//  'blockIndex', the last one a read just used) into the block cache.  A read
+//  starting at 'startPos' where the previous one ended doubles the window, any
+//  other resets it; a new window is only submitted once half of the previous one
+//  has been used, so the reads ahead stay in flight while the reader catches up
+void read_ahead(Volume* volume, File file, unsigned long startPos, unsigned long fileBlock, unsigned long blockIndex)
+{
+	#define firstDataBlock (*volume).info.firstDataBlock
 
-	// Write "First Data Block" field to buffer (Only done in Parent record)
-	memcpy((blockData + (parentInternalIndex * SIZE_OF_RECORD_ENTRY) + 1), &dataBlock, sizeof(int));
+	// THE SYNCHRONOUS ENGINE HAS NOTHING TO OVERLAP THE READS WITH
+	if(software_disk_engine() == SD_ENGINE_SYNC)
+		return;
 
-	for(unsigned int clusterIndex = 0; clusterIndex < recordsRequired; clusterIndex++)
+	// RANDOM ACCESS, NOTHING TO PREDICT
+	if(startPos != (*file).readAheadPos)
 	{
-		// ===== CONSTRUCT FIRST BYTE =====
-		// ================================
-		unsigned char fileAttr = 0x00;
+		(*file).readAheadBlocks = 0;
+		(*file).readAheadEnd = 0;
+		return;
+	}
 
-		fileAttr |= 128; // Set Present Flag
+	if((*file).readAheadBlocks == 0)
+		(*file).readAheadBlocks = READ_AHEAD_MIN_BLOCKS;
+	else if((*file).readAheadBlocks < READ_AHEAD_MAX_BLOCKS)
+		(*file).readAheadBlocks *= 2;
 
-		// IF Parent Block
-		if(clusterIndex == 0)
-		{
-			fileAttr |= 64; // Set Parent Flag
-			fileAttr |= 32; // Set Open Flag (this function only called by Create_File)
-		}
+	unsigned long window = (*file).readAheadBlocks;
 
-		fileAttr |= (recordsRequired - clusterIndex); // Set Cluster Index
+	// ENOUGH ALREADY ON ITS WAY
+	if((*file).readAheadEnd > fileBlock + (window / 2))
+		return;
 
-		// Write first Byte
-		memcpy((blockData + (parentInternalIndex * SIZE_OF_RECORD_ENTRY) + (clusterIndex * SIZE_OF_RECORD_ENTRY)), &fileAttr, sizeof(char));
+	// Blocks holding data
+	unsigned long fileBlocks = block_index_of((*file).fileSize) + 1;
 
-		// Write Name
-		if(length <= 23)
-		{
-			// Write 'length' bytes to name field
-			memcpy((blockData + (parentInternalIndex * SIZE_OF_RECORD_ENTRY) + (clusterIndex * SIZE_OF_RECORD_ENTRY) + 9), name + (clusterIndex * 23), (length * sizeof(char)));
+	unsigned long from = fileBlock + 1;
+	if(from < (*file).readAheadEnd)
+		from = (*file).readAheadEnd;
 
-		}
-		else
-		{
-			// Write 23 bytes to name field
-			memcpy((blockData + (parentInternalIndex * SIZE_OF_RECORD_ENTRY) + (clusterIndex * SIZE_OF_RECORD_ENTRY) + 9), name + (clusterIndex * 23), (23 * sizeof(char)));
+	unsigned long to = fileBlock + 1 + window;
+	if(to > fileBlocks)
+		to = fileBlocks;
 
-			// Then decrease length by 23
-			length -= 23;
-		}
+	if(from >= to)
+		return;
 
-	}
+	SDRequest* runs = malloc(window * sizeof(SDRequest));
+	if(runs == NULL)
+		return;
+
+	// WALK TO THE WINDOW (THE BLOCK MAP REMEMBERS IT FOR THE READS TO COME)
+	unsigned long numRuns = 0;
+	unsigned long currentBlockIndex = blockIndex;
+
+	for(unsigned long i = fileBlock + 1; i < to; i++)
+	{
+		currentBlockIndex = file_block(volume, file, i);
+
+		// Holes are not read
+		if(currentBlockIndex == FAT_END_OF_CHAIN)
+			continue;
+
+		if(i < from)
+			continue;
+
+		unsigned long absBlockNumber = currentBlockIndex + firstDataBlock;
+
+		if(numRuns > 0 && runs[numRuns - 1].blocknum + runs[numRuns - 1].count == absBlockNumber)
+		{
+			runs[numRuns - 1].count++;
+			continue;
+		}
+
+		runs[numRuns].write = 0;
+		runs[numRuns].blocknum = absBlockNumber;
+		runs[numRuns].count = 1;
+		runs[numRuns].buf = NULL;
+		numRuns++;
+	}
+
+	if(numRuns > 0)
+		cache_prefetch_runs(runs, numRuns);
+
+	free(runs);
+
+	(*file).readAheadEnd = to;
+
+	#undef firstDataBlock
+}
+
+// Adds data block 'blockIndex', read into 'blockData', to the runs of a read batch;
+//  a hole (FAT_END_OF_CHAIN) is not read, its buffer is zeroed
+void add_read_block(SDRequest* runs, unsigned long* numRuns, char* blockData, unsigned long blockIndex, unsigned long firstDataBlock)
+{
+	if(blockIndex == FAT_END_OF_CHAIN)
+		memset(blockData, 0, SOFTWARE_DISK_BLOCK_SIZE);
+	else
+		add_to_batch(runs, numRuns, blockData, blockIndex + firstDataBlock);
+}
+
+// Copies the bytes of the partial head and tail blocks of a batch of 'batchLength'
+//  blocks between 'batchData' and 'user', which holds the 'chunk' bytes from
+//  'relativePos' on; into the batch if 'toBatch', out of it otherwise
+void copy_batch_edges(char* batchData, char* user, unsigned long batchLength, unsigned long relativePos, unsigned long chunk, unsigned int toBatch)
+{
+	unsigned long edges[2] = { 0, batchLength - 1 };
+	unsigned long numEdges = (batchLength > 1) ? 2 : 1;
+
+	for(unsigned long i = 0; i < numEdges; i++)
+	{
+		if(batch_block_direct(edges[i], relativePos, chunk))
+			continue;
+
+		// Part of the block inside the chunk
+		unsigned long start = edges[i] * SOFTWARE_DISK_BLOCK_SIZE;
+		unsigned long end = start + SOFTWARE_DISK_BLOCK_SIZE;
+		if(start < relativePos)
+			start = relativePos;
+		if(end > relativePos + chunk)
+			end = relativePos + chunk;
+
+		if(start >= end)
+			continue;
+
+		if(toBatch)
+			memcpy(batchData + start, user + (start - relativePos), end - start);
+		else
+			memcpy(user + (start - relativePos), batchData + start, end - start);
+	}
+}
+
+// Locates record 'recordNumber': sets the absolute block holding it and its
+//  byte offset inside that block
+void locate_record(FSInfo* info, unsigned long recordNumber, unsigned long* absBlockNumber, unsigned long* recordOffset)
+{
+	unsigned long recordsPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
+	unsigned long blockIndex = recordNumber / recordsPerBlock;
+
+	*absBlockNumber = blockIndex + (*info).firstRecordBlock;
+	*recordOffset = (recordNumber - (blockIndex * recordsPerBlock)) * SIZE_OF_RECORD_ENTRY;
+}
+
+// Locates FAT entry 'fatIndex': sets the absolute block holding it and its
+//  byte offset inside that block
+void locate_fat_entry(FSInfo* info, unsigned long fatIndex, unsigned long* absBlockNumber, unsigned long* entryOffset)
+{
+	unsigned long entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_FAT_ENTRY;
+	unsigned long blockIndex = fatIndex / entriesPerBlock;
+
+	*absBlockNumber = blockIndex + (*info).firstFatBlock;
+	*entryOffset = (fatIndex - (blockIndex * entriesPerBlock)) * SIZE_OF_FAT_ENTRY;
+}
+
+// Locates name index slot 'slot': sets the absolute block holding it and its
+//  byte offset inside that block
+void locate_index_entry(FSInfo* info, unsigned long slot, unsigned long* absBlockNumber, unsigned long* entryOffset)
+{
+	unsigned long entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_INDEX_ENTRY;
+	unsigned long blockIndex = slot / entriesPerBlock;
+
+	*absBlockNumber = blockIndex + (*info).firstIndexBlock;
+	*entryOffset = (slot - (blockIndex * entriesPerBlock)) * SIZE_OF_INDEX_ENTRY;
+}
+
+// Slots of the name index (formatfs makes it a power of two), 0 without one
+unsigned long index_slots(FSInfo* info)
+{
+	return (*info).numIndexBlocks * (SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_INDEX_ENTRY);
+}
+
+// Allocates a data block, updating parent's FAT value
+//  ~~ Zeroized unless 'zeroize' is 0: write_file fills the blocks it allocates itself
+unsigned int allocate_data_block(Volume* volume, unsigned long* parentFatIndexPtr, unsigned long targetFatIndex, unsigned int zeroize)
+{
+	#define firstDataBlock (*volume).info.firstDataBlock
+
+	// Get Current Value of Target Entry, check it is free
+	unsigned long currentValue = get_next_data_block(volume, targetFatIndex);
+
+		// Block is currently allocated (ERROR)
+		if(currentValue != 0)
+		{
+			printf("Internal FileSystem Error - Allocation Failed - Block Already Allocated\n");
+			return 0;
+		}
+
+	// Regular Allocation Case (WRITE, SEEK), Parent must be End of Chain
+	if(parentFatIndexPtr != NULL && get_next_data_block(volume, *parentFatIndexPtr) != FAT_END_OF_CHAIN)
+	{
+		printf("Internal FileSystem Error - Allocation Failed - Parent NOT End of Chain");
+		return 0;
+	}
+
+	// Write termination symbol to complete allocation
+	write_fat_entry(volume, targetFatIndex, FAT_END_OF_CHAIN);
+
+	// ZEROIZE THE DATA BLOCK
+	if(zeroize)
+	{
+		// create zeroizer
+		char* zeroizer = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+
+		// write data block
+		cache_write_block(zeroizer, (targetFatIndex + firstDataBlock));
+		sd_free_buffer(zeroizer, SOFTWARE_DISK_BLOCK_SIZE);
+	}
+
+	// Regular Allocation Case (WRITE, SEEK), Must Update Parent
+	if(parentFatIndexPtr != NULL)
+		write_fat_entry(volume, *parentFatIndexPtr, targetFatIndex);
+
+	return 1;
+	#undef firstDataBlock
+}
+
+unsigned int update_file_size(Volume* volume, unsigned long recordNumber, unsigned long size)
+{
+	unsigned long absBlockNumber, recordOffset;
+	locate_record(&(*volume).info, recordNumber, &absBlockNumber, &recordOffset);
+
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	cache_read_block(blockData, absBlockNumber);
+
+	// Writing size to entry using index and RECORD_SIZE_OFFSET into entry (pointer-arithmetic is char)
+	memcpy(blockData + recordOffset + RECORD_SIZE_OFFSET, &size, sizeof(unsigned long));
+	int success = cache_write_block(blockData, absBlockNumber);
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+
+	return success;
+}
+
+// Finds and Returns the FAT Index of the next free Data Block, searching the
+//  bitmap 64 blocks at a time from lastUsedBlock on and wrapping around (next-fit)
+//  ~~ Blocks reserved for buffered appends are only handed out once released
+//  ~~ Must offset by +firstDataBlock to read/write block
+//  ~~ Returns FAT_END_OF_CHAIN if FS_OUT_OF_SPACE
+unsigned long get_free_data_block(Volume* volume)
+{
+	#define usedMap (*volume).usedMap
+
+	// The rest is promised to buffered appends
+	if((*volume).freeBlocks <= (*volume).reservedBlocks)
+	{
+		Error = FS_OUT_OF_SPACE;
+		return FAT_END_OF_CHAIN;
+	}
+
+	// Bits past numDataBlocks are set, so a free bit is always a data block
+	unsigned long numWords = ((*volume).info.numDataBlocks + 63) / 64;
+
+	unsigned long start = (*volume).info.lastUsedBlock;
+	if(start >= (*volume).info.numDataBlocks)
+		start = 0;
+
+	// First word: only the blocks from the cursor on, the rest come last
+	unsigned long wordIndex = start / 64;
+	unsigned long freeBits = ~usedMap[wordIndex] & (~0UL << (start % 64));
+
+	for(unsigned long visited = 0; visited <= numWords; visited++)
+	{
+		// Data block 0 is never handed out: a FAT entry pointing to it reads as free
+		if(wordIndex == 0)
+			freeBits &= ~1UL;
+
+		// Found Free Data Block
+		if(freeBits != 0)
+			return (wordIndex * 64) + __builtin_ctzl(freeBits);
+
+		wordIndex = (wordIndex + 1) % numWords;
+		freeBits = ~usedMap[wordIndex];
+	}
+
+	// No Free Blocks
+	Error = FS_OUT_OF_SPACE;
+	return FAT_END_OF_CHAIN;
+
+	#undef usedMap
+}
+
+// Returns the FAT entry of parentIndex (decoded by fat_next and fat_holes)
+//  Returns FAT_END_OF_CHAIN on terminating entry
+unsigned long get_next_data_block(Volume* volume, unsigned long parentIndex)
+{
+	return (*volume).fat[parentIndex];
+}
+
+// FAT entry linking to data block 'nextBlock' after 'holes' (at most FAT_MAX_HOLE)
+//  file blocks without one
+unsigned long fat_link(unsigned long holes, unsigned long nextBlock)
+{
+	return (holes << FAT_HOLE_SHIFT) | nextBlock;
+}
+
+// Data block a FAT entry links to, FAT_END_OF_CHAIN for the terminating entry
+unsigned long fat_next(unsigned long entryValue)
+{
+	if(entryValue == FAT_END_OF_CHAIN)
+		return FAT_END_OF_CHAIN;
+
+	return entryValue & FAT_BLOCK_MASK;
+}
+
+// File blocks without a data block a FAT entry skips before the block it links to
+unsigned long fat_holes(unsigned long entryValue)
+{
+	if(entryValue == FAT_END_OF_CHAIN)
+		return 0;
+
+	return entryValue >> FAT_HOLE_SHIFT;
+}
+
+// Sets FAT entry 'entryNumber' to 'entryValue', marking its FAT block for writing back
+//  ~~ Keeps the bitmap, the free count and the allocation cursor in step (0 frees the block)
+unsigned int write_fat_entry(Volume* volume, unsigned long entryNumber, unsigned long entryValue)
+{
+	unsigned long entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_FAT_ENTRY;
+	unsigned long blockIndex = entryNumber / entriesPerBlock;
+
+	// Newly allocated, resume the search here
+	if((*volume).fat[entryNumber] == 0 && entryValue != 0)
+	{
+		(*volume).usedMap[entryNumber / 64] |= 1UL << (entryNumber % 64);
+		(*volume).info.lastUsedBlock = entryNumber;
+		(*volume).infoDirty = 1;
+
+		if(entryNumber != 0)
+			(*volume).freeBlocks--;
+	}
+
+	// Freed
+	if(entryValue == 0)
+	{
+		if((*volume).fat[entryNumber] != 0 && entryNumber != 0)
+			(*volume).freeBlocks++;
+
+		(*volume).usedMap[entryNumber / 64] &= ~(1UL << (entryNumber % 64));
+	}
+
+	(*volume).fat[entryNumber] = entryValue;
+	(*volume).fatDirty[blockIndex / 8] |= 1 << (blockIndex % 8);
+
+	return 1;
+}
+
+// Finds and Returns the Record Number of the first of 'length' free contiguous Record
+//  entries, taken from the shortest listed free run long enough (no records are read),
+//  preferably one leaving 'room' free records after them
+//  ~~ The records of one file never cross a Record Block
+//  SETS FS_OUT_OF_SPACE IF ERROR, returns NO_RECORD
+unsigned long get_free_record(Volume* volume, unsigned int length, unsigned int room)
+{
+	#define freeRuns (*volume).freeRuns
+
+	// THE LAST BUCKET HOLDS EVERY LONGER RUN
+	unsigned int wanted = length + room;
+	if(wanted > FREE_RUN_BUCKETS - 1)
+		wanted = FREE_RUN_BUCKETS - 1;
+	if(wanted < length)
+		wanted = length;
+
+	for(unsigned int bucket = wanted; bucket < FREE_RUN_BUCKETS; bucket++)
+	{
+		if(freeRuns.heads[bucket] == 0)
+			continue;
+
+		unsigned long start = freeRuns.heads[bucket] - 1;
+		unsigned long runLength = freeRuns.runLength[start];
+
+		// Taken from the front, the rest stays free
+		remove_free_run(volume, start);
+		if(runLength > length)
+			add_free_run(volume, start + length, runLength - length);
+
+		return start;
+	}
+
+	// ANY RUN LONG ENOUGH THEN
+	if(wanted > length)
+		return get_free_record(volume, length, 0);
+
+	// No Free Records of suitable size
+	Error = FS_OUT_OF_SPACE;
+	return NO_RECORD;
+
+	#undef freeRuns
+}
+
+// Lists the free runs of every record block (a record is free when its attribute
+//  byte is 0)
+//  Returns 0 on failure
+unsigned int build_free_runs(Volume* volume)
+{
+	#define freeRuns (*volume).freeRuns
+
+	unsigned long entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
+	unsigned long numRecords = (*volume).info.numRecordBlocks * entriesPerBlock;
+
+	freeRuns.runLength = calloc(numRecords, sizeof(unsigned int));
+	freeRuns.runStart = calloc(numRecords, sizeof(unsigned int));
+	freeRuns.next = calloc(numRecords, sizeof(unsigned int));
+	freeRuns.prev = calloc(numRecords, sizeof(unsigned int));
+
+	if(freeRuns.runLength == NULL || freeRuns.runStart == NULL || freeRuns.next == NULL || freeRuns.prev == NULL)
+		return 0;
+
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+
+	for(unsigned long blockIndex = 0; blockIndex < (*volume).info.numRecordBlocks; blockIndex++)
+	{
+		if(cache_read_block(blockData, (*volume).info.firstRecordBlock + blockIndex) != 1)
+		{
+			sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+			return 0;
+		}
+
+		unsigned long runLength = 0;
+
+		for(unsigned long entryIndex = 0; entryIndex <= entriesPerBlock; entryIndex++)
+		{
+			// FREE RECORD, THE RUN GOES ON
+			if(entryIndex < entriesPerBlock && blockData[SIZE_OF_RECORD_ENTRY * entryIndex] == 0)
+			{
+				runLength++;
+				continue;
+			}
+
+			// USED RECORD OR BLOCK END, THE RUN (IF ANY) ENDS
+			if(runLength > 0)
+				add_free_run(volume, (blockIndex * entriesPerBlock) + entryIndex - runLength, runLength);
+
+			runLength = 0;
+		}
+	}
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+	return 1;
+
+	#undef freeRuns
+}
+
+void drop_free_runs(Volume* volume)
+{
+	free((*volume).freeRuns.runLength);
+	free((*volume).freeRuns.runStart);
+	free((*volume).freeRuns.next);
+	free((*volume).freeRuns.prev);
+}
+
+// Lists the free run of 'length' records starting at record 'start' first in its bucket
+void add_free_run(Volume* volume, unsigned long start, unsigned long length)
+{
+	#define freeRuns (*volume).freeRuns
+
+	unsigned int bucket = (length < FREE_RUN_BUCKETS) ? length : FREE_RUN_BUCKETS - 1;
+
+	freeRuns.runLength[start] = length;
+	freeRuns.runStart[start + length - 1] = start + 1;
+
+	freeRuns.prev[start] = 0;
+	freeRuns.next[start] = freeRuns.heads[bucket];
+	if(freeRuns.heads[bucket] != 0)
+		freeRuns.prev[freeRuns.heads[bucket] - 1] = start + 1;
+	freeRuns.heads[bucket] = start + 1;
+
+	#undef freeRuns
+}
+
+// Unlists the free run starting at record 'start', clearing its boundary tags
+void remove_free_run(Volume* volume, unsigned long start)
+{
+	#define freeRuns (*volume).freeRuns
+
+	unsigned long length = freeRuns.runLength[start];
+	unsigned int bucket = (length < FREE_RUN_BUCKETS) ? length : FREE_RUN_BUCKETS - 1;
+
+	if(freeRuns.prev[start] != 0)
+		freeRuns.next[freeRuns.prev[start] - 1] = freeRuns.next[start];
+	else
+		freeRuns.heads[bucket] = freeRuns.next[start];
+
+	if(freeRuns.next[start] != 0)
+		freeRuns.prev[freeRuns.next[start] - 1] = freeRuns.prev[start];
+
+	freeRuns.runLength[start] = 0;
+	freeRuns.runStart[start + length - 1] = 0;
+
+	#undef freeRuns
+}
+
+// Returns 'length' records from 'start' on to the free runs, joined with the
+//  free runs right before and after them in the same record block
+void release_records(Volume* volume, unsigned long start, unsigned long length)
+{
+	#define freeRuns (*volume).freeRuns
+
+	unsigned long entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
+	unsigned long numRecords = (*volume).info.numRecordBlocks * entriesPerBlock;
+	unsigned long end = start + length;
+
+	// RUN ENDING RIGHT BEFORE
+	if((start % entriesPerBlock) != 0 && freeRuns.runStart[start - 1] != 0)
+	{
+		unsigned long before = freeRuns.runStart[start - 1] - 1;
+		remove_free_run(volume, before);
+		start = before;
+	}
+
+	// RUN STARTING RIGHT AFTER
+	if((end % entriesPerBlock) != 0 && end < numRecords && freeRuns.runLength[end] != 0)
+	{
+		unsigned long afterLength = freeRuns.runLength[end];
+		remove_free_run(volume, end);
+		end += afterLength;
+	}
+
+	add_free_run(volume, start, end - start);
+
+	#undef freeRuns
+}
+
+// Creates the records of a new, empty file: an inline one with no inline data
+//  records yet
+//  Returns the index number of the File Record created, or NO_RECORD (Error set)
+//  when no records are free or the name index is full
+unsigned long write_record_entry(Volume* volume, char* name)
+{
+	// Calculate number of records needed for File Name
+	unsigned long length = strlen(name);
+	unsigned long written = 0;
+	unsigned int recordsRequired = records_for_name(name);
+	unsigned int totalRecords = recordsRequired;
+
+	// Names longer than MAX_FILE_RECORDS records cannot be stored
+	if(totalRecords > MAX_FILE_RECORDS)
+	{
+		Error = FS_OUT_OF_SPACE;
+		return NO_RECORD;
+	}
+
+	// Inline File: firstBlock holds the number of inline data records
+	unsigned long dataBlock = 0;
+
+	// Get record we're going to write into, with room to stay inline after it if there is any
+	unsigned long parentRecordIndex = get_free_record(volume, totalRecords, INLINE_RECORDS);
+	if(Error == FS_OUT_OF_SPACE)
+		return NO_RECORD;
+
+	// Make it findable, or give the records back: a file no name leads to is lost
+	if((*volume).info.numIndexBlocks != 0 && index_insert(volume, name, parentRecordIndex) != 1)
+	{
+		release_records(volume, parentRecordIndex, totalRecords);
+		Error = FS_OUT_OF_SPACE;
+		return NO_RECORD;
+	}
+
+	// Indexing
+	unsigned long absBlockNumber, parentOffset;
+	locate_record(&(*volume).info, parentRecordIndex, &absBlockNumber, &parentOffset);
+
+	// Read Block of Parent Record
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	cache_read_block(blockData, absBlockNumber);
+
+	// Write "First Data Block" and "File Size" fields to buffer (Only done in Parent record)
+	unsigned long fileSize = 0;
+	memcpy((blockData + parentOffset + RECORD_FIRST_BLOCK_OFFSET), &dataBlock, sizeof(unsigned long));
+	memcpy((blockData + parentOffset + RECORD_SIZE_OFFSET), &fileSize, sizeof(unsigned long));
+
+	for(unsigned int clusterIndex = 0; clusterIndex < recordsRequired; clusterIndex++)
+	{
+		char* record = blockData + parentOffset + (clusterIndex * SIZE_OF_RECORD_ENTRY);
+
+		// ===== CONSTRUCT FIRST BYTE =====
+		// ================================
+		unsigned char fileAttr = 0x00;
+
+		fileAttr |= 128; // Set Present Flag
+
+		// IF Parent Block
+		if(clusterIndex == 0)
+		{
+			fileAttr |= 64; // Set Parent Flag
+			fileAttr |= RECORD_INLINE_FLAG; // Set Inline Flag
+		}
+
+		fileAttr |= (totalRecords - clusterIndex); // Set Cluster Index
+
+		// Write first Byte
+		memcpy(record, &fileAttr, sizeof(char));
+
+		// Write Name (zero padded), as much of it as the name field holds
+		unsigned long fieldLength;
+		unsigned long fieldOffset = record_name_field(clusterIndex, &fieldLength);
+
+		unsigned long chunkLength = length - written;
+		if(chunkLength > fieldLength)
+			chunkLength = fieldLength;
+
+		memset(record + fieldOffset, 0, fieldLength);
+		memcpy(record + fieldOffset, name + written, (chunkLength * sizeof(char)));
+
+		written += chunkLength;
+	}
+
+	// Write to Disk
+	cache_write_block(blockData, absBlockNumber);
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+
+	return parentRecordIndex;
+}
+
+// Name records of the file whose parent record is at 'entry': its record count
+//  less its inline data records
+unsigned int name_records_of(char* entry)
+{
+	unsigned char fileAttr;
+	memcpy(&fileAttr, entry, sizeof(char));
+
+	unsigned int numRecords = fileAttr & 15;
+
+	if(fileAttr & RECORD_INLINE_FLAG)
+	{
+		unsigned long inlineRecords;
+		memcpy(&inlineRecords, entry + RECORD_FIRST_BLOCK_OFFSET, sizeof(unsigned long));
+		numRecords -= inlineRecords;
+	}
+
+	return numRecords;
+}
+
+// Allocates block 0 of a new file: a data block, or on extent volumes the root
+//  of its tree (zeroized, an empty leaf) and the data block it maps
+//  ~~ '*firstBlock' goes in the record, '*dataBlock' holds the first byte
+//  Returns 0 (Error set) when out of space
+unsigned int allocate_first_block(Volume* volume, unsigned long* firstBlock, unsigned long* dataBlock, ExtentMap** extentMap)
+{
+	*extentMap = NULL;
+
+	*firstBlock = get_free_data_block(volume);
+	if(*firstBlock == FAT_END_OF_CHAIN)
+		return 0;
+
+	allocate_data_block(volume, NULL, *firstBlock, 1);
+	*dataBlock = *firstBlock;
+
+	if((*volume).info.features & FS_FEATURE_EXTENTS)
+	{
+		*extentMap = load_extent_map(volume, *firstBlock);
+		if(*extentMap != NULL)
+			*dataBlock = map_extent_block(volume, *extentMap, 0, 1);
+
+		if(*extentMap == NULL || *dataBlock == FAT_END_OF_CHAIN)
+		{
+			free_extent_map(*extentMap);
+			*extentMap = NULL;
+			write_fat_entry(volume, *firstBlock, 0);
+			return 0;
+		}
+
+		flush_extent_map(volume, *extentMap);
+	}
+
+	return 1;
+}
+
+// Copies 'numbytes' from byte 'pos' of inline 'file' into 'buf', or the other way
+//  round if 'write' (the records of a file share one record block)
+//  Returns 0 on failure
+unsigned int transfer_inline(Volume* volume, File file, char* buf, unsigned long pos, unsigned long numbytes, int write)
+{
+	unsigned long absBlockNumber, recordOffset;
+	locate_record(&(*volume).info, (*file).inlineRecord, &absBlockNumber, &recordOffset);
+
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	unsigned int success = cache_read_block(blockData, absBlockNumber);
+
+	for(unsigned long done = 0; success && done < numbytes; )
+	{
+		unsigned long record = (pos + done) / RECORD_INLINE_DATA_LENGTH;
+		unsigned long within = (pos + done) % RECORD_INLINE_DATA_LENGTH;
+
+		unsigned long chunk = RECORD_INLINE_DATA_LENGTH - within;
+		if(chunk > numbytes - done)
+			chunk = numbytes - done;
+
+		char* data = blockData + recordOffset + (record * SIZE_OF_RECORD_ENTRY) + RECORD_INLINE_DATA_OFFSET + within;
+
+		if(write)
+			memcpy(data, buf + done, chunk);
+		else
+			memcpy(buf + done, data, chunk);
+
+		done += chunk;
+	}
+
+	if(success && write)
+		success = cache_write_block(blockData, absBlockNumber);
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+	return success;
+}
+
+// Whether 'file' keeps its bytes in records after its name (none while it is
+//  empty) rather than in data blocks
+unsigned int is_inline(File file)
+{
+	return (*file).startingBlock == FAT_END_OF_CHAIN;
+}
+
+// Makes the inline data records of 'file' hold 'size' bytes, taking the free
+//  records right after its last one when it needs more (they are zeroized, so
+//  a seek past the end reads as zeros)
+//  ~~ Records of a file stay together in one record block: when the next ones
+//     are taken, or more than INLINE_RECORDS are needed, the file moves to a
+//     data block instead
+//  Returns 0 when they cannot hold 'size' bytes
+unsigned int grow_inline_file(Volume* volume, File file, unsigned long size)
+{
+	#define freeRuns (*volume).freeRuns
+
+	unsigned long needed = (size + RECORD_INLINE_DATA_LENGTH - 1) / RECORD_INLINE_DATA_LENGTH;
+	if(needed <= (*file).inlineRecords)
+		return 1;
+
+	unsigned long nameRecords = (*file).inlineRecord - (*file).recordNumber;
+	if(needed > INLINE_RECORDS || nameRecords + needed > MAX_FILE_RECORDS)
+		return 0;
+
+	// THE RECORDS AFTER THE FILE MUST START A FREE RUN IN THE SAME BLOCK
+	unsigned long entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY;
+	unsigned long end = (*file).inlineRecord + (*file).inlineRecords;
+	unsigned long more = needed - (*file).inlineRecords;
+
+	if((end % entriesPerBlock) == 0 || freeRuns.runLength[end] < more)
+		return 0;
+
+	unsigned long runLength = freeRuns.runLength[end];
+	remove_free_run(volume, end);
+	if(runLength > more)
+		add_free_run(volume, end + more, runLength - more);
+
+	// PARENT RECORD COUNTS THEM, EACH RECORD GETS ITS NEW REMAINING COUNT
+	unsigned long absBlockNumber, recordOffset;
+	locate_record(&(*volume).info, (*file).recordNumber, &absBlockNumber, &recordOffset);
+
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	if(cache_read_block(blockData, absBlockNumber) != 1)
+	{
+		release_records(volume, end, more);
+		sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+		return 0;
+	}
+
+	unsigned int totalRecords = nameRecords + needed;
+
+	for(unsigned int clusterIndex = 0; clusterIndex < totalRecords; clusterIndex++)
+	{
+		char* record = blockData + recordOffset + (clusterIndex * SIZE_OF_RECORD_ENTRY);
+
+		unsigned char fileAttr;
+		memcpy(&fileAttr, record, sizeof(char));
+
+		// New inline data record, zeroized
+		if(clusterIndex >= nameRecords + (*file).inlineRecords)
+		{
+			fileAttr = 128 | RECORD_INLINE_FLAG;
+			memset(record + RECORD_INLINE_DATA_OFFSET, 0, RECORD_INLINE_DATA_LENGTH);
+		}
+
+		fileAttr = (fileAttr & ~15) | (totalRecords - clusterIndex);
+		memcpy(record, &fileAttr, sizeof(char));
+	}
+
+	memcpy(blockData + recordOffset + RECORD_FIRST_BLOCK_OFFSET, &needed, sizeof(unsigned long));
+
+	unsigned int success = cache_write_block(blockData, absBlockNumber);
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+
+	if(success != 1)
+	{
+		release_records(volume, end, more);
+		return 0;
+	}
+
+	(*file).inlineRecords = needed;
+	return 1;
+
+	#undef freeRuns
+}
+
+// Moves the bytes of inline 'file' into a first data block, points its parent
+//  record at it and frees its inline data records
+//  Returns 0 (Error set) when out of space
+unsigned int promote_inline_file(Volume* volume, File file)
+{
+	unsigned long firstBlock, dataBlock;
+	ExtentMap* extentMap;
+
+	if(allocate_first_block(volume, &firstBlock, &dataBlock, &extentMap) != 1)
+		return 0;
+
+	// COPY THE BYTES OVER
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	memset(blockData, 0, SOFTWARE_DISK_BLOCK_SIZE);
+
+	transfer_inline(volume, file, blockData, 0, (*file).fileSize, 0);
+	cache_write_block(blockData, dataBlock + (*volume).info.firstDataBlock);
+
+	// PARENT RECORD POINTS AT THE BLOCK, THE INLINE DATA RECORDS GO
+	unsigned long absBlockNumber, recordOffset;
+	locate_record(&(*volume).info, (*file).recordNumber, &absBlockNumber, &recordOffset);
+	cache_read_block(blockData, absBlockNumber);
+
+	unsigned char fileAttr;
+	memcpy(&fileAttr, blockData + recordOffset, sizeof(char));
+
+	fileAttr = (fileAttr & ~(RECORD_INLINE_FLAG | 15)) | ((fileAttr & 15) - (*file).inlineRecords);
+	memcpy(blockData + recordOffset, &fileAttr, sizeof(char));
+	memcpy(blockData + recordOffset + RECORD_FIRST_BLOCK_OFFSET, &firstBlock, sizeof(unsigned long));
+
+	unsigned long inlineOffset = recordOffset + (((*file).inlineRecord - (*file).recordNumber) * SIZE_OF_RECORD_ENTRY);
+	memset(blockData + inlineOffset, 0, (*file).inlineRecords * SIZE_OF_RECORD_ENTRY);
+
+	cache_write_block(blockData, absBlockNumber);
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+
+	if((*file).inlineRecords != 0)
+		release_records(volume, (*file).inlineRecord, (*file).inlineRecords);
+
+	// FROM NOW ON A FILE OF BLOCKS (filePos is within block 0)
+	(*file).startingBlock = firstBlock;
+	(*file).currentBlock = dataBlock;
+	(*file).extentMap = extentMap;
+	(*file).inlineRecords = 0;
+
+	if(extentMap == NULL)
+		append_block_map(file, firstBlock);
+
+	return 1;
+}
+
+// ========== NAME INDEX ==========
+// ================================
+
+// FNV-1a hash of 'name', mixed so its low bits (the home slot) depend on every byte
+unsigned int name_hash(char *name)
+{
+	unsigned int hash = 2166136261u;
+
+	for(unsigned char* c = (unsigned char*)name; *c != 0; c++)
+	{
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bu;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35u;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+// Follows the probe sequence of 'name' up to the first empty slot,
+//  checking the records of slots with the same hash
+//  ~~ Usually one index block and one record block read
+unsigned long index_lookup(Volume* volume, char *name)
+{
+	unsigned int hash = name_hash(name);
+	unsigned int recordsRequired = records_for_name(name);
+	unsigned long numSlots = index_slots(&(*volume).info);
+
+	unsigned long found = NO_RECORD;
+
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+
+	for(unsigned long probe = 0; probe < numSlots; probe++)
+	{
+		unsigned long slot = (hash + probe) & (numSlots - 1);
+
+		unsigned int slotHash;
+		unsigned long recordNumber;
+		get_index_entry(volume, slot, &slotHash, &recordNumber);
+
+		// END OF PROBE SEQUENCE, FILE NOT FOUND
+		if(recordNumber == NO_RECORD)
+			break;
+
+		if(slotHash != hash)
+			continue;
+
+		// SAME HASH, COMPARE THE NAME ITSELF
+		unsigned long absBlockNumber, recordOffset;
+		locate_record(&(*volume).info, recordNumber, &absBlockNumber, &recordOffset);
+		cache_read_block(blockData, absBlockNumber);
+
+		unsigned char fileAttr;
+		memcpy(&fileAttr, blockData + recordOffset, sizeof(char));
+
+		if(name_records_of(blockData + recordOffset) == recordsRequired && record_name_matches(blockData + recordOffset, recordsRequired, name))
+		{
+			found = recordNumber;
+			break;
+		}
+	}
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+	return found;
+}
+
+// Puts 'recordNumber' in the first empty slot of the probe sequence of 'name'
+//  Returns 0 if every slot is taken (formatfs sizes the index so none is)
+unsigned int index_insert(Volume* volume, char *name, unsigned long recordNumber)
+{
+	unsigned int hash = name_hash(name);
+	unsigned long numSlots = index_slots(&(*volume).info);
+
+	for(unsigned long probe = 0; probe < numSlots; probe++)
+	{
+		unsigned long slot = (hash + probe) & (numSlots - 1);
+
+		unsigned int slotHash;
+		unsigned long slotRecord;
+		get_index_entry(volume, slot, &slotHash, &slotRecord);
+
+		if(slotRecord == NO_RECORD)
+			return write_index_entry(volume, slot, hash, recordNumber);
+	}
+
+	return 0;
+}
+
+// Empties the slot of 'recordNumber', then moves later entries of the cluster
+//  back into the hole when that keeps them reachable from their home slot
+//  ~~ No tombstones, so probe sequences never grow from deletions
+unsigned int index_remove(Volume* volume, char *name, unsigned long recordNumber)
+{
+	unsigned int hash = name_hash(name);
+	unsigned long numSlots = index_slots(&(*volume).info);
+	unsigned long mask = numSlots - 1;
+
+	unsigned int slotHash;
+	unsigned long slotRecord;
+
+	// FIND THE SLOT
+	unsigned long hole = hash & mask;
+	unsigned long probe;
+	for(probe = 0; probe < numSlots; probe++)
+	{
+		get_index_entry(volume, hole, &slotHash, &slotRecord);
+
+		if(slotRecord == NO_RECORD)
+			return 0;
+		if(slotRecord == recordNumber)
+			break;
+
+		hole = (hole + 1) & mask;
+	}
+
+	if(probe == numSlots)
+		return 0;
+
+	// SHIFT THE REST OF THE CLUSTER BACK
+	unsigned long slot = hole;
+	for(;;)
+	{
+		slot = (slot + 1) & mask;
+
+		get_index_entry(volume, slot, &slotHash, &slotRecord);
+		if(slotRecord == NO_RECORD)
+			break;
+
+		// Hole lies between the entry's home slot and where it sits now
+		unsigned long home = slotHash & mask;
+		if(((slot - hole) & mask) <= ((slot - home) & mask))
+		{
+			write_index_entry(volume, hole, slotHash, slotRecord);
+			hole = slot;
+		}
+	}
+
+	return write_index_entry(volume, hole, 0, NO_RECORD);
+}
+
+// Reads slot 'slot' of the name index, NO_RECORD for an empty slot
+void get_index_entry(Volume* volume, unsigned long slot, unsigned int* hash, unsigned long* recordNumber)
+{
+	unsigned long absBlockNumber, entryOffset;
+	locate_index_entry(&(*volume).info, slot, &absBlockNumber, &entryOffset);
+
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	cache_read_block(blockData, absBlockNumber);
+
+	unsigned int storedRecord;
+	memcpy(hash, blockData + entryOffset, sizeof(unsigned int));
+	memcpy(&storedRecord, blockData + entryOffset + INDEX_RECORD_OFFSET, sizeof(unsigned int));
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+
+	if(storedRecord == 0)
+		*recordNumber = NO_RECORD;
+	else
+		*recordNumber = storedRecord - 1;
+}
+
+// Sets slot 'slot' of the name index, NO_RECORD empties it
+unsigned int write_index_entry(Volume* volume, unsigned long slot, unsigned int hash, unsigned long recordNumber)
+{
+	unsigned long absBlockNumber, entryOffset;
+	locate_index_entry(&(*volume).info, slot, &absBlockNumber, &entryOffset);
+
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	cache_read_block(blockData, absBlockNumber);
+
+	unsigned int storedRecord = 0;
+	if(recordNumber != NO_RECORD)
+		storedRecord = recordNumber + 1;
+
+	memcpy(blockData + entryOffset, &hash, sizeof(unsigned int));
+	memcpy(blockData + entryOffset + INDEX_RECORD_OFFSET, &storedRecord, sizeof(unsigned int));
+	int success = cache_write_block(blockData, absBlockNumber);
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+	return success;
+}
+
+// Number of records needed to hold 'name': the parent record, then as many
+//  name records as the rest of it takes
+unsigned int records_for_name(char *name)
+{
+	unsigned long nameLength = strlen(name);
+
+	if(nameLength <= RECORD_PARENT_NAME_LENGTH)
+		return 1;
+
+	return 1 + (nameLength - RECORD_PARENT_NAME_LENGTH + RECORD_NAME_LENGTH - 1) / RECORD_NAME_LENGTH;
+}
+
+// Offset in record 'internalIndex' of a file of its piece of the name, setting
+//  '*fieldLength' to the bytes of the name that piece holds at most
+//  ~~ The parent record shares itself with the first block and the size
+unsigned long record_name_field(unsigned int internalIndex, unsigned long* fieldLength)
+{
+	if(internalIndex == 0)
+	{
+		*fieldLength = RECORD_PARENT_NAME_LENGTH;
+		return RECORD_PARENT_NAME_OFFSET;
+	}
+
+	*fieldLength = RECORD_NAME_LENGTH;
+	return RECORD_NAME_OFFSET;
+}
+
+// Compares 'name' against the name stored in the 'numRecords' records at 'entry'
+//  Returns 1 on match
+int record_name_matches(char *entry, unsigned int numRecords, char *name)
+{
+	unsigned long nameLength = strlen(name);
+	unsigned long checked = 0;
+
+	for(unsigned int internalIndex = 0; internalIndex < numRecords; internalIndex++)
+	{
+		unsigned long fieldLength;
+		char* chunk = entry + (internalIndex * SIZE_OF_RECORD_ENTRY) + record_name_field(internalIndex, &fieldLength);
+
+		unsigned long chunkLength = nameLength - checked;
+		if(chunkLength > fieldLength)
+			chunkLength = fieldLength;
+
+		if(memcmp(chunk, name + checked, chunkLength) != 0)
+			return 0;
+
+		// Stored name must end where 'name' ends
+		if(chunkLength < fieldLength && chunk[chunkLength] != 0)
+			return 0;
+
+		checked += chunkLength;
+	}
+
+	return checked == nameLength;
+}
+
+
+// ========== FILE TRANSFERS ==========
+// ====================================
+
+// Finds the data block holding the byte before 'bytepos' in 'file' (out of its
+//  records) for '*blockIndexPtr', growing the file to 'bytepos' as seek_file does:
+//  what lies past the end is a hole (FAT_END_OF_CHAIN) until written
+//  ~~ A chain is walked from the end of its block map on, recording the holes
+//  Returns 0 when the block map cannot grow
+unsigned int position_file(Volume* volume, File file, unsigned long bytepos, unsigned long* blockIndexPtr)
+{
+	// How many blocks we are seeking into
+	unsigned long numBlocks = block_index_of(bytepos);
+
+	if((*file).extentMap == NULL && map_chain(volume, file, numBlocks) != 1)
+		return 0;
+
+	if(bytepos > (*file).fileSize)
+	{
+		(*file).fileSize = bytepos;
+		update_file_size(volume, (*file).recordNumber, bytepos);
+	}
+
+	*blockIndexPtr = lookup_file_block(file, numBlocks);
+	return 1;
+}
+
+// Reads 'numbytes' (all before EOF) of 'file' from byte 'pos' on into 'buf';
+//  '*blockIndexPtr' is the data block holding the byte before 'pos' (see
+//  seek_file) and is left on the last block read
+//  ~~ Neither the position nor the read-ahead state of the handle change
+//  Returns the number of bytes read
+unsigned long read_blocks(Volume* volume, File file, void* buf, unsigned long numbytes, unsigned long pos, unsigned long* blockIndexPtr)
+{
+	#define firstDataBlock (*volume).info.firstDataBlock
+
+	// Position in Current Block (may equal SOFTWARE_DISK_BLOCK_SIZE, see seek_file)
+	unsigned long relativePos = pos - (block_index_of(pos) * SOFTWARE_DISK_BLOCK_SIZE);
+
+	unsigned long bytesRead = 0;
+
+	unsigned long batchCapacity = batch_capacity(relativePos, numbytes);
+	char* batchData = sd_alloc_buffer(batchCapacity * SOFTWARE_DISK_BLOCK_SIZE);
+	SDRequest* runs = malloc(batchCapacity * sizeof(SDRequest));
+
+	unsigned long currentBlockIndex = *blockIndexPtr;
+	unsigned long fileBlock = block_index_of(pos);
+
+	// The hole a handle was left in may have been written since (write_file_at);
+	//  a block without data before EOF reads as zeros
+	if(currentBlockIndex == FAT_END_OF_CHAIN)
+		currentBlockIndex = file_block(volume, file, fileBlock);
+
+	while(bytesRead < numbytes)
+	{
+		// ========== CONTEXT SWITCHING ==========
+		// =======================================
+			// CURRENT BLOCK EXHAUSTED, MOVE TO NEXT IN FILE
+			if(relativePos == SOFTWARE_DISK_BLOCK_SIZE)
+			{
+				fileBlock++;
+				currentBlockIndex = file_block(volume, file, fileBlock);
+				relativePos = 0;
+			}
+
+		// ========== BATCH BUILDING ==========
+		// ====================================
+			// COLLECT THE FILE AS RUNS OF PHYSICALLY CONTIGUOUS BLOCKS (WHOLE BLOCKS INTO 'buf')
+			char* userData = (char*)buf + bytesRead;
+			unsigned long remaining = numbytes - bytesRead;
+			unsigned long numRuns = 0;
+			unsigned long batchLength = 0;
+			unsigned long batchBytes = SOFTWARE_DISK_BLOCK_SIZE - relativePos;
+
+			add_read_block(runs, &numRuns, batch_block_buffer(batchData, userData, batchLength++, relativePos, remaining), currentBlockIndex, firstDataBlock);
+
+			while(batchBytes < remaining && batchLength < batchCapacity)
+			{
+				fileBlock++;
+				currentBlockIndex = file_block(volume, file, fileBlock);
+				add_read_block(runs, &numRuns, batch_block_buffer(batchData, userData, batchLength++, relativePos, remaining), currentBlockIndex, firstDataBlock);
+				batchBytes += SOFTWARE_DISK_BLOCK_SIZE;
+			}
+
+		// ========== DATA READING ==========
+		// ==================================
+			// ALL RUNS OF THE BATCH SUBMITTED TOGETHER (NONE IF IT IS ALL HOLES)
+			if(numRuns > 0)
+				cache_read_runs(runs, numRuns);
+
+			unsigned long chunk = remaining;
+			if(chunk > batchBytes)
+				chunk = batchBytes;
+
+			// ONLY PARTIAL BLOCKS WENT THROUGH THE BATCH BUFFER
+			copy_batch_edges(batchData, userData, batchLength, relativePos, chunk, 0);
+			bytesRead += chunk;
+
+			// POSITION WITHIN LAST BLOCK OF THE BATCH
+			relativePos = relativePos + chunk - ((batchLength - 1) * SOFTWARE_DISK_BLOCK_SIZE);
+	}
+
+	free(runs);
+	sd_free_buffer(batchData, batchCapacity * SOFTWARE_DISK_BLOCK_SIZE);
+
+	*blockIndexPtr = currentBlockIndex;
+
+	return bytesRead;
+
+	#undef firstDataBlock
+}
+
+// Writes 'numbytes' from 'buf' to 'file' from byte 'pos' on, allocating blocks as
+//  it crosses their boundaries and growing the file size; '*blockIndexPtr' is the
+//  data block holding the byte before 'pos' and is left on the last block written
+//  ~~ The file must be out of its records; the position of the handle does not change
+//  ~~ Called with the file and volume locks held; the volume lock is let go while
+//     the data of a batch moves, its blocks being the file's already
+//  Returns the number of bytes written
+unsigned long write_blocks(Volume* volume, File file, void* buf, unsigned long numbytes, unsigned long pos, unsigned long* blockIndexPtr)
+{
+	#define firstDataBlock (*volume).info.firstDataBlock
+
+	// Position in Current Block (may equal SOFTWARE_DISK_BLOCK_SIZE, see seek_file)
+	unsigned long relativePos = pos - (block_index_of(pos) * SOFTWARE_DISK_BLOCK_SIZE);
+
+	unsigned long bytesWritten = 0;
+
+	unsigned long batchCapacity = batch_capacity(relativePos, numbytes);
+	char* batchData = sd_alloc_buffer(batchCapacity * SOFTWARE_DISK_BLOCK_SIZE);
+	SDRequest* runs = malloc(batchCapacity * sizeof(SDRequest));
+
+	unsigned long currentBlockIndex = *blockIndexPtr;
+	unsigned long fileBlock = block_index_of(pos);
+
+	// Blocks from here on are allocated by this write, unzeroized: nothing to keep in
+	//  them.  Holes before it are zeroized when filled, around a partial write
+	unsigned long storedBlocks = block_index_of((*file).fileSize) + 1;
+
+	while(bytesWritten < numbytes)
+	{
+		// ========== CONTEXT SWITCHING ==========
+		// =======================================
+			// CURRENT BLOCK FULL, MOVE TO NEXT IN FILE
+			if(relativePos == SOFTWARE_DISK_BLOCK_SIZE)
+			{
+				if(extend_file(volume, file, &currentBlockIndex, fileBlock + 1, fileBlock + 1 < storedBlocks) != 1)
+					break;
+
+				fileBlock++;
+				relativePos = 0;
+			}
+			// POSITION IN A HOLE OF A SPARSE FILE, ITS BLOCK IS ALLOCATED NOW
+			else if(currentBlockIndex == FAT_END_OF_CHAIN)
+			{
+				if(extend_file(volume, file, &currentBlockIndex, fileBlock, fileBlock < storedBlocks) != 1)
+					break;
+			}
+
+		// ========== BATCH BUILDING ==========
+		// ====================================
+			// COLLECT (AND GROW) THE FILE AS RUNS OF PHYSICALLY CONTIGUOUS BLOCKS (WHOLE BLOCKS FROM 'buf')
+			char* userData = (char*)buf + bytesWritten;
+			unsigned long remaining = numbytes - bytesWritten;
+			unsigned long batchFileBlock = fileBlock;
+			unsigned long numRuns = 0;
+			unsigned long batchLength = 0;
+			unsigned long batchBytes = SOFTWARE_DISK_BLOCK_SIZE - relativePos;
+
+			add_to_batch(runs, &numRuns, batch_block_buffer(batchData, userData, batchLength++, relativePos, remaining), currentBlockIndex + firstDataBlock);
+
+			while(batchBytes < remaining && batchLength < batchCapacity)
+			{
+				if(extend_file(volume, file, &currentBlockIndex, fileBlock + 1, fileBlock + 1 < storedBlocks) != 1)
+					break;
+
+				fileBlock++;
+				add_to_batch(runs, &numRuns, batch_block_buffer(batchData, userData, batchLength++, relativePos, remaining), currentBlockIndex + firstDataBlock);
+				batchBytes += SOFTWARE_DISK_BLOCK_SIZE;
+			}
+
+		// ========== DATA WRITING ==========
+		// ==================================
+			// OTHER FILES MAY ALLOCATE MEANWHILE
+			pthread_mutex_unlock(&(*volume).lock);
+
+			unsigned long chunk = remaining;
+			if(chunk > batchBytes)
+				chunk = batchBytes;
+
+			// PARTIAL HEAD AND TAIL BLOCKS KEEP THEIR OLD BYTES, NEW ONES ARE ZEROED AROUND THE DATA
+			SDRequest edges[2];
+			unsigned long numEdges = 0;
+			unsigned long batchEnd = relativePos + chunk;
+			unsigned long tailIndex = batchLength - 1;
+
+			if(relativePos != 0)
+			{
+				if(batchFileBlock >= storedBlocks)
+					memset(batchData, 0, SOFTWARE_DISK_BLOCK_SIZE);
+				else
+					add_to_batch(edges, &numEdges, batchData, runs[0].blocknum);
+			}
+			if((batchEnd % SOFTWARE_DISK_BLOCK_SIZE) != 0 && (batchLength > 1 || relativePos == 0))
+			{
+				if(batchFileBlock + tailIndex >= storedBlocks)
+					memset(batchData + (tailIndex * SOFTWARE_DISK_BLOCK_SIZE), 0, SOFTWARE_DISK_BLOCK_SIZE);
+				else
+					add_to_batch(edges, &numEdges, batchData + (tailIndex * SOFTWARE_DISK_BLOCK_SIZE), currentBlockIndex + firstDataBlock);
+			}
+			if(numEdges > 0)
+				cache_read_runs(edges, numEdges);
+
+			// ONLY PARTIAL BLOCKS GO THROUGH THE BATCH BUFFER
+			copy_batch_edges(batchData, userData, batchLength, relativePos, chunk, 1);
+
+			// ALL RUNS OF THE BATCH SUBMITTED TOGETHER
+			cache_write_runs(runs, numRuns);
+
+			pthread_mutex_lock(&(*volume).lock);
+
+			bytesWritten += chunk;
+
+			// POSITION WITHIN LAST BLOCK OF THE BATCH
+			relativePos = batchEnd - ((batchLength - 1) * SOFTWARE_DISK_BLOCK_SIZE);
+
+			// CHAIN COULD NOT GROW ANY FURTHER
+			if(Error != FS_NONE)
+				break;
+	}
+
+	free(runs);
+	sd_free_buffer(batchData, batchCapacity * SOFTWARE_DISK_BLOCK_SIZE);
+
+	if((*file).extentMap != NULL)
+		flush_extent_map(volume, (*file).extentMap);
+
+	// CHECK FOR FILE SIZE INCREASE
+	if((pos + bytesWritten) > (*file).fileSize)
+	{
+		(*file).fileSize = pos + bytesWritten;
+		update_file_size(volume, (*file).recordNumber, (*file).fileSize);
+	}
+
+	*blockIndexPtr = currentBlockIndex;
+
+	return bytesWritten;
+
+	#undef firstDataBlock
+}
+
+// ========== WRITE BUFFERING ==========
+// =====================================
+
+// Buffers the append of 'numbytes' from 'buf' at the end of 'file', reserving
+//  the blocks they will need so the flush cannot run out of space
+//  ~~ While bytes are buffered, filePos == fileSize == bufferStart + bufferedBytes
+//     and currentBlock is still the block of bufferStart
+//  Returns 0 when the write has to go through instead (not an append, too large,
+//  or not enough free blocks to promise)
+unsigned int buffer_write(Volume* volume, File file, void* buf, unsigned long numbytes)
+{
+	unsigned long capacity = WRITE_BUFFER_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE;
+
+	if(numbytes == 0 || numbytes >= capacity || (*file).filePos != (*file).fileSize)
+		return 0;
+
+	// FULL: WRITE IT OUT AND START OVER AT THE NEW END
+	if((*file).bufferedBytes + numbytes > capacity)
+	{
+		if(flush_write_buffer(volume, file) != 1)
+			return 0;
+	}
+
+	if((*file).writeBuffer == NULL)
+	{
+		(*file).writeBuffer = malloc(capacity);
+		if((*file).writeBuffer == NULL)
+			return 0;
+	}
+
+	if((*file).bufferedBytes == 0)
+		(*file).bufferStart = (*file).fileSize;
+
+	// RESERVE WHAT THE WHOLE BUFFER NEEDS
+	unsigned long newEnd = (*file).bufferStart + (*file).bufferedBytes + numbytes;
+	unsigned long needed = blocks_to_grow(volume, file, (*file).bufferStart, newEnd);
+
+	if(needed > (*file).reservedBlocks)
+	{
+		unsigned long available = 0;
+		if((*volume).freeBlocks > (*volume).reservedBlocks)
+			available = (*volume).freeBlocks - (*volume).reservedBlocks;
+
+		if(needed - (*file).reservedBlocks > available)
+			return 0;
+
+		(*volume).reservedBlocks += needed - (*file).reservedBlocks;
+		(*file).reservedBlocks = needed;
+	}
+
+	memcpy((*file).writeBuffer + (*file).bufferedBytes, buf, numbytes);
+	(*file).bufferedBytes += numbytes;
+
+	(*file).fileSize = newEnd;
+	(*file).filePos = newEnd;
+
+	return 1;
+}
+
+// Writes the appends buffered by 'file' through to it in one go: the blocks
+//  for all of them are allocated together, so next-fit keeps them contiguous,
+//  and the record is updated once
+//  Returns 0 on failure
+unsigned int flush_write_buffer(Volume* volume, File file)
+{
+	if((*file).bufferedBytes == 0)
+		return 1;
+
+	unsigned long numbytes = (*file).bufferedBytes;
+
+	// The reserved blocks are the ones about to be allocated
+	(*volume).reservedBlocks -= (*file).reservedBlocks;
+	(*file).reservedBlocks = 0;
+	(*file).bufferedBytes = 0;
+
+	(*file).fileSize = (*file).bufferStart;
+	(*file).filePos = (*file).bufferStart;
+
+	return write_through(volume, file, (*file).writeBuffer, numbytes) == numbytes;
+}
+
+// Most blocks 'file' allocates growing from 'fromSize' to 'toSize' bytes: its data
+//  blocks and, on an extent volume, the tree nodes if every block were an extent
+unsigned long blocks_to_grow(Volume* volume, File file, unsigned long fromSize, unsigned long toSize)
+{
+	unsigned long inlineCapacity = (*file).inlineRecords * RECORD_INLINE_DATA_LENGTH;
+
+	// Stays in the records it has (more may not be free when it gets there)
+	if(is_inline(file) && toSize <= inlineCapacity)
+		return 0;
+
+	unsigned long have = (fromSize + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+	unsigned long want = (toSize + SOFTWARE_DISK_BLOCK_SIZE - 1) / SOFTWARE_DISK_BLOCK_SIZE;
+
+	// A file out of its records always has its first block, an inline one none yet
+	if(have == 0)
+		have = 1;
+	if(is_inline(file))
+		have = 0;
+	if(want == 0)
+		want = 1;
+
+	unsigned long blocks = (want > have) ? want - have : 0;
+
+	// The partial block the growth starts in may be a hole
+	if(!is_inline(file) && (fromSize % SOFTWARE_DISK_BLOCK_SIZE) != 0 && file_block(volume, file, block_index_of(fromSize)) == FAT_END_OF_CHAIN)
+		blocks++;
+
+	if((*volume).info.features & FS_FEATURE_EXTENTS)
+	{
+		if(is_inline(file))
+			blocks += extent_tree_nodes(blocks, NULL, NULL);
+		else if((*file).extentMap != NULL)
+		{
+			unsigned long nodes = extent_tree_nodes((*(*file).extentMap).numExtents + blocks, NULL, NULL);
+			if(nodes > (*(*file).extentMap).numNodes)
+				blocks += nodes - (*(*file).extentMap).numNodes;
+		}
+	}
+
+	return blocks;
+}
+
+// Writes 'numbytes' from 'buf' at the position of 'file', allocating blocks as it
+//  crosses their boundaries (write_file without the buffering)
+//  Returns the number of bytes written
+unsigned long write_through(Volume* volume, File file, void* buf, unsigned long numbytes)
+{
+	unsigned long recordNumber = (*file).recordNumber;
+
+	// INLINE FILE: WRITTEN IN ITS RECORDS WHILE IT FITS, MOVED TO A DATA BLOCK OTHERWISE
+	if(is_inline(file))
+	{
+		if(grow_inline_file(volume, file, (*file).filePos + numbytes) == 1)
+		{
+			transfer_inline(volume, file, buf, (*file).filePos, numbytes, 1);
+			(*file).filePos += numbytes;
+
+			if((*file).filePos > (*file).fileSize)
+			{
+				(*file).fileSize = (*file).filePos;
+				update_file_size(volume, recordNumber, (*file).fileSize);
+			}
+
+			return numbytes;
+		}
+
+		if(promote_inline_file(volume, file) != 1)
+			return 0;
+	}
+
+	unsigned long bytesWritten = write_blocks(volume, file, buf, numbytes, (*file).filePos, &(*file).currentBlock);
+	(*file).filePos += bytesWritten;
+
+	return bytesWritten;
+}
+
+
+// ========== EXTENTS ==========
+// =============================
+
+// Returns the data block holding block 'fileBlock' of 'file' from memory: the
+//  extents, or the block map of a chain (which only covers the blocks walked so far)
+//  Returns FAT_END_OF_CHAIN in a hole or past the block map
+unsigned long lookup_file_block(File file, unsigned long fileBlock)
+{
+	if((*file).extentMap != NULL)
+		return extent_lookup((*file).extentMap, fileBlock);
+
+	if(fileBlock < (*file).mappedBlocks)
+		return (*file).blockMap[fileBlock];
+
+	// Block 0 is known even if the map could not be started
+	if(fileBlock == 0)
+		return (*file).startingBlock;
+
+	return FAT_END_OF_CHAIN;
+}
+
+// Makes room in the block map of 'file' for 'numBlocks' file blocks, doubling its capacity
+//  Returns 0 on failure (the map stays as it was)
+unsigned int reserve_block_map(File file, unsigned long numBlocks)
+{
+	if(numBlocks <= (*file).blockMapCapacity)
+		return 1;
+
+	unsigned long capacity = ((*file).blockMapCapacity != 0) ? (*file).blockMapCapacity * 2 : 16;
+	if(capacity < numBlocks)
+		capacity = numBlocks;
+
+	unsigned long* blockMap = realloc((*file).blockMap, capacity * sizeof(unsigned long));
+	if(blockMap == NULL)
+		return 0;
+
+	(*file).blockMap = blockMap;
+	(*file).blockMapCapacity = capacity;
+	return 1;
+}
+
+// Appends data block 'blockIndex' to the block map of 'file'
+//  Returns 0 on failure (the map stays as it was)
+unsigned int append_block_map(File file, unsigned long blockIndex)
+{
+	if(reserve_block_map(file, (*file).mappedBlocks + 1) != 1)
+		return 0;
+
+	(*file).blockMap[(*file).mappedBlocks++] = blockIndex;
+	return 1;
+}
+
+// Walks the chain of 'file' from the last block of its block map on until the map
+//  covers block 'fileBlock' or the chain ends, recording the holes skipped on the way
+//  ~~ Past the end of the chain, up to EOF, the file is a hole; the map never covers it
+//  Returns 0 when the map cannot grow
+unsigned int map_chain(Volume* volume, File file, unsigned long fileBlock)
+{
+	if((*file).mappedBlocks == 0 && append_block_map(file, (*file).startingBlock) != 1)
+		return 0;
+
+	while((*file).mappedBlocks <= fileBlock)
+	{
+		unsigned long entryValue = get_next_data_block(volume, (*file).blockMap[(*file).mappedBlocks - 1]);
+		if(entryValue == FAT_END_OF_CHAIN)
+			return 1;
+
+		unsigned long holes = fat_holes(entryValue);
+		if(reserve_block_map(file, (*file).mappedBlocks + holes + 1) != 1)
+			return 0;
+
+		for(; holes > 0; holes--)
+			(*file).blockMap[(*file).mappedBlocks++] = FAT_END_OF_CHAIN;
+
+		(*file).blockMap[(*file).mappedBlocks++] = fat_next(entryValue);
+	}
+
+	return 1;
+}
+
+// Returns the data block holding block 'fileBlock' of 'file', following the FAT
+//  past the block map of a chain (which grows as it is walked)
+//  Returns FAT_END_OF_CHAIN in a hole or past the last one
+unsigned long file_block(Volume* volume, File file, unsigned long fileBlock)
+{
+	if((*file).extentMap == NULL && fileBlock >= (*file).mappedBlocks)
+		map_chain(volume, file, fileBlock);
+
+	return lookup_file_block(file, fileBlock);
+}
+
+// Allocates a data block for block 'fileBlock' of the chain of 'file' (zeroized if
+//  'zeroize'), a hole or past the end of the chain, and links it between the blocks
+//  around it.  Block 0 always has its data block
+//  ~~ A hole too long for one FAT entry to count gets zeroized blocks in between
+//  Returns FAT_END_OF_CHAIN on failure (Error set when out of space)
+unsigned long fill_chain_hole(Volume* volume, File file, unsigned long fileBlock, unsigned int zeroize)
+{
+	#define blockMap (*file).blockMap
+	#define mappedBlocks (*file).mappedBlocks
+
+	if(map_chain(volume, file, fileBlock) != 1 || reserve_block_map(file, fileBlock + 1) != 1)
+		return FAT_END_OF_CHAIN;
+
+	// TOO FAR PAST THE END FOR ONE ENTRY: BRIDGE THE HOLE FIRST
+	if(fileBlock >= mappedBlocks && fileBlock - mappedBlocks > FAT_MAX_HOLE)
+	{
+		if(fill_chain_hole(volume, file, mappedBlocks + FAT_MAX_HOLE, 1) == FAT_END_OF_CHAIN)
+			return FAT_END_OF_CHAIN;
+
+		return fill_chain_hole(volume, file, fileBlock, zeroize);
+	}
+
+	// The blocks of the chain around it: the last one before, the first one after (if any)
+	unsigned long before = (fileBlock < mappedBlocks) ? fileBlock - 1 : mappedBlocks - 1;
+	while(blockMap[before] == FAT_END_OF_CHAIN)
+		before--;
+
+	unsigned long after = fileBlock + 1;
+	while(after < mappedBlocks && blockMap[after] == FAT_END_OF_CHAIN)
+		after++;
+
+	unsigned long newBlock = get_free_data_block(volume);
+	if(newBlock == FAT_END_OF_CHAIN)
+	{
+		Error = FS_OUT_OF_SPACE;
+		return FAT_END_OF_CHAIN;
+	}
+
+	if(allocate_data_block(volume, NULL, newBlock, zeroize) != 1)
+	{
+		printf("Internal FileSystem Error - Failed to Allocate Next Block\n");
+		return FAT_END_OF_CHAIN;
+	}
+
+	// LINK IT IN: THE HOLE IT WAS IN IS SPLIT IN TWO
+	if(after < mappedBlocks)
+		write_fat_entry(volume, newBlock, fat_link(after - fileBlock - 1, blockMap[after]));
+
+	write_fat_entry(volume, blockMap[before], fat_link(fileBlock - before - 1, newBlock));
+
+	for(; mappedBlocks < fileBlock; mappedBlocks++)
+		blockMap[mappedBlocks] = FAT_END_OF_CHAIN;
+
+	blockMap[fileBlock] = newBlock;
+	if(mappedBlocks == fileBlock)
+		mappedBlocks++;
+
+	return newBlock;
+
+	#undef blockMap
+	#undef mappedBlocks
+}
+
+// Moves '*blockIndexPtr' to block 'nextFileBlock' of 'file', allocating it in a
+//  hole or past the end of the file (zeroized if 'zeroize').  Returns 1 on success,
+//  0 otherwise (Error set when out of space)
+unsigned int extend_file(Volume* volume, File file, unsigned long* blockIndexPtr, unsigned long nextFileBlock, unsigned int zeroize)
+{
+	ExtentMap* map = (*file).extentMap;
+
+	// CHAIN: KNOWN, OR FOLLOW IT, OR FILL THE HOLE
+	if(map == NULL)
+	{
+		unsigned long nextBlock = file_block(volume, file, nextFileBlock);
+
+		if(nextBlock == FAT_END_OF_CHAIN)
+			nextBlock = fill_chain_hole(volume, file, nextFileBlock, zeroize);
+
+		if(nextBlock == FAT_END_OF_CHAIN)
+			return 0;
+
+		*blockIndexPtr = nextBlock;
+		return 1;
+	}
+
+	unsigned long nextBlock = extent_lookup(map, nextFileBlock);
+
+	// PAST THE LAST EXTENT, ATTEMPT TO GROW THE FILE
+	if(nextBlock == FAT_END_OF_CHAIN)
+	{
+		nextBlock = map_extent_block(volume, map, nextFileBlock, zeroize);
+		if(nextBlock == FAT_END_OF_CHAIN)
+			return 0;
+	}
+
+	*blockIndexPtr = nextBlock;
+	return 1;
+}
+
+// Reads the extent tree rooted at data block 'rootBlock' one level after the
+//  other, so the leaves (and the extents in them) come in file order
+//  ~~ nodes: the root, the leaves, then the other index nodes (see flush_extent_map)
+//  Returns NULL on failure
+ExtentMap* load_extent_map(Volume* volume, unsigned long rootBlock)
+{
+	#define firstDataBlock (*volume).info.firstDataBlock
+	#define numDataBlocks (*volume).info.numDataBlocks
+
+	unsigned long leafEntries = (SOFTWARE_DISK_BLOCK_SIZE - EXTENT_NODE_HEADER_SIZE) / SIZE_OF_EXTENT_ENTRY;
+	unsigned long indexEntries = (SOFTWARE_DISK_BLOCK_SIZE - EXTENT_NODE_HEADER_SIZE) / SIZE_OF_EXTENT_INDEX_ENTRY;
+
+	ExtentMap* map = calloc(1, sizeof(ExtentMap));
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+
+	// Tree blocks in the order read (breadth first)
+	unsigned long* order = malloc(sizeof(unsigned long));
+	unsigned long numOrder = 1;
+	unsigned long firstLeaf = NO_RECORD;
+	unsigned int success = (map != NULL && order != NULL);
+
+	if(success)
+	{
+		(*map).firstDirty = NO_RECORD;
+		order[0] = rootBlock;
+	}
+
+	for(unsigned long i = 0; success && i < numOrder; i++)
+	{
+		if(order[i] >= numDataBlocks || cache_read_block(blockData, order[i] + firstDataBlock) != 1)
+		{
+			success = 0;
+			break;
+		}
+
+		unsigned long numEntries, depth;
+		memcpy(&numEntries, blockData, sizeof(unsigned long));
+		memcpy(&depth, blockData + sizeof(unsigned long), sizeof(unsigned long));
+
+		// LEAF: ITS EXTENTS FOLLOW THOSE OF THE LEAVES BEFORE IT
+		if(depth == 0)
+		{
+			if(firstLeaf == NO_RECORD)
+				firstLeaf = i;
+
+			if(numEntries > leafEntries || reserve_extents(map, (*map).numExtents + numEntries) != 1)
+			{
+				success = 0;
+				break;
+			}
+
+			// An empty leaf (a sparse file with nothing written) may have no array yet
+			if(numEntries != 0)
+				memcpy((*map).extents + (*map).numExtents, blockData + EXTENT_NODE_HEADER_SIZE, numEntries * SIZE_OF_EXTENT_ENTRY);
+			(*map).numExtents += numEntries;
+		}
+
+		// INDEX NODE: ITS CHILDREN JOIN THE NEXT LEVEL
+		else
+		{
+			unsigned long* grown = NULL;
+			if(numEntries <= indexEntries && firstLeaf == NO_RECORD && numOrder + numEntries <= numDataBlocks)
+				grown = realloc(order, (numOrder + numEntries) * sizeof(unsigned long));
+
+			if(grown == NULL)
+			{
+				success = 0;
+				break;
+			}
+			order = grown;
+
+			for(unsigned long j = 0; j < numEntries; j++)
+			{
+				unsigned long entryOffset = EXTENT_NODE_HEADER_SIZE + (j * SIZE_OF_EXTENT_INDEX_ENTRY);
+				memcpy(&order[numOrder++], blockData + entryOffset + sizeof(unsigned long), sizeof(unsigned long));
+			}
+		}
+	}
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+
+	if(firstLeaf == NO_RECORD)
+		success = 0;
+
+	if(success)
+		(*map).nodes = malloc(numOrder * sizeof(unsigned long));
+
+	if(!success || (*map).nodes == NULL)
+	{
+		free(order);
+		free_extent_map(map);
+		return NULL;
+	}
+
+	// ROOT, LEAVES, THEN THE INDEX NODES BETWEEN THEM
+	(*map).nodes[0] = rootBlock;
+	(*map).numNodes = 1;
+
+	if(firstLeaf != 0)
+	{
+		memcpy((*map).nodes + 1, order + firstLeaf, (numOrder - firstLeaf) * sizeof(unsigned long));
+		memcpy((*map).nodes + 1 + (numOrder - firstLeaf), order + 1, (firstLeaf - 1) * sizeof(unsigned long));
+		(*map).numNodes = numOrder;
+	}
+
+	free(order);
+	return map;
+
+	#undef firstDataBlock
+	#undef numDataBlocks
+}
+
+void free_extent_map(ExtentMap* map)
+{
+	if(map == NULL)
+		return;
 
-	// Write to Disk
-	write_sd_block(blockData, (parentRecordBlockNumber + firstRecordBlock));
+	free((*map).extents);
+	free((*map).nodes);
+	free(map);
+}
 
-	free(blockData);
-	return parentRecordIndex;
-	#undef firstRecordBlock
+// Makes room for 'numExtents' extents in 'map', doubling its capacity
+//  Returns 0 on failure
+unsigned int reserve_extents(ExtentMap* map, unsigned long numExtents)
+{
+	if(numExtents <= (*map).capacity)
+		return 1;
+
+	unsigned long capacity = ((*map).capacity != 0) ? (*map).capacity : 16;
+	while(capacity < numExtents)
+		capacity *= 2;
+
+	Extent* extents = realloc((*map).extents, capacity * sizeof(Extent));
+	if(extents == NULL)
+		return 0;
+
+	(*map).extents = extents;
+	(*map).capacity = capacity;
+	return 1;
+}
+
+// Returns the data block holding block 'fileBlock' of the file, searching the
+//  extents (sorted by fileBlock) for the last one starting at or before it
+//  Returns FAT_END_OF_CHAIN past the last one
+unsigned long extent_lookup(ExtentMap* map, unsigned long fileBlock)
+{
+	unsigned long low = 0;
+	unsigned long high = (*map).numExtents;
+
+	// low ends on the first extent starting past 'fileBlock'
+	while(low < high)
+	{
+		unsigned long middle = low + ((high - low) / 2);
+
+		if((*map).extents[middle].fileBlock <= fileBlock)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if(low == 0)
+		return FAT_END_OF_CHAIN;
+
+	Extent* extent = &(*map).extents[low - 1];
+	if(fileBlock - (*extent).fileBlock >= (*extent).length)
+		return FAT_END_OF_CHAIN;
+
+	return (*extent).startBlock + (fileBlock - (*extent).fileBlock);
+}
+
+// Number of file blocks mapped by 'map'
+unsigned long extent_map_blocks(ExtentMap* map)
+{
+	if((*map).numExtents == 0)
+		return 0;
+
+	Extent* last = &(*map).extents[(*map).numExtents - 1];
+	return (*last).fileBlock + (*last).length;
+}
+
+// Allocates a data block for block 'fileBlock' of 'map', which is past its end
+//  or in a hole: the extent ending right before it grows when the block follows
+//  it on disk too, otherwise a new extent starts there and the tree blocks it
+//  needs are allocated right away, so a flush never runs out of space
+//  ~~ The data block is zeroized if 'zeroize', tree blocks always are
+//  Returns FAT_END_OF_CHAIN (Error set) when out of space
+unsigned long map_extent_block(Volume* volume, ExtentMap* map, unsigned long fileBlock, unsigned int zeroize)
+{
+	#define extents (*map).extents
+	#define numExtents (*map).numExtents
+
+	unsigned long dataBlock = get_free_data_block(volume);
+	if(dataBlock == FAT_END_OF_CHAIN)
+		return FAT_END_OF_CHAIN;
+
+	if(allocate_data_block(volume, NULL, dataBlock, zeroize) != 1)
+		return FAT_END_OF_CHAIN;
+
+	// Extents before 'fileBlock' (the new one goes at this index)
+	unsigned long position = 0;
+	unsigned long high = numExtents;
+	while(position < high)
+	{
+		unsigned long middle = position + ((high - position) / 2);
+
+		if(extents[middle].fileBlock < fileBlock)
+			position = middle + 1;
+		else
+			high = middle;
+	}
+
+	// CONTIGUOUS IN THE FILE AND ON DISK, THE PREVIOUS EXTENT GROWS
+	if(position > 0)
+	{
+		Extent* previous = &extents[position - 1];
+
+		if((*previous).fileBlock + (*previous).length == fileBlock && (*previous).startBlock + (*previous).length == dataBlock)
+		{
+			(*previous).length++;
+
+			if((*map).firstDirty == NO_RECORD || (*map).firstDirty > position - 1)
+				(*map).firstDirty = position - 1;
+
+			return dataBlock;
+		}
+	}
+
+	// NEW EXTENT, RESERVE ITS TREE BLOCKS
+	unsigned int oldDepth, newDepth;
+	extent_tree_nodes(numExtents, NULL, &oldDepth);
+	unsigned long numNodes = extent_tree_nodes(numExtents + 1, NULL, &newDepth);
+
+	unsigned long reservedFrom = (*map).numNodes;
+	unsigned long* nodes = (*map).nodes;
+
+	if(numNodes > (*map).numNodes)
+		nodes = realloc((*map).nodes, numNodes * sizeof(unsigned long));
+
+	if(nodes == NULL || reserve_extents(map, numExtents + 1) != 1)
+	{
+		write_fat_entry(volume, dataBlock, 0);
+		return FAT_END_OF_CHAIN;
+	}
+	(*map).nodes = nodes;
+
+	while((*map).numNodes < numNodes)
+	{
+		unsigned long nodeBlock = get_free_data_block(volume);
+
+		// OUT OF SPACE, GIVE BACK WHAT THIS CALL TOOK
+		if(nodeBlock == FAT_END_OF_CHAIN || allocate_data_block(volume, NULL, nodeBlock, 1) != 1)
+		{
+			while((*map).numNodes > reservedFrom)
+				write_fat_entry(volume, nodes[--(*map).numNodes], 0);
+
+			write_fat_entry(volume, dataBlock, 0);
+			return FAT_END_OF_CHAIN;
+		}
+
+		nodes[(*map).numNodes++] = nodeBlock;
+	}
+
+	// Filling a hole, the extents after it move up one
+	memmove(&extents[position + 1], &extents[position], (numExtents - position) * sizeof(Extent));
+
+	extents[position].fileBlock = fileBlock;
+	extents[position].startBlock = dataBlock;
+	extents[position].length = 1;
+	numExtents++;
+
+	// The root stops being the only leaf, its extents move to the first one
+	if(oldDepth == 0 && newDepth != 0)
+		(*map).firstDirty = 0;
+	else if((*map).firstDirty == NO_RECORD || (*map).firstDirty > position)
+		(*map).firstDirty = position;
+
+	return dataBlock;
+
+	#undef extents
+	#undef numExtents
+}
+
+// Tree blocks needed for 'numExtents' extents in full leaves and index nodes;
+//  sets the nodes of each level (leaves first) and the depth of the root if asked
+unsigned long extent_tree_nodes(unsigned long numExtents, unsigned long* levelNodes, unsigned int* depth)
+{
+	unsigned long leafEntries = (SOFTWARE_DISK_BLOCK_SIZE - EXTENT_NODE_HEADER_SIZE) / SIZE_OF_EXTENT_ENTRY;
+	unsigned long indexEntries = (SOFTWARE_DISK_BLOCK_SIZE - EXTENT_NODE_HEADER_SIZE) / SIZE_OF_EXTENT_INDEX_ENTRY;
+
+	// The root is a leaf, even an empty one
+	unsigned long nodes = (numExtents + leafEntries - 1) / leafEntries;
+	if(nodes == 0)
+		nodes = 1;
+
+	unsigned long total = nodes;
+	unsigned int level = 0;
+
+	if(levelNodes != NULL)
+		levelNodes[0] = nodes;
+
+	while(nodes > 1)
+	{
+		nodes = (nodes + indexEntries - 1) / indexEntries;
+		total += nodes;
+		level++;
+
+		if(levelNodes != NULL)
+			levelNodes[level] = nodes;
+	}
+
+	if(depth != NULL)
+		*depth = level;
+
+	return total;
+}
+
+// Writes the leaves of 'map' from the first one holding a changed extent on,
+//  and every index node above them, to the block cache
+//  ~~ Leaf j is nodes[1 + j], the index levels follow bottom up, the root is
+//     nodes[0] (the only leaf at depth 0)
+//  Returns 0 on failure
+unsigned int flush_extent_map(Volume* volume, ExtentMap* map)
+{
+	#define firstDataBlock (*volume).info.firstDataBlock
+	#define extents (*map).extents
+	#define nodes (*map).nodes
+
+	if((*map).firstDirty == NO_RECORD)
+		return 1;
+
+	unsigned long leafEntries = (SOFTWARE_DISK_BLOCK_SIZE - EXTENT_NODE_HEADER_SIZE) / SIZE_OF_EXTENT_ENTRY;
+	unsigned long indexEntries = (SOFTWARE_DISK_BLOCK_SIZE - EXTENT_NODE_HEADER_SIZE) / SIZE_OF_EXTENT_INDEX_ENTRY;
+
+	unsigned long levelNodes[EXTENT_MAX_LEVELS];
+	unsigned int depth;
+	extent_tree_nodes((*map).numExtents, levelNodes, &depth);
+
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	unsigned int success = 1;
+
+	// ========== LEAVES ==========
+	for(unsigned long leaf = (*map).firstDirty / leafEntries; leaf < levelNodes[0]; leaf++)
+	{
+		unsigned long first = leaf * leafEntries;
+		unsigned long numEntries = (*map).numExtents - first;
+		if(numEntries > leafEntries)
+			numEntries = leafEntries;
+
+		unsigned long nodeDepth = 0;
+
+		memset(blockData, 0, SOFTWARE_DISK_BLOCK_SIZE);
+		memcpy(blockData, &numEntries, sizeof(unsigned long));
+		memcpy(blockData + sizeof(unsigned long), &nodeDepth, sizeof(unsigned long));
+		memcpy(blockData + EXTENT_NODE_HEADER_SIZE, extents + first, numEntries * SIZE_OF_EXTENT_ENTRY);
+
+		unsigned long nodeBlock = (depth == 0) ? nodes[0] : nodes[1 + leaf];
+		if(cache_write_block(blockData, nodeBlock + firstDataBlock) != 1)
+			success = 0;
+	}
+
+	// ========== INDEX NODES ==========
+	unsigned long childSpan = leafEntries;		// extents under a node of the level below
+	unsigned long childBase = 1;				// nodes[] position of the level below
+	unsigned long levelBase = 1 + levelNodes[0];
+
+	for(unsigned int level = 1; level <= depth; level++)
+	{
+		for(unsigned long node = 0; node < levelNodes[level]; node++)
+		{
+			unsigned long firstChild = node * indexEntries;
+			unsigned long numEntries = levelNodes[level - 1] - firstChild;
+			if(numEntries > indexEntries)
+				numEntries = indexEntries;
+
+			unsigned long nodeDepth = level;
+
+			memset(blockData, 0, SOFTWARE_DISK_BLOCK_SIZE);
+			memcpy(blockData, &numEntries, sizeof(unsigned long));
+			memcpy(blockData + sizeof(unsigned long), &nodeDepth, sizeof(unsigned long));
+
+			for(unsigned long j = 0; j < numEntries; j++)
+			{
+				unsigned long entryOffset = EXTENT_NODE_HEADER_SIZE + (j * SIZE_OF_EXTENT_INDEX_ENTRY);
+				unsigned long child = firstChild + j;
+
+				memcpy(blockData + entryOffset, &extents[child * childSpan].fileBlock, sizeof(unsigned long));
+				memcpy(blockData + entryOffset + sizeof(unsigned long), &nodes[childBase + child], sizeof(unsigned long));
+			}
+
+			unsigned long nodeBlock = (level == depth) ? nodes[0] : nodes[levelBase + node];
+			if(cache_write_block(blockData, nodeBlock + firstDataBlock) != 1)
+				success = 0;
+		}
+
+		childBase = levelBase;
+		levelBase += levelNodes[level];
+		childSpan *= indexEntries;
+	}
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+
+	if(success)
+		(*map).firstDirty = NO_RECORD;
+
+	return success;
+
+	#undef firstDataBlock
+	#undef extents
+	#undef nodes
+}
+
+// Frees every data block and tree block of 'map'
+void free_extent_blocks(Volume* volume, ExtentMap* map)
+{
+	for(unsigned long i = 0; i < (*map).numExtents; i++)
+	{
+		Extent* extent = &(*map).extents[i];
+
+		for(unsigned long j = 0; j < (*extent).length; j++)
+			write_fat_entry(volume, (*extent).startBlock + j, 0);
+	}
+
+	for(unsigned long i = 0; i < (*map).numNodes; i++)
+		write_fat_entry(volume, (*map).nodes[i], 0);
+}
+
+
+// ========== VOLUMES ==========
+// =============================
+
+// Volume of the selected software disk, mounting it on first use
+//  Returns NULL (Error set) if it holds no filesystem
+Volume* current_volume()
+{
+	SDDevice* device = selected_disk();
+
+	pthread_mutex_lock(&VolumesLock);
+
+	for(Volume* volume = Volumes; volume != NULL; volume = (*volume).next)
+	{
+		if((*volume).device == device)
+		{
+			pthread_mutex_unlock(&VolumesLock);
+			set_stats_layout(volume);
+			return volume;
+		}
+	}
+
+	pthread_mutex_unlock(&VolumesLock);
 
+	// Another thread may mount it first, fs_mount looks again
+	return fs_mount(device);
 }
 
+// Holds the software disk of 'volume' selected for the calls on its files
+//  Returns the disk, for release_disk
+SDDevice* activate_volume(Volume* volume)
+{
+	SDDevice* device = hold_disk((*volume).device);
+
+	set_stats_layout(volume);
+
+	return device;
+}
+
+// The selected software disk, as the last thread to select one left it
+SDDevice* selected_disk(void)
+{
+	pthread_mutex_lock(&DiskLock);
+	SDDevice* device = software_disk_device();
+	pthread_mutex_unlock(&DiskLock);
+
+	return device;
+}
+
+// Selects 'device' once no thread holds another disk and holds it selected
+//  ~~ Unlocked transfers of the block cache and the software disk run while their
+//     disk is held, so nothing can switch it under them.  The first holder makes
+//     the block cache write back the blocks of the disk it held before, while
+//     nothing else runs
+//  Returns 'device', for release_disk
+SDDevice* hold_disk(SDDevice* device)
+{
+	pthread_mutex_lock(&DiskLock);
+
+	while(DiskHolders != 0 && (software_disk_device() != device || DiskWaiters != 0))
+	{
+		// ANOTHER DISK IS IN USE, OR WAITED FOR
+		unsigned int waiting = software_disk_device() != device;
+
+		DiskWaiters += waiting;
+		pthread_cond_wait(&DiskReleased, &DiskLock);
+		DiskWaiters -= waiting;
+	}
+
+	if(DiskHolders == 0)
+	{
+		if(software_disk_device() != device)
+			select_software_disk(device);
+
+		switch_block_cache_disk();
+	}
+
+	DiskHolders++;
+
+	pthread_mutex_unlock(&DiskLock);
+
+	return device;
+}
+
+// Lets go of the disk '*device' held by hold_disk (FS_DISK_SCOPE cleanup)
+void release_disk(SDDevice** device)
+{
+	(void)device;
+
+	pthread_mutex_lock(&DiskLock);
+
+	if(--DiskHolders == 0)
+		pthread_cond_broadcast(&DiskReleased);
+
+	pthread_mutex_unlock(&DiskLock);
+}
+
+// Reads the FAT of the selected software disk into 'volume' (one request)
+//  Returns 0 on failure
+unsigned int load_fat(Volume* volume)
+{
+	unsigned long numFatBlocks = (*volume).info.numFatBlocks;
+
+	(*volume).fat = sd_alloc_buffer(numFatBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+	(*volume).fatDirty = calloc((numFatBlocks + 7) / 8, 1);
+
+	if((*volume).fat == NULL || (*volume).fatDirty == NULL
+		|| cache_read_blocks((*volume).fat, (*volume).info.firstFatBlock, numFatBlocks) != 1)
+	{
+		sd_free_buffer((*volume).fat, numFatBlocks * SOFTWARE_DISK_BLOCK_SIZE);
+		free((*volume).fatDirty);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Writes the FAT blocks of 'volume' changed since the last flush to the block
+//  cache, each run of consecutive ones in one request (its disk held)
+//  Returns 0 on failure (the blocks stay marked)
+unsigned int flush_fat(Volume* volume)
+{
+	#define numFatBlocks (*volume).info.numFatBlocks
+	#define fatDirty (*volume).fatDirty
+
+	unsigned long entriesPerBlock = SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_FAT_ENTRY;
+	unsigned int success = 1;
+
+	unsigned long blockIndex = 0;
+	while(blockIndex < numFatBlocks)
+	{
+		// SKIP 8 CLEAN BLOCKS AT A TIME
+		if((blockIndex % 8) == 0 && fatDirty[blockIndex / 8] == 0)
+		{
+			blockIndex += 8;
+			continue;
+		}
+
+		if((fatDirty[blockIndex / 8] & (1 << (blockIndex % 8))) == 0)
+		{
+			blockIndex++;
+			continue;
+		}
+
+		unsigned long runLength = 1;
+		while(blockIndex + runLength < numFatBlocks
+			&& (fatDirty[(blockIndex + runLength) / 8] & (1 << ((blockIndex + runLength) % 8))) != 0)
+			runLength++;
+
+		if(cache_write_blocks((*volume).fat + (blockIndex * entriesPerBlock), (*volume).info.firstFatBlock + blockIndex, runLength) == 1)
+		{
+			for(unsigned long i = blockIndex; i < blockIndex + runLength; i++)
+				fatDirty[i / 8] &= ~(1 << (i % 8));
+		}
+		else
+		{
+			success = 0;
+		}
+
+		blockIndex += runLength;
+	}
+
+	return success;
+
+	#undef numFatBlocks
+	#undef fatDirty
+}
+
+// Builds the bitmap of allocated data blocks of 'volume' from its FAT, and
+//  counts the free ones; the bits past the last data block count as allocated
+//  Returns 0 on failure
+unsigned int build_used_map(Volume* volume)
+{
+	unsigned long numDataBlocks = (*volume).info.numDataBlocks;
+	unsigned long numWords = (numDataBlocks + 63) / 64;
+
+	(*volume).usedMap = calloc(numWords, sizeof(unsigned long));
+	if((*volume).usedMap == NULL)
+		return 0;
+
+	(*volume).freeBlocks = 0;
+
+	for(unsigned long fatIndex = 0; fatIndex < numWords * 64; fatIndex++)
+	{
+		if(fatIndex >= numDataBlocks || (*volume).fat[fatIndex] != 0)
+			(*volume).usedMap[fatIndex / 64] |= 1UL << (fatIndex % 64);
+		else if(fatIndex != 0)
+			(*volume).freeBlocks++;
+	}
+
+	return 1;
+}
+
+// Writes the changed FAT blocks and, if it moved, the allocation cursor of
+//  'volume' to the block cache
+//  Returns 0 on failure
+unsigned int flush_volume(Volume* volume)
+{
+	unsigned int success = flush_fat(volume);
+
+	if((*volume).infoDirty)
+	{
+		char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+
+		if(cache_read_block(blockData, 0) == 1)
+		{
+			memcpy(blockData + INFO_LAST_USED_BLOCK_OFFSET, &(*volume).info.lastUsedBlock, sizeof(unsigned long));
+			if(cache_write_block(blockData, 0) == 1)
+				(*volume).infoDirty = 0;
+		}
+
+		if((*volume).infoDirty)
+			success = 0;
+
+		sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+	}
+
+	return success;
+}
+
+// Writes back the appends buffered by open handles, the resident FAT and the
+//  cached blocks of every volume, syncing their disks, then selects the disk
+//  that was selected before
+//  ~~ The open handles are listed first and locked one at a time after, as their
+//     own calls lock them: the file before the volume.  Each listed handle is
+//     referenced, so one closed in between is still safe to lock
+//  Returns 0 on failure
+unsigned int sync_volumes()
+{
+	SDDevice* selected = selected_disk();
+	unsigned int success = 1;
+
+	pthread_mutex_lock(&VolumesLock);
+
+	for(Volume* volume = Volumes; volume != NULL; volume = (*volume).next)
+	{
+		FS_DISK_SCOPE(volume);
+
+		unsigned long numRecords = (*volume).info.numRecordBlocks * (SOFTWARE_DISK_BLOCK_SIZE / SIZE_OF_RECORD_ENTRY);
+
+		// LIST THE OPEN HANDLES
+		File* handles = NULL;
+		unsigned long numHandles = 0;
+
+		pthread_mutex_lock(&(*volume).lock);
+
+		if((*volume).openFiles > 0)
+			handles = malloc((*volume).openFiles * sizeof(File));
+
+		for(unsigned long recordNumber = 0; handles != NULL && recordNumber < numRecords; recordNumber++)
+		{
+			if((*volume).openTable[recordNumber].handle != NULL)
+			{
+				handles[numHandles] = (*volume).openTable[recordNumber].handle;
+				__atomic_add_fetch(&(*handles[numHandles]).references, 1, __ATOMIC_RELAXED);
+				numHandles++;
+			}
+		}
+
+		pthread_mutex_unlock(&(*volume).lock);
+
+		// FLUSH THE APPENDS OF THOSE STILL OPEN
+		for(unsigned long i = 0; i < numHandles; i++)
+		{
+			File handle = handles[i];
+
+			pthread_rwlock_wrlock(&(*handle).lock);
+			pthread_mutex_lock(&(*volume).lock);
+
+			if((*volume).openTable[(*handle).recordNumber].handle == handle && flush_write_buffer(volume, handle) != 1)
+				success = 0;
+
+			pthread_mutex_unlock(&(*volume).lock);
+			pthread_rwlock_unlock(&(*handle).lock);
+
+			release_file(handle);
+		}
+
+		free(handles);
+
+		pthread_mutex_lock(&(*volume).lock);
+
+		if(flush_volume(volume) != 1 || flush_block_cache() != 1)
+			success = 0;
+
+		pthread_mutex_unlock(&(*volume).lock);
+	}
+
+	pthread_mutex_unlock(&VolumesLock);
 
-struct FSInfo get_fs_info()
+	SDDevice* held = hold_disk(selected);
+
+	if(flush_block_cache() != 1)
+		success = 0;
+
+	release_disk(&held);
+
+	return success;
+}
+
+// Program exit: nothing resident may be lost
+void sync_at_exit(void)
 {
-	// Block 0
-	char* blockData = calloc(SOFTWARE_DISK_BLOCK_SIZE, sizeof(char));
-	read_sd_block(blockData, 0);
+	sync_volumes();
+}
 
-	struct FSInfo info;
-	unsigned int offset = 0;
+// Reads the layout of the filesystem on the selected software disk from block 0
+//  and switches the disk to the block size it was formatted with
+//  Returns 0 if block 0 cannot be read or holds no layout
+unsigned int get_fs_info(FSInfo* info)
+{
+	// Block 0 (only the first MIN_BLOCK_SIZE bytes are used)
+	char* blockData = sd_alloc_buffer(SOFTWARE_DISK_BLOCK_SIZE);
+	if(cache_read_block(blockData, 0) != 1)
+	{
+		sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+		return 0;
+	}
 
-	memcpy(&info.numFatBlocks, blockData, sizeof(int));
-		offset += sizeof(int);
-	memcpy(&info.numRecordBlocks, blockData + offset, sizeof(int));
-		offset += sizeof(int);
-	memcpy(&info.numDataBlocks, blockData + offset, sizeof(int));
-		offset += sizeof(int);
-	memcpy(&info.firstFatBlock, blockData + offset, sizeof(int));
-		offset += sizeof(int);
-	memcpy(&info.firstRecordBlock, blockData + offset, sizeof(int));
-		offset += sizeof(int);
-	memcpy(&info.firstDataBlock, blockData + offset, sizeof(int));
-		offset += sizeof(int);
-	memcpy(&info.lastUsedBlock, blockData + offset, sizeof(int));
-		offset += sizeof(int);
+	unsigned long offset = 0;
+
+	memcpy(&(*info).numFatBlocks, blockData, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).numRecordBlocks, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).numDataBlocks, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).firstFatBlock, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).firstRecordBlock, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).firstDataBlock, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).lastUsedBlock, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).blockSize, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).numBlocks, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).numIndexBlocks, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).firstIndexBlock, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+	memcpy(&(*info).features, blockData + offset, sizeof(unsigned long));
+		offset += sizeof(unsigned long);
+
+	sd_free_buffer(blockData, SOFTWARE_DISK_BLOCK_SIZE);
+
+	// Never formatted (formatfs always leaves data blocks)
+	if((*info).firstDataBlock == 0 || (*info).numDataBlocks == 0)
+		return 0;
 
-	free(blockData);
+	// Disk still addressed with another block size than it was formatted with:
+	//  switch over (block 0 is the only block read so far)
+	if((*info).blockSize != 0 && (*info).blockSize != SOFTWARE_DISK_BLOCK_SIZE)
+	{
+		flush_block_cache();
+		if(set_software_disk_block_size((*info).blockSize) != 1)
+			return 0;
+	}
 
-	return info;
+	return 1;
 }
 
 // May Be Unneeded Now
@@ -1208,4 +3827,4 @@ int isNthBitSet (unsigned char c, int n)
 {
     static unsigned char mask[] = {128, 64, 32, 16, 8, 4, 2, 1};
     return ((c & mask[n]) != 0);
-}
\ No newline at end of file
+}
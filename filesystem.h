@@ -1,5 +1,102 @@
-#define SIZE_OF_FAT_ENTRY     (1 * sizeof(int))
+#include <pthread.h>
+
+#define SIZE_OF_FAT_ENTRY     (1 * sizeof(unsigned long))
 #define SIZE_OF_RECORD_ENTRY  (32 * sizeof(char))
+#define SIZE_OF_INDEX_ENTRY   (2 * sizeof(unsigned int))
+
+// File Record Entry (SIZE_OF_RECORD_ENTRY bytes)
+//  attributes (byte 0)      - present, parent and inline flags and record count (the
+//                             open flag, bit 5, is no longer written or read)
+//  Parent record (the first of a file):
+//   firstBlock (bytes 1-8)  - of an inline file, its number of inline data records
+//   fileSize   (bytes 9-16)
+//   name       (bytes 17-31) - the first RECORD_PARENT_NAME_LENGTH bytes of the name
+//  Other name records:
+//   name       (bytes 1-31)  - the next RECORD_NAME_LENGTH bytes of the name each
+//
+// The record count is 4 bits, so a file has at most MAX_FILE_RECORDS records; the
+//  smallest record block holds 16, so they always fit in one.
+//
+// A new file is inline with no inline data records.  Its first bytes go in the
+//  records following its name records (counted in the record count),
+//  RECORD_INLINE_DATA_LENGTH bytes each, taken when they are written; when the
+//  records after it are in use, or its bytes outgrow INLINE_RECORDS, it moves to
+//  data blocks
+#define RECORD_FIRST_BLOCK_OFFSET  1
+#define RECORD_SIZE_OFFSET         9
+#define RECORD_PARENT_NAME_OFFSET  17
+#define RECORD_PARENT_NAME_LENGTH  15
+#define RECORD_NAME_OFFSET         1
+#define RECORD_NAME_LENGTH         31
+#define MAX_FILE_RECORDS           15   // names up to 449 bytes
+#define RECORD_INLINE_FLAG         16   // parent: the data is inline; other: an inline data record
+#define RECORD_INLINE_DATA_OFFSET  1
+#define RECORD_INLINE_DATA_LENGTH  31
+#define INLINE_RECORDS             3    // most inline data records of a file (93 bytes)
+
+// Name Index Entry (SIZE_OF_INDEX_ENTRY bytes), one slot of a linear probing
+//  hash table over the names of all files
+//  hash         (bytes 0-3) - name_hash() of the name
+//  recordNumber (bytes 4-7) - parent record number + 1, 0 for an empty slot
+#define INDEX_RECORD_OFFSET        4
+
+// Extent Node (one data block) of the extent tree of a file, on volumes
+//  formatted with FS_FEATURE_EXTENTS.  The file's record points to the root.
+//  numEntries (bytes 0-7)
+//  depth      (bytes 8-15) - 0 for a leaf
+//  entries    (bytes 16-)  - leaf: extents, SIZE_OF_EXTENT_ENTRY bytes each
+//                            fileBlock, startBlock, length (8 bytes each)
+//                          - otherwise: children, SIZE_OF_EXTENT_INDEX_ENTRY bytes each
+//                            fileBlock (first one below), childBlock (8 bytes each)
+#define EXTENT_NODE_HEADER_SIZE    (2 * sizeof(unsigned long))
+#define SIZE_OF_EXTENT_ENTRY       (3 * sizeof(unsigned long))
+#define SIZE_OF_EXTENT_INDEX_ENTRY (2 * sizeof(unsigned long))
+#define EXTENT_MAX_LEVELS          16
+
+// FAT value terminating a chain (also returned when no block is free)
+#define FAT_END_OF_CHAIN      0xFFFFFFFFFFFFFFFFUL
+
+// A FAT entry links its data block to the next block of the chain (bits 0-39).
+//  File blocks seeked over and never written are holes without a data block:
+//  the entry of the block before them counts them (bits 40-63, see fat_link)
+#define FAT_HOLE_SHIFT        40
+#define FAT_BLOCK_MASK        ((1UL << FAT_HOLE_SHIFT) - 1)
+#define FAT_MAX_HOLE          ((1UL << (64 - FAT_HOLE_SHIFT)) - 2)  // all ones is FAT_END_OF_CHAIN
+
+// Record number returned when no record matches
+#define NO_RECORD             0xFFFFFFFFFFFFFFFFUL
+
+// Most blocks in one request of a read_file/write_file batch
+#define MAX_RUN_BLOCKS        64
+
+// Most blocks read_file/write_file resolve from the chain before submitting them together
+#define MAX_BATCH_BLOCKS      256
+
+// Read-ahead window of a handle reading sequentially: starts at the first size,
+//  doubles with every sequential read_file up to the second
+#define READ_AHEAD_MIN_BLOCKS 4
+#define READ_AHEAD_MAX_BLOCKS 64
+
+// batch request and disk types of the software disk (softwaredisk.h)
+struct SDRequest;
+struct SDDevice;
+
+// a run of consecutive data blocks of a file
+typedef struct Extent {
+    unsigned long fileBlock;     // block of the file it starts at
+    unsigned long startBlock;    // FAT index of its first data block
+    unsigned long length;        // blocks
+} Extent;
+
+// extent tree of an open file, held as the sorted array of its extents
+typedef struct ExtentMap {
+    Extent* extents;
+    unsigned long numExtents;
+    unsigned long capacity;
+    unsigned long* nodes;        // FAT indexes of the tree blocks, the root first
+    unsigned long numNodes;
+    unsigned long firstDirty;    // first extent changed since written, NO_RECORD if none
+} ExtentMap;
 
 // access mode for open_file() and create_file() 
 typedef enum {
@@ -9,36 +106,115 @@ typedef enum {
 // main private file type
 typedef struct FileInternals
 {
-    unsigned int recordNumber;
-    unsigned int fileSize;
-    unsigned int filePos;
-    unsigned int startingBlock;
-    unsigned int currentBlock;
+    struct Volume* volume;
+    unsigned long recordNumber;
+    unsigned long fileSize;
+    unsigned long filePos;
+    unsigned long startingBlock;
+    unsigned long currentBlock;
     FileMode mode;
+    ExtentMap* extentMap;        // NULL for a FAT chain
+    unsigned long* blockMap;     // FAT chain: data blocks of the file blocks walked so far,
+                                 //  FAT_END_OF_CHAIN for a hole (it always ends on a block)
+    unsigned long mappedBlocks;
+    unsigned long blockMapCapacity;
+    unsigned long inlineRecord;  // inline file (startingBlock FAT_END_OF_CHAIN): where its
+    unsigned long inlineRecords; //  inline data records start, and how many it has so far
+    char* writeBuffer;           // appends not yet in the file (delayed allocation)
+    unsigned long bufferedBytes;
+    unsigned long bufferStart;   // file size on disk, where the buffered bytes go
+    unsigned long reservedBlocks;// blocks held back on the volume for them
+    unsigned long readAheadPos;  // where a sequential read_file would start next
+    unsigned long readAheadBlocks;// read-ahead window, 0 while access looks random
+    unsigned long readAheadEnd;  // file blocks before this one have been prefetched
+    pthread_rwlock_t lock;       // shared by read_file_at and file_length, exclusive for
+                                 //  the rest
+    unsigned long references;    // the opener's until close_file, and sync_volumes'
+                                 //  while it flushes the handle; freed at 0
 } FileInternals;
 
+// blocks of appends a handle buffers before allocating blocks for them
+#define WRITE_BUFFER_BLOCKS 256
+
 // file type used by user code
 typedef FileInternals* File;
 
-// FS Information Struct
-//  numFatBlocks  (bytes 0-3)
-//  numRecordBlocks  (bytes 4-7)
-//  numDataBlocks (bytes 8-11)
-//  firstFatBlock (bytes 12-15)
-//  firstRecordBlock (bytes 16-19)
-//  firstDataBlock  (bytes 20-23)
-//  lastUsedBlock (bytes 24-27) - starts as 0, no need to write
+// FS Information Struct (Block 0, all fields 8 bytes)
+//  numFatBlocks  (bytes 0-7)
+//  numRecordBlocks  (bytes 8-15)
+//  numDataBlocks (bytes 16-23)
+//  firstFatBlock (bytes 24-31)
+//  firstRecordBlock (bytes 32-39)
+//  firstDataBlock  (bytes 40-47)
+//  lastUsedBlock (bytes 48-55) - last data block allocated, where the search
+//   for a free one resumes (starts as 0)
+//  blockSize (bytes 56-63) - bytes per block, chosen at format time
+//  numBlocks (bytes 64-71) - blocks on the disk, chosen at format time
+//  numIndexBlocks (bytes 72-79) - 0 on disks formatted without a name index
+//  firstIndexBlock (bytes 80-87)
+//  features (bytes 88-95) - FS_FEATURE_* flags chosen at format time
+// Everything a mount needs sits in the first MIN_BLOCK_SIZE bytes, so block 0
+//  can be read before the block size is known.
 typedef struct FSInfo {
-    unsigned int numFatBlocks;
-    unsigned int numRecordBlocks;
-    unsigned int numDataBlocks;
-    unsigned int firstFatBlock;
-    unsigned int firstRecordBlock;
-    unsigned int firstDataBlock;
-    unsigned int lastUsedBlock;
+    unsigned long numFatBlocks;
+    unsigned long numRecordBlocks;
+    unsigned long numDataBlocks;
+    unsigned long firstFatBlock;
+    unsigned long firstRecordBlock;
+    unsigned long firstDataBlock;
+    unsigned long lastUsedBlock;
+    unsigned long blockSize;
+    unsigned long numBlocks;
+    unsigned long numIndexBlocks;
+    unsigned long firstIndexBlock;
+    unsigned long features;
 } FSInfo;
 
-// error codes set in global 'fserror' by filesystem functions
+#define INFO_LAST_USED_BLOCK_OFFSET 48
+
+// files are extent trees instead of FAT chains (formatfs -e); the FAT only
+//  marks their blocks as allocated
+#define FS_FEATURE_EXTENTS 1
+
+// entry of the open-file table of a volume, one per record
+typedef struct OpenRecord {
+    unsigned long refCount;      // handles open on the file (concurrent opens are refused)
+    FileMode mode;
+    struct FileInternals* handle;
+} OpenRecord;
+
+// free records of a volume as maximal runs of free records inside one record
+// block, listed by length so a create takes one without scanning
+//  ~~ record numbers are stored + 1, 0 meaning none
+#define FREE_RUN_BUCKETS (MAX_FILE_RECORDS + 1) // lists for lengths 1-14, the last for 15 and more
+typedef struct FreeRecordRuns {
+    unsigned int* runLength;     // at the first record of a free run: its length, else 0
+    unsigned int* runStart;      // at the last record of a free run: its first record + 1, else 0
+    unsigned int* next;          // list links, at the first record of a free run
+    unsigned int* prev;
+    unsigned int heads[FREE_RUN_BUCKETS];
+} FreeRecordRuns;
+
+// a mounted filesystem: its software disk, the layout read from block 0 when
+// it was mounted and the FAT, resident from then on
+typedef struct Volume {
+    struct SDDevice* device;
+    FSInfo info;
+    unsigned long* fat;          // numFatBlocks blocks of entries, as on disk
+    unsigned char* fatDirty;     // bit per FAT block changed since written back
+    unsigned long* usedMap;      // bit per data block, set while it is allocated
+    int infoDirty;               // lastUsedBlock changed since written back
+    OpenRecord* openTable;       // indexed by record number, in memory only
+    unsigned long freeBlocks;    // free data blocks (block 0 is never handed out)
+    unsigned long reservedBlocks;// of them, promised to buffered appends
+    FreeRecordRuns freeRuns;     // built at mount, in memory only
+    unsigned long openFiles;
+    pthread_mutex_t lock;        // allocation and metadata: everything above but 'device'
+                                 //  and 'info' (only lastUsedBlock of it changes)
+    struct Volume* next;
+} Volume;
+
+// error codes set in 'fserror' (one per thread) by filesystem functions
 typedef enum  {
   FS_NONE, 
   FS_OUT_OF_SPACE,        // the operation caused the software disk to fill up
@@ -47,11 +223,63 @@ typedef enum  {
                           // supported and neither is deleting a file that is open.
   FS_FILE_NOT_FOUND, 	  // attempted open or delete of file that doesn’t exist
   FS_FILE_READ_ONLY, 	  // attempted write to file opened for READ_ONLY
-  FS_FILE_ALREADY_EXISTS  // attempted creation of file with existing name
+  FS_FILE_ALREADY_EXISTS, // attempted creation of file with existing name
+  FS_NO_FILESYSTEM        // the software disk was never formatted
 } FSError;
 
+// regions of the disk, by the offsets in FSInfo
+typedef enum {
+  FS_REGION_SUPER, FS_REGION_FAT, FS_REGION_RECORD, FS_REGION_INDEX, FS_REGION_DATA,
+  FS_NUM_REGIONS
+} FSRegion;
+
+// filesystem calls block I/O is attributed to (FS_OP_NONE: outside any call,
+// e.g. the flush at program exit)
+typedef enum {
+  FS_OP_NONE, FS_OP_CREATE, FS_OP_OPEN, FS_OP_CLOSE, FS_OP_READ, FS_OP_WRITE,
+  FS_OP_SEEK, FS_OP_LENGTH, FS_OP_DELETE, FS_OP_EXISTS, FS_OP_SYNC, FS_OP_FLUSH,
+  FS_OP_READ_AT, FS_OP_WRITE_AT, FS_NUM_OPS
+} FSOp;
+
+// latency histogram buckets: bucket i counts transfers taking under 2^(i+1) ns
+#define FS_LATENCY_BUCKETS 32
+
+// block I/O of one region caused by one kind of call ([0] reads, [1] writes)
+typedef struct FSRegionStats {
+  unsigned long requests[2];   // blocks asked of the block cache
+  unsigned long hits;          // blocks read from the block cache without I/O
+  unsigned long blocks[2];     // blocks moved to/from the software disk
+  unsigned long transfers[2];  // software disk transfers (first block's region)
+  unsigned long latency[2][FS_LATENCY_BUCKETS];
+} FSRegionStats;
+
+typedef struct FSStats {
+  unsigned long calls[FS_NUM_OPS];
+  FSRegionStats io[FS_NUM_OPS][FS_NUM_REGIONS];
+} FSStats;
+
 // function prototypes for filesystem API
 
+// Calls naming a file act on the volume of the selected software disk, which
+// is mounted on first use; calls on an open file act on the volume it was
+// opened on.
+//
+// Every call may be made from several threads at once.  Calls on different
+// files only contend while they allocate or change metadata; read_file_at
+// calls on the same file run side by side.  Threads share the selected software
+// disk, so calls on different volumes take turns with it, and a handle must not
+// be closed while another thread uses it.
+
+// mounts the filesystem on software disk 'device' (NULL for the selected one),
+// reading its layout once, and selects that disk.  Returns the volume, the one
+// already mounted on 'device' if any, or NULL on error. Always sets 'fserror' global.
+Volume* fs_mount(struct SDDevice* device);
+
+// writes back every cached change of 'volume' and unmounts it.  Fails if a file
+// is open on it.  Unmount a volume before destroying its software disk.
+// Returns 1 on success, 0 on failure. Always sets 'fserror' global.
+int fs_unmount(Volume* volume);
+
 // open existing file with pathname 'name' and access mode 'mode'.  Current file
 // position is set at byte 0.  Returns NULL on error. Always sets 'fserror' global.
 File open_file(char *name, FileMode mode);
@@ -60,7 +288,9 @@ File open_file(char *name, FileMode mode);
 // position is set at byte 0.  Returns NULL on error. Always sets 'fserror' global.
 File create_file(char *name, FileMode mode);
 
-// close 'file'.  Always sets 'fserror' global.
+// close 'file', writing the appends it buffered first.  If they cannot all be
+// written the file is closed anyway and 'fserror' says why.  'file' is invalid
+// once this returns, even if it fails.  Always sets 'fserror' global.
 void close_file(File file);
 
 // read at most 'numbytes' of data from 'file' into 'buf', starting at the 
@@ -71,11 +301,30 @@ unsigned long read_file(File file, void *buf, unsigned long numbytes);
 
 // write 'numbytes' of data from 'buf' into 'file' at the current file position. 
 // Returns the number of bytes written. On an out of space error, the return value may be
-// less than 'numbytes'.  Always sets 'fserror' global.
+// less than 'numbytes'.  Appends are buffered in the handle until it is flushed,
+// seeked or closed; the blocks they need are reserved right away, so running out
+// of space is still reported here.  Always sets 'fserror' global.
 unsigned long write_file(File file, void *buf, unsigned long numbytes);
 
+// writes the appends 'file' has buffered to it, allocating their blocks (at
+// once, so they can be contiguous) and updating its size once.  close_file and
+// fs_sync do this too.  Returns 1 on success, 0 on failure. Always sets 'fserror' global.
+int flush_file(File file);
+
+// read at most 'numbytes' of data from 'file' into 'buf', starting at byte 'offset'.
+// The current file position is neither used nor changed, so several readers can
+// share one handle.  Returns the number of bytes read, less than 'numbytes' at end
+// of file.  Always sets 'fserror' global.
+unsigned long read_file_at(File file, void *buf, unsigned long numbytes, unsigned long offset);
+
+// write 'numbytes' of data from 'buf' into 'file' at byte 'offset', extending the
+// file as a seek there would.  The current file position is neither used nor
+// changed.  Returns the number of bytes written.  Always sets 'fserror' global.
+unsigned long write_file_at(File file, void *buf, unsigned long numbytes, unsigned long offset);
+
 // sets current position in file to 'bytepos', always relative to the beginning of file.
-// Seeks past the current end of file should extend the file. Always sets 'fserror'
+// Seeks past the current end of file should extend the file.  The extension is a
+// hole: it takes no blocks and reads as zeros until written.  Always sets 'fserror'
 // global.
 void seek_file(File file, unsigned long bytepos);
 
@@ -91,44 +340,378 @@ int delete_file(char *name);
 // Always sets 'fserror' global.
 int file_exists(char *name);
 
+// writes all cached filesystem changes of every mounted volume back to its
+// software disk and syncs it.  Changes are otherwise only guaranteed on disk at
+// normal program exit.
+// Returns 1 on success, 0 on failure. Always sets 'fserror' global.
+int fs_sync(void);
+
+// sets the number of blocks held by the block cache, flushing it first.
+// Returns 1 on success, 0 on failure. Always sets 'fserror' global.
+int fs_set_cache_capacity(unsigned long blocks);
+
+// copies the block I/O statistics gathered since the first filesystem call (or
+// the last fs_reset_stats()) into 'stats'.  Calls still running in other
+// threads may be partly counted.
+void fs_get_stats(FSStats *stats);
+
+// clears the block I/O statistics.
+void fs_reset_stats(void);
+
+// prints the block I/O statistics, per call and region, to standard output.
+void fs_print_stats(void);
+
 // describe current filesystem error code by printing a descriptive message to standard
 // error.
 void fs_print_error(void);
 
-// filesystem error code set (set by each filesystem function)
-extern FSError fserror;
+// filesystem error code set (set by each filesystem function), one per thread
+extern _Thread_local FSError fserror;
 
 // ========== MY FUNCTIONS ==========
 // ==================================
 
-struct FSInfo get_fs_info();
+// Reads block 0 into 'info'
+//  Returns 0 if it holds no filesystem
+unsigned int get_fs_info(FSInfo* info);
+
+// Volume of the selected software disk, mounted on first use
+//  Returns NULL if it holds no filesystem
+Volume* current_volume();
+
+// Mounts the filesystem on 'device' (fs_mount with VolumesLock held)
+//  Returns NULL if it holds none
+Volume* mount_volume(struct SDDevice* device);
+
+// Holds the software disk of 'volume' selected (hold_disk), returns it
+struct SDDevice* activate_volume(Volume* volume);
+
+// The selected software disk, read under DiskLock
+struct SDDevice* selected_disk(void);
+
+// Reads the FAT of 'volume' into memory
+//  Returns 0 on failure
+unsigned int load_fat(Volume* volume);
+
+// Writes the changed blocks of the resident FAT to the block cache
+//  Returns 0 on failure
+unsigned int flush_fat(Volume* volume);
+
+// Derives the data block bitmap of 'volume' from its FAT
+//  Returns 0 on failure
+unsigned int build_used_map(Volume* volume);
+
+// Writes the resident FAT and allocation cursor of 'volume' to the block cache
+//  Returns 0 on failure
+unsigned int flush_volume(Volume* volume);
+
+// Writes back the FAT and cached blocks of every volume and syncs their disks
+//  Returns 0 on failure
+unsigned int sync_volumes();
+
+// sync_volumes() at program exit
+void sync_at_exit(void);
+
+// Returns record number of the parent record of 'name'
+//  Returns NO_RECORD if there is no such file
+unsigned long find_file(Volume* volume, char *name);
+
+// Hash of 'name' placing it in the name index
+unsigned int name_hash(char *name);
+
+// Looks 'name' up in the name index
+//  Returns NO_RECORD if there is no such file
+unsigned long index_lookup(Volume* volume, char *name);
+
+// Adds parent record 'recordNumber' of 'name' to the name index
+unsigned int index_insert(Volume* volume, char *name, unsigned long recordNumber);
+
+// Removes parent record 'recordNumber' of 'name' from the name index
+unsigned int index_remove(Volume* volume, char *name, unsigned long recordNumber);
+
+// Reads slot 'slot' of the name index
+//  Sets '*recordNumber' to NO_RECORD for an empty slot
+void get_index_entry(Volume* volume, unsigned long slot, unsigned int* hash, unsigned long* recordNumber);
+
+// Sets slot 'slot' of the name index (NO_RECORD empties it)
+unsigned int write_index_entry(Volume* volume, unsigned long slot, unsigned int hash, unsigned long recordNumber);
+
+// Lists the free record runs of 'volume' by reading every record block
+//  Returns 0 on failure
+unsigned int build_free_runs(Volume* volume);
+
+void drop_free_runs(Volume* volume);
+
+// Lists records 'start' to 'start + length - 1' (all in one record block) as a free run
+void add_free_run(Volume* volume, unsigned long start, unsigned long length);
+
+// Unlists the free run starting at record 'start'
+void remove_free_run(Volume* volume, unsigned long start);
+
+// Returns records 'start' to 'start + length - 1' to the free runs, merged with their neighbours
+void release_records(Volume* volume, unsigned long start, unsigned long length);
+
+// Finds the data block holding the byte before 'bytepos' (FAT_END_OF_CHAIN in a
+//  hole), growing the file to 'bytepos' without allocating
+//  Returns 0 when the block map cannot grow
+unsigned int position_file(Volume* volume, File file, unsigned long bytepos, unsigned long* blockIndexPtr);
+
+// Reads 'numbytes' of 'file' from byte 'pos' on, '*blockIndexPtr' holding the byte before it
+unsigned long read_blocks(Volume* volume, File file, void* buf, unsigned long numbytes, unsigned long pos, unsigned long* blockIndexPtr);
+
+// Writes 'numbytes' to 'file' from byte 'pos' on, '*blockIndexPtr' holding the byte before it
+unsigned long write_blocks(Volume* volume, File file, void* buf, unsigned long numbytes, unsigned long pos, unsigned long* blockIndexPtr);
+
+// Buffers the append of 'numbytes' at the end of 'file' if blocks can be reserved for it
+//  Returns 0 when it has to be written through instead
+unsigned int buffer_write(Volume* volume, File file, void* buf, unsigned long numbytes);
+
+// Writes the appends buffered by 'file' through to it
+//  Returns 0 on failure
+unsigned int flush_write_buffer(Volume* volume, File file);
+
+// Writes 'numbytes' at the position of 'file', allocating blocks as it goes
+unsigned long write_through(Volume* volume, File file, void* buf, unsigned long numbytes);
+
+// Blocks 'file' may have to allocate to grow from 'fromSize' to 'toSize' bytes
+unsigned long blocks_to_grow(Volume* volume, File file, unsigned long fromSize, unsigned long toSize);
+
+// Whether record 'recordNumber' has a handle open (open-file table, no disk access)
+unsigned int is_record_open(Volume* volume, unsigned long recordNumber);
+
+// Whether 'file' is the handle its record is open with (not closed, not stale)
+unsigned int is_open(Volume* volume, File file);
+
+// Returns index of next free entry in the FAT from lastUsedBlock on
+//  Returns FAT_END_OF_CHAIN on OUT_OF_SPACE error
+unsigned long get_free_data_block(Volume* volume);
+
+// Returns index of first record at start of 'length' contiguous records, preferably
+//  with 'room' more free records after them
+//  Returns NO_RECORD on OUT_OF_SPACE error
+unsigned long get_free_record(Volume* volume, unsigned int length, unsigned int room);
+
+// Returns the FAT entry of parentIndex: the next block of the chain and the holes before it
+//  Returns FAT_END_OF_CHAIN on terminating entry
+unsigned long get_next_data_block(Volume* volume, unsigned long parentIndex);
+
+// FAT entry linking to data block 'nextBlock' after 'holes' file blocks without one
+unsigned long fat_link(unsigned long holes, unsigned long nextBlock);
+
+// Data block a FAT entry links to, FAT_END_OF_CHAIN for the terminating entry
+unsigned long fat_next(unsigned long entryValue);
+
+// File blocks without a data block a FAT entry skips before the block it links to
+unsigned long fat_holes(unsigned long entryValue);
+
+unsigned int update_file_size(Volume* volume, unsigned long recordNumber, unsigned long size);
+
+unsigned int write_fat_entry(Volume* volume, unsigned long entryNumber, unsigned long entryValue);
+
+// Creates the records of a new, empty file (inline, no inline data records yet)
+//  Returns NO_RECORD (Error set) when out of records or name index slots
+unsigned long write_record_entry(Volume* volume, char* name);
+
+// Name records of the file whose parent record is at 'entry'
+unsigned int name_records_of(char* entry);
+
+// Allocates block 0 of a new file: a data block, or on extent volumes the root
+//  of its tree ('*extentMap') and the data block it maps
+//  Returns 0 (Error set) when out of space
+unsigned int allocate_first_block(Volume* volume, unsigned long* firstBlock, unsigned long* dataBlock, ExtentMap** extentMap);
+
+// Copies 'numbytes' from byte 'pos' of inline 'file' to 'buf', or from 'buf' if 'write'
+unsigned int transfer_inline(Volume* volume, File file, char* buf, unsigned long pos, unsigned long numbytes, int write);
+
+// Whether 'file' keeps its bytes in records after its name rather than in data blocks
+unsigned int is_inline(File file);
+
+// Makes the inline records of 'file' hold 'size' bytes, taking the free ones after them
+//  Returns 0 when they cannot (the file has to move to a data block)
+unsigned int grow_inline_file(Volume* volume, File file, unsigned long size);
+
+// Moves the data of inline 'file' to its first data block, freeing its inline records
+//  Returns 0 (Error set) when out of space
+unsigned int promote_inline_file(Volume* volume, File file);
+
+// Allocates data block 'targetFatIndex' at the end of the chain of '*parentFatIndexPtr' (NULL: a new chain)
+//  ~~ 'zeroize' 0 when the caller writes the whole block before anything reads it
+unsigned int allocate_data_block(Volume* volume, unsigned long* parentFatIndexPtr, unsigned long targetFatIndex, unsigned int zeroize);
+
+// Attributes block I/O to 'op' until the enclosing function returns
+#define FS_STATS_SCOPE(op) FSOp statsScope __attribute__((cleanup(end_stats_op))) = begin_stats_op(op)
+
+FSOp begin_stats_op(FSOp op);
+
+void end_stats_op(FSOp* previousOp);
+
+// Makes the block cache and the software disk report to the statistics (once)
+void install_stats_observers(void);
+
+// Holds the allocation and metadata lock of 'volume' until the enclosing scope ends
+//  ~~ Taken after the lock of a file, never before it
+#define FS_VOLUME_SCOPE(volume) Volume* volumeScope __attribute__((cleanup(unlock_volume))) = lock_volume(volume)
+
+Volume* lock_volume(Volume* volume);
+
+void unlock_volume(Volume** volume);
+
+// Holds the software disk of 'volume' selected until the enclosing scope ends
+//  ~~ Taken before the lock of a file, never after it, and never twice
+#define FS_DISK_SCOPE(volume) struct SDDevice* diskScope __attribute__((cleanup(release_disk))) = activate_volume(volume)
+
+// Selects 'device' once no thread holds another disk and holds it selected
+//  ~~ Threads holding the same disk share it; one waiting for another disk
+//     keeps new holders out so it gets its turn
+struct SDDevice* hold_disk(struct SDDevice* device);
+
+// Lets go of the disk '*device' held by hold_disk (FS_DISK_SCOPE cleanup)
+void release_disk(struct SDDevice** device);
+
+// Holds the lock of 'file', shared or 'exclusive', until the enclosing function returns
+#define FS_FILE_SCOPE(file, exclusive) File fileScope __attribute__((cleanup(unlock_file))) = lock_file(file, exclusive)
+
+File lock_file(File file, unsigned int exclusive);
+
+void unlock_file(File* file);
+
+// Drops a reference to 'file', freeing the handle with the last one
+//  ~~ Called with no lock of the handle held
+void release_file(File file);
+
+// Takes 'file' out of the open table and frees what it holds but the handle
+//  Returns 0 if it was not open
+unsigned int close_handle(Volume* volume, File file);
+
+// Whether read_file_at of 'numbytes' at 'offset' leaves 'file' as it is, so a
+//  shared lock will do (no buffered appends to flush, no chain left to walk)
+unsigned int reads_in_place(File file, unsigned long offset, unsigned long numbytes);
+
+// Attributes this thread's block I/O by the region bounds of 'volume'
+void set_stats_layout(Volume* volume);
+
+// Region of the disk holding absolute block 'absBlockNumber'
+FSRegion region_of(unsigned long absBlockNumber);
+
+// Block cache and software disk observers feeding the I/O statistics
+void observe_cache(int write, unsigned long blocknum, unsigned long count, unsigned long hits);
+
+void observe_disk(int write, unsigned long blocknum, unsigned long count, unsigned long nanoseconds);
+
+// Upper bound in microseconds of the 'fraction' percentile of a latency histogram
+double latency_percentile(unsigned long* histogram, double fraction);
+
+// Index of the chain block holding the byte just before 'pos' (block 0 for pos 0)
+unsigned long block_index_of(unsigned long pos);
+
+// Blocks needed to batch 'numbytes' starting at 'relativePos', capped at MAX_BATCH_BLOCKS
+unsigned long batch_capacity(unsigned long relativePos, unsigned long numbytes);
+
+// Appends an absolute block to the runs of a batch, buffered at 'blockData'
+void add_to_batch(struct SDRequest* runs, unsigned long* numRuns, char* blockData, unsigned long absBlockNumber);
+
+// Whether block 'batchIndex' of a batch lies wholly inside the 'remaining' bytes
+//  transferred from 'relativePos' on, so the caller's buffer can back it
+unsigned int batch_block_direct(unsigned long batchIndex, unsigned long relativePos, unsigned long remaining);
+
+// Buffer of block 'batchIndex' of a batch: inside 'user' (the caller's bytes from
+//  'relativePos' on) when the block lies wholly in them, in 'batchData' otherwise
+char* batch_block_buffer(char* batchData, char* user, unsigned long batchIndex, unsigned long relativePos, unsigned long remaining);
+
+// Prefetches the blocks of 'file' after 'fileBlock' (data block 'blockIndex') into the block
+//  cache when its reads are sequential, growing its window, or resets the window
+void read_ahead(Volume* volume, File file, unsigned long startPos, unsigned long fileBlock, unsigned long blockIndex);
+
+// Adds data block 'blockIndex' to the runs of a read batch, or zeroes 'blockData' for a hole
+void add_read_block(struct SDRequest* runs, unsigned long* numRuns, char* blockData, unsigned long blockIndex, unsigned long firstDataBlock);
+
+// Copies the 'chunk' bytes of the partial head and tail blocks of a batch between
+//  'batchData' and 'user' (into the batch if 'toBatch')
+void copy_batch_edges(char* batchData, char* user, unsigned long batchLength, unsigned long relativePos, unsigned long chunk, unsigned int toBatch);
+
+// Returns the data block holding block 'fileBlock' of 'file' without reading the disk
+//  Returns FAT_END_OF_CHAIN in a hole or past what is known
+unsigned long lookup_file_block(File file, unsigned long fileBlock);
+
+// Makes room in the block map of 'file' for 'numBlocks' file blocks
+//  Returns 0 when the map cannot grow
+unsigned int reserve_block_map(File file, unsigned long numBlocks);
+
+// Records data block 'blockIndex' as the next block of the chain of 'file'
+//  Returns 0 when the map cannot grow
+unsigned int append_block_map(File file, unsigned long blockIndex);
+
+// Walks the chain of 'file' until the block map covers block 'fileBlock' or the chain ends
+//  Returns 0 when the map cannot grow
+unsigned int map_chain(Volume* volume, File file, unsigned long fileBlock);
+
+// Returns the data block holding block 'fileBlock' of 'file'
+//  Returns FAT_END_OF_CHAIN in a hole or past the last one
+unsigned long file_block(Volume* volume, File file, unsigned long fileBlock);
+
+// Allocates a data block for block 'fileBlock' of a chain, a hole or past its end
+//  Returns FAT_END_OF_CHAIN when out of space
+unsigned long fill_chain_hole(Volume* volume, File file, unsigned long fileBlock, unsigned int zeroize);
+
+// Moves to block 'nextFileBlock' of 'file', the one after '*blockIndexPtr', allocating it if needed
+//  Returns 0 when the file cannot grow
+unsigned int extend_file(Volume* volume, File file, unsigned long* blockIndexPtr, unsigned long nextFileBlock, unsigned int zeroize);
+
+// Reads the extent tree rooted at data block 'rootBlock'
+//  Returns NULL on failure
+ExtentMap* load_extent_map(Volume* volume, unsigned long rootBlock);
+
+void free_extent_map(ExtentMap* map);
+
+// Makes room for 'numExtents' extents in 'map'
+//  Returns 0 on failure
+unsigned int reserve_extents(ExtentMap* map, unsigned long numExtents);
+
+// Returns the data block holding block 'fileBlock' of the file (binary search)
+//  Returns FAT_END_OF_CHAIN past the last one
+unsigned long extent_lookup(ExtentMap* map, unsigned long fileBlock);
+
+// Number of file blocks mapped by 'map'
+unsigned long extent_map_blocks(ExtentMap* map);
+
+// Allocates a data block for block 'fileBlock' of 'map' (past its end or in a hole), growing the tree if needed
+//  Returns FAT_END_OF_CHAIN when out of space
+unsigned long map_extent_block(Volume* volume, ExtentMap* map, unsigned long fileBlock, unsigned int zeroize);
+
+// Tree blocks needed for 'numExtents' extents, and the nodes of each level
+unsigned long extent_tree_nodes(unsigned long numExtents, unsigned long* levelNodes, unsigned int* depth);
 
-unsigned int find_file(char *name);
+// Writes the changed nodes of 'map' to the block cache
+//  Returns 0 on failure
+unsigned int flush_extent_map(Volume* volume, ExtentMap* map);
 
-unsigned int is_open(unsigned int recordNumber);
+// Frees every data and tree block of 'map'
+void free_extent_blocks(Volume* volume, ExtentMap* map);
 
-// Returns index of first free entry in the FAT
-//  Returns 0xFFFFFFFF on OUT_OF_SPACE error
-unsigned int get_free_data_block();
+// Sets the absolute block and byte offset of record 'recordNumber'
+void locate_record(FSInfo* info, unsigned long recordNumber, unsigned long* absBlockNumber, unsigned long* recordOffset);
 
-// Returns index of first record at start of 'length' contiguous records
-//  Returns 0xFFFFFFFF on OUT_OF_SPACE error
-unsigned int get_free_record(unsigned int length);
+// Sets the absolute block and byte offset of FAT entry 'fatIndex'
+void locate_fat_entry(FSInfo* info, unsigned long fatIndex, unsigned long* absBlockNumber, unsigned long* entryOffset);
 
-// Returns index of child of parentIndex
-//  Returns 0xFFFFFFFF on terminating entry
-unsigned int get_next_data_block(unsigned int parentIndex);
+// Sets the absolute block and byte offset of name index slot 'slot'
+void locate_index_entry(FSInfo* info, unsigned long slot, unsigned long* absBlockNumber, unsigned long* entryOffset);
 
-unsigned int update_file_size(unsigned int recordNumber, unsigned int size);
+// Number of slots of the name index (a power of two), 0 without one
+unsigned long index_slots(FSInfo* info);
 
-unsigned int write_fat_entry(unsigned int entryNumber, unsigned int entryValue);
+// Number of records needed to hold 'name'
+unsigned int records_for_name(char *name);
 
-unsigned int write_record_entry(char* name, unsigned int dataBlock);
+// Compares 'name' against the name stored in the 'numRecords' records at 'entry'
+//  Returns 1 on match
+int record_name_matches(char *entry, unsigned int numRecords, char *name);
 
-unsigned int allocate_data_block(int* parentFatIndexPtr, int targetFatIndex);
+// Offset in record 'internalIndex' of a file of its piece of the name, and its length
+unsigned long record_name_field(unsigned int internalIndex, unsigned long* fieldLength);
 
 // Endian-ness sucks
 void iEndianSwap(int* num);
 
 // Bitwise Comparison Function
-int isNthBitSet(unsigned char c, int n);
\ No newline at end of file
+int isNthBitSet(unsigned char c, int n);
@@ -1,5 +1,12 @@
 /*
-	** 
+	** Formats the software disk.
+	**
+	**   formatfs [-e] [-i bytesPerFile] [numBlocks [blockSize]]
+	**
+	** numBlocks defaults to DEFAULT_NUM_BLOCKS, blockSize to DEFAULT_BLOCK_SIZE
+	** (a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE).  With -e, files are
+	** stored as extent trees instead of FAT chains.  The record region holds one
+	** file per bytesPerFile bytes of the disk (DEFAULT_BYTES_PER_FILE).
 */
 
 #include <stdio.h>
@@ -7,43 +14,115 @@
 #include <string.h>
 #include <math.h>
 #include "softwaredisk.h"
+#include "filesystem.h"
 
-int main()
-{
-	init_software_disk();
-
-	int blockSize = SOFTWARE_DISK_BLOCK_SIZE;
-	int numBlocks = software_disk_size();
-
-
-	// FAT using 4-byte (32-bit) integers for Block allocation numbers
-	int numFatBlocks = (int)ceil((4.0 * numBlocks / blockSize));
+// Disk bytes per file the record region is sized for, and the records such a
+//  file takes: a name record and an inline data record or two if it is small
+#define DEFAULT_BYTES_PER_FILE 4096
+#define RECORDS_PER_FILE 2
 
-	// Use 1% of Disk Space for file entries
-	int numRecordBlocks = (int)ceil((numBlocks * 0.01));
+int main(int argc, char *argv[])
+{
+	unsigned long numBlocks = DEFAULT_NUM_BLOCKS;
+	unsigned long blockSize = DEFAULT_BLOCK_SIZE;
+	unsigned long bytesPerFile = DEFAULT_BYTES_PER_FILE;
+
+	// Feature Flags (FS_FEATURE_* in filesystem.h)
+	unsigned long features = 0;
+
+	while(argc > 1 && argv[1][0] == '-')
+	{
+		if(strcmp(argv[1], "-e") == 0)
+		{
+			features |= FS_FEATURE_EXTENTS;
+		}
+		else if(strcmp(argv[1], "-i") == 0 && argc > 2)
+		{
+			bytesPerFile = strtoul(argv[2], NULL, 0);
+			argc--;
+			argv++;
+		}
+		else
+		{
+			fprintf(stderr, "usage: formatfs [-e] [-i bytesPerFile] [numBlocks [blockSize]]\n");
+			return 1;
+		}
+		argc--;
+		argv++;
+	}
+
+	if(bytesPerFile == 0)
+	{
+		fprintf(stderr, "formatfs: bytesPerFile must be positive\n");
+		return 1;
+	}
+
+	if(argc > 1)
+		numBlocks = strtoul(argv[1], NULL, 0);
+	if(argc > 2)
+		blockSize = strtoul(argv[2], NULL, 0);
+
+	if(!init_software_disk_geometry(numBlocks, blockSize))
+	{
+		sd_print_error();
+		return 1;
+	}
+
+	// FAT using 8-byte (64-bit) integers for Block allocation numbers
+	unsigned long numFatBlocks = (8 * numBlocks + blockSize - 1) / blockSize;
+
+	// Records for the files the disk is expected to hold
+	unsigned long numFiles = (unsigned long)ceil((double)numBlocks * blockSize / bytesPerFile);
+	unsigned long numRecordBlocks = (numFiles * RECORDS_PER_FILE * SIZE_OF_RECORD_ENTRY + blockSize - 1) / blockSize;
+
+	// Name Index: hash table of 8-byte slots, a power of two of them and at least
+	//  twice as many as there are records, so probe sequences stay short
+	unsigned long numIndexSlots = blockSize / 8;
+	while(numIndexSlots < 2 * numRecordBlocks * (blockSize / SIZE_OF_RECORD_ENTRY))
+		numIndexSlots *= 2;
+	unsigned long numIndexBlocks = numIndexSlots / (blockSize / 8);
+
+	if(numBlocks <= 1 + numFatBlocks + numRecordBlocks + numIndexBlocks)
+	{
+		fprintf(stderr, "formatfs: %lu blocks is too small for a filesystem\n", numBlocks);
+		return 1;
+	}
 
 	// Rest of disk is data
-	int numDataBlocks = numBlocks - 1 - numFatBlocks - numRecordBlocks;
-
-	// Offsets
-	int firstFatBlock = 1;
-	int firstRecordBlock = 1 + numFatBlocks;
-	int firstDataBlock = 1 + numFatBlocks + numRecordBlocks;
-
-	// Free Space Tracker (not super efficient)
-	int lastUsedBlock = 0;
+	unsigned long numDataBlocks = numBlocks - 1 - numFatBlocks - numRecordBlocks - numIndexBlocks;
 
-	// Write FileSys Info to Block 0
-	//	numFatBlocks	(bytes 0-3)
-	//  numDirBlocks	(bytes 4-7)
-	//  numDataBlocks	(bytes 8-11)
-	//	firstFatBlock	(bytes 12-15)
-	//	firstRecordBlock(bytes 16-19)
-	//  firstDataBlock	(bytes 20-23)
-	//  lastUsedBlock	(bytes 24-27) - starts as 0, no need to write
+	// A FAT entry links to data blocks with its low FAT_HOLE_SHIFT bits
+	if(numDataBlocks > FAT_BLOCK_MASK)
+	{
+		fprintf(stderr, "formatfs: %lu blocks is too large for a filesystem\n", numBlocks);
+		return 1;
+	}
 
-
-		char* data = calloc(blockSize, sizeof(char));
+	// Offsets
+	unsigned long firstFatBlock = 1;
+	unsigned long firstRecordBlock = 1 + numFatBlocks;
+	unsigned long firstIndexBlock = 1 + numFatBlocks + numRecordBlocks;
+	unsigned long firstDataBlock = 1 + numFatBlocks + numRecordBlocks + numIndexBlocks;
+
+	// Allocation cursor, the search for free blocks starts after it
+	unsigned long lastUsedBlock = 0;
+
+	// Write FileSys Info to Block 0 (all fields 8 bytes)
+	//	numFatBlocks	(bytes 0-7)
+	//  numDirBlocks	(bytes 8-15)
+	//  numDataBlocks	(bytes 16-23)
+	//	firstFatBlock	(bytes 24-31)
+	//	firstRecordBlock(bytes 32-39)
+	//  firstDataBlock	(bytes 40-47)
+	//  lastUsedBlock	(bytes 48-55) - starts as 0
+	//  blockSize		(bytes 56-63)
+	//  numBlocks		(bytes 64-71)
+	//  numIndexBlocks	(bytes 72-79)
+	//  firstIndexBlock	(bytes 80-87)
+	//  features		(bytes 88-95)
+
+
+		char* data = sd_alloc_buffer(blockSize);
 
 		int offset = 0;
 
@@ -65,11 +144,32 @@ int main()
 		memcpy(data + offset, &firstDataBlock, sizeof(firstDataBlock));
 		offset += sizeof(firstDataBlock);
 
-		// Passes
+		memcpy(data + offset, &lastUsedBlock, sizeof(lastUsedBlock));
+		offset += sizeof(lastUsedBlock);
+
+		memcpy(data + offset, &blockSize, sizeof(blockSize));
+		offset += sizeof(blockSize);
+
+		memcpy(data + offset, &numBlocks, sizeof(numBlocks));
+		offset += sizeof(numBlocks);
+
+		memcpy(data + offset, &numIndexBlocks, sizeof(numIndexBlocks));
+		offset += sizeof(numIndexBlocks);
+
+		memcpy(data + offset, &firstIndexBlock, sizeof(firstIndexBlock));
+		offset += sizeof(firstIndexBlock);
+
+		memcpy(data + offset, &features, sizeof(features));
+		offset += sizeof(features);
+
+		// FAT, Record and Index regions of the fresh image already read as zeros
+		//  (all blocks free, no files), so block 0 is the only write
 		write_sd_block((void*)data, 0);
+		sync_software_disk();
 
 		// Cleanup
-		free(data);
+		sd_free_buffer(data, blockSize);
 
 	//printf("File System Initialization Completed\n");
-}
\ No newline at end of file
+	return 0;
+}
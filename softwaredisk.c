@@ -3,131 +3,1698 @@
 // Written by Golden G. Richard III (@nolaforensix), 10/2017.
 //
 
+#define _GNU_SOURCE         // O_DIRECT, statx
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#ifndef SD_NO_IO_URING
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include "softwaredisk.h"
 
-#define NUM_BLOCKS 5000
 #define BACKING_STORE "sdprivate.sd"
+#define MAX_IOVECS 1024     // portable lower bound for IOV_MAX
+#define SD_RING_ENTRIES 64  // requests in flight with SD_ENGINE_IO_URING
+#define SD_POOL_CLASSES 8   // pooled buffer sizes: MIN_BLOCK_SIZE .. MAX_BLOCK_SIZE
+#define SD_POOL_DEPTH 64    // free buffers kept per size
 
-// internals of software disk implementation
-typedef struct SoftwareDiskInternals {
-  FILE *fp;       
-} SoftwareDiskInternals;
+// internals of a software disk; 'priv' belongs to the implementation in 'ops'
+struct SDDevice {
+  const SDDeviceOps *ops;
+  unsigned long blockSize;
+  unsigned long numBlocks;   // known once the disk has been acquired
+  void *priv;
+};
+
+// internals of an image file disk
+typedef struct FileDisk {
+  SDBackend backend;
+  char *path;
+  FILE *fp;       // SD_BACKEND_DIRECT: wraps the O_DIRECT descriptor, never buffers
+  char *map;      // SD_BACKEND_MMAP only: whole image, numBlocks blocks
+  unsigned long memAlign;    // SD_BACKEND_DIRECT only: buffer alignment O_DIRECT needs
+  pthread_mutex_t lock;      // held while opening, and around stdio transfers: the
+			     // stream has one position and one buffer
+} FileDisk;
+
+// internals of a RAM disk
+typedef struct RamDisk {
+  char *data;
+  unsigned long bytes;
+} RamDisk;
+
+// one file of a striped disk and the worker thread serving it
+typedef struct StripeMember {
+  struct StripedDisk *disk;
+  char *path;
+  int fd;
+  pthread_t thread;
+  int started;
+  // work handed to the worker: 'iovcnt' iovecs at byte 'offset' of the file
+  struct iovec *iov;
+  int iovcnt;
+  off_t offset;
+  int write;
+  int pending;
+  int result;
+} StripeMember;
+
+// internals of a striped disk: blocks go round-robin to the members,
+// 'stripeBlocks' at a time
+typedef struct StripedDisk {
+  int numMembers;
+  unsigned long stripeBlocks;
+  StripeMember *members;
+  pthread_mutex_t transferLock;  // one transfer at a time hands work to the members
+  pthread_mutex_t lock;
+  pthread_cond_t work;       // workers wait here for 'pending'
+  pthread_cond_t done;       // the caller waits here for 'outstanding' to reach 0
+  int outstanding;
+  int stopping;
+} StripedDisk;
+
+// free aligned buffers, one stack per power-of-two size
+typedef struct SDBufferPool {
+  void *free[SD_POOL_CLASSES][SD_POOL_DEPTH];
+  int count[SD_POOL_CLASSES];
+} SDBufferPool;
+
+static const SDDeviceOps file_disk_ops;
+static const SDDeviceOps ram_disk_ops;
+static const SDDeviceOps striped_disk_ops;
+
+//
+// GLOBALS
+//
+
+static FileDisk defaultFile = { SD_BACKEND_MMAP, BACKING_STORE, NULL, NULL, MIN_BLOCK_SIZE,
+				PTHREAD_MUTEX_INITIALIZER };
+static SDDevice defaultDisk = { &file_disk_ops, DEFAULT_BLOCK_SIZE, 0, &defaultFile };
+
+// disk the software disk API acts on
+static SDDevice *current = &defaultDisk;
+
+static SDEngine engine = SD_ENGINE_SYNC;
+
+static SDObserver observer = NULL;
+
+static SDBufferPool pool;
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+
+// software disk error code set (set by each software disk function), one per
+// thread.
+_Thread_local SDError sderror;
+
+
+// returns the pool stack for buffers of 'size' bytes, or -1 if that size is
+// not pooled
+static int pool_class(unsigned long size) {
+  int c=0;
+
+  if (size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0) {
+    return -1;
+  }
+  while (((unsigned long)MIN_BLOCK_SIZE << c) != size) {
+    c++;
+  }
+  return c;
+}
+
+// returns a zeroed buffer of 'size' bytes aligned to SD_BUFFER_ALIGN, or NULL
+// when out of memory.
+void *sd_alloc_buffer(unsigned long size) {
+  void *buf;
+  int c=pool_class(size);
+
+  buf=NULL;
+  if (c >= 0) {
+    pthread_mutex_lock(&poolLock);
+    if (pool.count[c]) {
+      buf=pool.free[c][--pool.count[c]];
+    }
+    pthread_mutex_unlock(&poolLock);
+  }
+  if (! buf && posix_memalign(&buf, SD_BUFFER_ALIGN, size ? size : 1) != 0) {
+    return NULL;
+  }
+  memset(buf, 0, size);
+  return buf;
+}
+
+// returns 'buf' of 'size' bytes to the pool, or to the heap if the pool for
+// that size is full.
+void sd_free_buffer(void *buf, unsigned long size) {
+  int c=pool_class(size);
+
+  if (! buf) {
+    return;
+  }
+  if (c >= 0) {
+    pthread_mutex_lock(&poolLock);
+    if (pool.count[c] < SD_POOL_DEPTH) {
+      pool.free[c][pool.count[c]++]=buf;
+      buf=NULL;
+    }
+    pthread_mutex_unlock(&poolLock);
+  }
+  free(buf);
+}
+
+
+// returns 1 if 'blocksize' is a legal block size
+static int legal_block_size(unsigned long blocksize) {
+
+  return blocksize >= MIN_BLOCK_SIZE && blocksize <= MAX_BLOCK_SIZE &&
+    (blocksize & (blocksize - 1)) == 0;
+}
+
+// monotonic clock in nanoseconds, for the observer
+static unsigned long clock_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+//
+// IMAGE FILE DISK
+//
+
+// opens the backing store with O_DIRECT.  Blocks must be at least as large as
+// the file's direct I/O offset alignment, and SD_BUFFER_ALIGN must satisfy its
+// memory alignment (assumed MIN_BLOCK_SIZE where the kernel cannot tell).
+// Returns the stream wrapping the descriptor or NULL.
+static FILE *open_direct(SDDevice *dev) {
+  FileDisk *f=dev->priv;
+  int fd;
+  FILE *fp;
+#ifdef STATX_DIOALIGN
+  struct statx stx;
+#endif
+
+  fd=open(f->path, O_RDWR | O_DIRECT);
+  if (fd < 0) {
+    return NULL;
+  }
+  f->memAlign=MIN_BLOCK_SIZE;
+#ifdef STATX_DIOALIGN
+  if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 &&
+      (stx.stx_mask & STATX_DIOALIGN)) {
+    if (stx.stx_dio_offset_align == 0 || stx.stx_dio_offset_align > dev->blockSize ||
+	stx.stx_dio_mem_align > SD_BUFFER_ALIGN) {
+      close(fd);
+      return NULL;
+    }
+    if (stx.stx_dio_mem_align > 1) {
+      f->memAlign=stx.stx_dio_mem_align;
+    }
+  }
+#endif
+  fp=fdopen(fd, "r+");
+  if (! fp) {
+    close(fd);
+  }
+  return fp;
+}
+
+// maps the whole image, open as 'fp', once.  Returns 1 on success, otherwise
+// 0.
+static int file_map(SDDevice *dev, FILE *fp) {
+  FileDisk *f=dev->priv;
+  void *p;
+
+  if (f->backend != SD_BACKEND_MMAP) {
+    return 1;
+  }
+  p=mmap(NULL, (size_t)dev->numBlocks * dev->blockSize,
+	 PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+  if (p == MAP_FAILED) {
+    return 0;
+  }
+  f->map=p;
+  return 1;
+}
+
+// opens (and maps, if needed) an existing image on first access and returns
+// its number of blocks, which follows from its size.  The stream is published
+// last, so a thread finding it set sees the image ready.  Returns 0 with
+// 'sderror' set on failure.
+static unsigned long file_size(SDDevice *dev) {
+  FileDisk *f=dev->priv;
+  FILE *fp;
+  long size;
+
+  if (__atomic_load_n(&f->fp, __ATOMIC_ACQUIRE)) {
+    return dev->numBlocks;
+  }
+  pthread_mutex_lock(&f->lock);
+  if (f->fp) {
+    pthread_mutex_unlock(&f->lock);
+    return dev->numBlocks;
+  }
+  if (f->backend == SD_BACKEND_DIRECT) {
+    fp=open_direct(dev);
+  }
+  else {
+    fp=fopen(f->path, "r+");
+  }
+  if (! fp) {
+    pthread_mutex_unlock(&f->lock);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  fseek(fp, 0L, SEEK_END);
+  size=ftell(fp);
+  if (size <= 0 || size % dev->blockSize != 0) {
+    fclose(fp);
+    pthread_mutex_unlock(&f->lock);
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  dev->numBlocks=size / dev->blockSize;
+  if (! file_map(dev, fp)) {
+    fclose(fp);
+    pthread_mutex_unlock(&f->lock);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  __atomic_store_n(&f->fp, fp, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&f->lock);
+  return dev->numBlocks;
+}
+
+// returns 1 if 'p' may be handed to an O_DIRECT transfer on 'f' as is
+static int buffer_aligned(FileDisk *f, void *p) {
+
+  return ((unsigned long)p & (f->memAlign - 1)) == 0;
+}
+
+static int file_transfer(SDDevice *dev, struct iovec *iov, int iovcnt,
+			 unsigned long blocknum, unsigned long count, int write);
+
+// file_transfer() for SD_BACKEND_DIRECT when some buffer is not aligned: goes
+// through one aligned pool buffer instead.  Returns 1 on success, otherwise 0
+// with 'sderror' set.
+static int transfer_bounced(SDDevice *dev, struct iovec *iov, int iovcnt,
+			    unsigned long blocknum, unsigned long count, int write) {
+  struct iovec bounce;
+  char *p;
+  int i, ret;
+
+  bounce.iov_len=count * dev->blockSize;
+  bounce.iov_base=sd_alloc_buffer(bounce.iov_len);
+  if (! bounce.iov_base) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (write) {
+    for (i=0, p=bounce.iov_base; i < iovcnt; p += iov[i].iov_len, i++) {
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+    }
+  }
+  ret=file_transfer(dev, &bounce, 1, blocknum, count, write);
+  if (ret && ! write) {
+    for (i=0, p=bounce.iov_base; i < iovcnt; p += iov[i].iov_len, i++) {
+      memcpy(iov[i].iov_base, p, iov[i].iov_len);
+    }
+  }
+  sd_free_buffer(bounce.iov_base, bounce.iov_len);
+  return ret;
+}
+
+// one block through the stdio stream: a seek and a read or write.  Called with
+// the stream's lock held.  Returns 1 on success, otherwise 0 with 'sderror'
+// set.
+static int stdio_transfer(SDDevice *dev, void *buf, unsigned long blocknum, int write) {
+  FileDisk *f=dev->priv;
+  size_t n;
+
+  fseek(f->fp, blocknum * dev->blockSize, SEEK_SET);
+  if (write) {
+    n=fwrite(buf, dev->blockSize, 1, f->fp);
+    fflush(f->fp);
+  }
+  else {
+    // the seek discards any stale stdio read-ahead, so no flush is needed here
+    n=fread(buf, dev->blockSize, 1, f->fp);
+  }
+  if (n != 1) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  return 1;
+}
+
+// positional I/O on the descriptor underneath the stdio stream; flushing
+// before and after keeps the stream's buffer coherent with the file.  Returns
+// 1 on success, otherwise 0 with 'sderror' set.
+static int fd_transfer(SDDevice *dev, struct iovec *iov, int iovcnt,
+		       unsigned long blocknum, unsigned long count, int write) {
+  FileDisk *f=dev->priv;
+  ssize_t n;
+
+  fflush(f->fp);
+  if (write) {
+    n=pwritev(fileno(f->fp), iov, iovcnt, (off_t)blocknum * dev->blockSize);
+  }
+  else {
+    n=preadv(fileno(f->fp), iov, iovcnt, (off_t)blocknum * dev->blockSize);
+  }
+  fflush(f->fp);
+  if (n != (ssize_t)(count * dev->blockSize)) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  return 1;
+}
+
+// transfers 'count' consecutive blocks starting at 'blocknum' between the
+// image and the iovecs in 'iov', which together cover count blocks.  'write'
+// selects the direction.  Only the stdio backend serializes transfers; the
+// others address the image by offset and run concurrently.  Returns 1 on
+// success, otherwise 0 with 'sderror' set.
+static int file_transfer(SDDevice *dev, struct iovec *iov, int iovcnt,
+			 unsigned long blocknum, unsigned long count, int write) {
+  FileDisk *f=dev->priv;
+  char *p;
+  int i, ret;
+
+  if (f->map) {
+    p=f->map + blocknum * dev->blockSize;
+    for (i=0; i < iovcnt; i++) {
+      if (write) {
+	memcpy(p, iov[i].iov_base, iov[i].iov_len);
+      }
+      else {
+	memcpy(iov[i].iov_base, p, iov[i].iov_len);
+      }
+      p += iov[i].iov_len;
+    }
+    return 1;
+  }
+
+  if (f->backend == SD_BACKEND_STDIO) {
+    // another thread's seek must not come between a seek and its transfer
+    pthread_mutex_lock(&f->lock);
+    if (count == 1) {
+      ret=stdio_transfer(dev, iov[0].iov_base, blocknum, write);
+    }
+    else {
+      ret=fd_transfer(dev, iov, iovcnt, blocknum, count, write);
+    }
+    pthread_mutex_unlock(&f->lock);
+    return ret;
+  }
+
+  if (f->backend == SD_BACKEND_DIRECT) {
+    for (i=0; i < iovcnt && buffer_aligned(f, iov[i].iov_base); i++)
+      ;
+    if (i < iovcnt) {
+      return transfer_bounced(dev, iov, iovcnt, blocknum, count, write);
+    }
+  }
+
+  return fd_transfer(dev, iov, iovcnt, blocknum, count, write);
+}
+
+static int file_read(SDDevice *dev, struct iovec *iov, int iovcnt,
+		     unsigned long blocknum, unsigned long count) {
+
+  return file_transfer(dev, iov, iovcnt, blocknum, count, 0);
+}
+
+static int file_write(SDDevice *dev, struct iovec *iov, int iovcnt,
+		      unsigned long blocknum, unsigned long count) {
+
+  return file_transfer(dev, iov, iovcnt, blocknum, count, 1);
+}
+
+// msync for the mmap backend, fflush for stdio, fdatasync for direct
+static int file_sync(SDDevice *dev) {
+  FileDisk *f=dev->priv;
+
+  if (! f->fp) {
+    return 1;
+  }
+  if (f->map && msync(f->map, (size_t)dev->numBlocks * dev->blockSize, MS_SYNC) != 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (fflush(f->fp) != 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (f->backend == SD_BACKEND_DIRECT && fdatasync(fileno(f->fp)) != 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  return 1;
+}
+
+// syncs, unmaps and closes the image; the next access reopens it
+static int file_close(SDDevice *dev) {
+  FileDisk *f=dev->priv;
+  int ret;
+
+  ret=file_sync(dev);
+  if (f->map) {
+    munmap(f->map, (size_t)dev->numBlocks * dev->blockSize);
+    f->map=NULL;
+  }
+  if (f->fp) {
+    fclose(f->fp);
+    f->fp=NULL;
+  }
+  return ret;
+}
+
+// creates the image sparse: truncating to zero and extending again leaves
+// every block reading as zeros without being written, so creation takes
+// constant time.  The finished image is reopened the way the backend accesses
+// it.
+static int file_create(SDDevice *dev, unsigned long numblocks, unsigned long blocksize) {
+  FileDisk *f=dev->priv;
+  int fd;
+
+  if (! file_close(dev)) {
+    return 0;
+  }
+  dev->blockSize=blocksize;
+  dev->numBlocks=numblocks;
+  fd=open(f->path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (ftruncate(fd, (off_t)numblocks * blocksize) != 0) {
+    close(fd);
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  close(fd);
+  return file_size(dev) != 0;
+}
+
+static void file_destroy(SDDevice *dev) {
+  FileDisk *f=dev->priv;
+
+  file_close(dev);
+  pthread_mutex_destroy(&f->lock);
+  free(f->path);
+  free(f);
+}
+
+static const SDDeviceOps file_disk_ops = {
+  file_read, file_write, file_sync, file_size, file_create, file_close, file_destroy
+};
+
+//
+// RAM DISK
+//
+
+static int ram_read(SDDevice *dev, struct iovec *iov, int iovcnt,
+		    unsigned long blocknum, unsigned long count) {
+  RamDisk *r=dev->priv;
+  char *p=r->data + blocknum * dev->blockSize;
+  int i;
+
+  (void)count;
+  for (i=0; i < iovcnt; p += iov[i].iov_len, i++) {
+    memcpy(iov[i].iov_base, p, iov[i].iov_len);
+  }
+  return 1;
+}
+
+static int ram_write(SDDevice *dev, struct iovec *iov, int iovcnt,
+		     unsigned long blocknum, unsigned long count) {
+  RamDisk *r=dev->priv;
+  char *p=r->data + blocknum * dev->blockSize;
+  int i;
+
+  (void)count;
+  for (i=0; i < iovcnt; p += iov[i].iov_len, i++) {
+    memcpy(p, iov[i].iov_base, iov[i].iov_len);
+  }
+  return 1;
+}
+
+// nothing outlives the process, so there is nothing to make durable
+static int ram_sync(SDDevice *dev) {
+
+  (void)dev;
+  return 1;
+}
+
+// the number of blocks follows from the bytes held and the block size, worked
+// out once as transfers of several threads ask for it
+static unsigned long ram_size(SDDevice *dev) {
+  RamDisk *r=dev->priv;
+
+  if (dev->numBlocks) {
+    return dev->numBlocks;
+  }
+  if (r->bytes == 0 || r->bytes % dev->blockSize != 0) {
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  dev->numBlocks=r->bytes / dev->blockSize;
+  return dev->numBlocks;
+}
+
+static int ram_create(SDDevice *dev, unsigned long numblocks, unsigned long blocksize) {
+  RamDisk *r=dev->priv;
+  char *data;
+
+  data=calloc(numblocks, blocksize);
+  if (! data) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  free(r->data);
+  r->data=data;
+  r->bytes=numblocks * blocksize;
+  dev->blockSize=blocksize;
+  dev->numBlocks=numblocks;
+  return 1;
+}
+
+// the contents stay in memory until the disk is destroyed
+static int ram_close(SDDevice *dev) {
+
+  (void)dev;
+  return 1;
+}
+
+static void ram_destroy(SDDevice *dev) {
+  RamDisk *r=dev->priv;
+
+  free(r->data);
+  free(r);
+}
+
+static const SDDeviceOps ram_disk_ops = {
+  ram_read, ram_write, ram_sync, ram_size, ram_create, ram_close, ram_destroy
+};
+
+//
+// STRIPED DISK
+//
+
+// maps block 'blocknum' to its member and block within that member's file
+static void stripe_locate(StripedDisk *st, unsigned long blocknum, int *member,
+			  unsigned long *memberBlock) {
+  unsigned long unit=blocknum / st->stripeBlocks;
+
+  *member=unit % st->numMembers;
+  *memberBlock=(unit / st->numMembers) * st->stripeBlocks + blocknum % st->stripeBlocks;
+}
+
+// number of blocks member 'm' holds of a disk of 'numblocks' blocks
+static unsigned long stripe_member_blocks(StripedDisk *st, int m, unsigned long numblocks) {
+  unsigned long row=st->numMembers * st->stripeBlocks;
+  unsigned long rest=numblocks % row;
+  unsigned long blocks=(numblocks / row) * st->stripeBlocks;
+
+  if (rest > m * st->stripeBlocks) {
+    rest -= m * st->stripeBlocks;
+    blocks += rest < st->stripeBlocks ? rest : st->stripeBlocks;
+  }
+  return blocks;
+}
+
+// carries out the work handed to 'm'.  Returns 1 on success, otherwise 0.
+static int stripe_member_io(StripeMember *m) {
+  struct iovec *iov=m->iov;
+  int left=m->iovcnt, n;
+  off_t offset=m->offset;
+  ssize_t want, got;
+
+  while (left > 0) {
+    n=left < MAX_IOVECS ? left : MAX_IOVECS;
+    for (want=0, got=0; got < n; got++) {
+      want += iov[got].iov_len;
+    }
+    if (m->write) {
+      got=pwritev(m->fd, iov, n, offset);
+    }
+    else {
+      got=preadv(m->fd, iov, n, offset);
+    }
+    if (got != want) {
+      return 0;
+    }
+    offset += want;
+    iov += n;
+    left -= n;
+  }
+  return 1;
+}
+
+// the worker of one member: waits for work, does it, reports back
+static void *stripe_worker(void *arg) {
+  StripeMember *m=arg;
+  StripedDisk *st=m->disk;
+  int result;
+
+  pthread_mutex_lock(&st->lock);
+  for (;;) {
+    while (! m->pending && ! st->stopping) {
+      pthread_cond_wait(&st->work, &st->lock);
+    }
+    if (st->stopping) {
+      break;
+    }
+    pthread_mutex_unlock(&st->lock);
+    result=stripe_member_io(m);
+    pthread_mutex_lock(&st->lock);
+    m->result=result;
+    m->pending=0;
+    if (--st->outstanding == 0) {
+      pthread_cond_signal(&st->done);
+    }
+  }
+  pthread_mutex_unlock(&st->lock);
+  return NULL;
+}
+
+// starts the worker threads the first time work is spread over members.
+// Returns 1 on success, otherwise 0.
+static int stripe_start_workers(StripedDisk *st) {
+  int i;
+
+  for (i=0; i < st->numMembers; i++) {
+    if (st->members[i].started) {
+      continue;
+    }
+    if (pthread_create(&st->members[i].thread, NULL, stripe_worker, &st->members[i]) != 0) {
+      return 0;
+    }
+    st->members[i].started=1;
+  }
+  return 1;
+}
+
+// striped_size() with the transfer lock held
+static unsigned long striped_open(SDDevice *dev) {
+  StripedDisk *st=dev->priv;
+  unsigned long total=0;
+  off_t size;
+  int i;
+
+  if (st->members[0].fd >= 0) {
+    return dev->numBlocks;
+  }
+  for (i=0; i < st->numMembers; i++) {
+    st->members[i].fd=open(st->members[i].path, O_RDWR);
+    if (st->members[i].fd < 0) {
+      break;
+    }
+    size=lseek(st->members[i].fd, 0, SEEK_END);
+    if (size < 0 || size % dev->blockSize != 0) {
+      i++;
+      break;
+    }
+    total += size / dev->blockSize;
+  }
+  // the member sizes must be exactly those of a striped disk of 'total' blocks
+  if (i == st->numMembers && total) {
+    for (i=0; i < st->numMembers; i++) {
+      if (lseek(st->members[i].fd, 0, SEEK_END) !=
+	  (off_t)(stripe_member_blocks(st, i, total) * dev->blockSize)) {
+	break;
+      }
+    }
+  }
+  if (i != st->numMembers || ! total) {
+    for (i=0; i < st->numMembers; i++) {
+      if (st->members[i].fd >= 0) {
+	close(st->members[i].fd);
+	st->members[i].fd=-1;
+      }
+    }
+    sderror=SD_NOT_INIT;
+    return 0;
+  }
+  dev->numBlocks=total;
+  return total;
+}
+
+// opens the member files on first access and returns the number of blocks,
+// which follows from their sizes.  Returns 0 with 'sderror' set on failure.
+static unsigned long striped_size(SDDevice *dev) {
+  StripedDisk *st=dev->priv;
+  unsigned long total;
+
+  pthread_mutex_lock(&st->transferLock);
+  total=striped_open(dev);
+  pthread_mutex_unlock(&st->transferLock);
+  return total;
+}
+
+// splits the transfer into one contiguous range per member and carries the
+// ranges out in parallel when more than one member is involved.  Transfers of
+// concurrent callers take turns: each one uses every member's work slot.
+static int striped_transfer(SDDevice *dev, struct iovec *iov, int iovcnt,
+			    unsigned long blocknum, unsigned long count, int write) {
+  StripedDisk *st=dev->priv;
+  struct iovec *lists;
+  unsigned long i, memberBlock;
+  int m, used=0, piece=0, ret=1;
+  char *p=iov[0].iov_base;
+  size_t left=iov[0].iov_len;
+  StripeMember *member;
+
+  (void)iovcnt;
+  lists=malloc(st->numMembers * count * sizeof(struct iovec));
+  if (! lists) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  pthread_mutex_lock(&st->transferLock);
+  for (m=0; m < st->numMembers; m++) {
+    st->members[m].iov=lists + m * count;
+    st->members[m].iovcnt=0;
+    st->members[m].write=write;
+  }
+
+  // consecutive blocks of one member are contiguous in its file
+  for (i=0; i < count; i++) {
+    if (left == 0) {
+      piece++;
+      p=iov[piece].iov_base;
+      left=iov[piece].iov_len;
+    }
+    stripe_locate(st, blocknum + i, &m, &memberBlock);
+    member=&st->members[m];
+    if (member->iovcnt == 0) {
+      member->offset=(off_t)memberBlock * dev->blockSize;
+      used++;
+    }
+    if (member->iovcnt &&
+	(char *)member->iov[member->iovcnt-1].iov_base + member->iov[member->iovcnt-1].iov_len == p) {
+      member->iov[member->iovcnt-1].iov_len += dev->blockSize;
+    }
+    else {
+      member->iov[member->iovcnt].iov_base=p;
+      member->iov[member->iovcnt].iov_len=dev->blockSize;
+      member->iovcnt++;
+    }
+    p += dev->blockSize;
+    left -= dev->blockSize;
+  }
+
+  if (used == 1 || ! stripe_start_workers(st)) {
+    // one member (or no threads): no point in waking workers
+    for (m=0; m < st->numMembers; m++) {
+      if (st->members[m].iovcnt && ! stripe_member_io(&st->members[m])) {
+	ret=0;
+      }
+    }
+  }
+  else {
+    pthread_mutex_lock(&st->lock);
+    for (m=0; m < st->numMembers; m++) {
+      if (st->members[m].iovcnt) {
+	st->members[m].pending=1;
+	st->outstanding++;
+      }
+    }
+    pthread_cond_broadcast(&st->work);
+    while (st->outstanding) {
+      pthread_cond_wait(&st->done, &st->lock);
+    }
+    for (m=0; m < st->numMembers; m++) {
+      if (st->members[m].iovcnt && ! st->members[m].result) {
+	ret=0;
+      }
+    }
+    pthread_mutex_unlock(&st->lock);
+  }
+  pthread_mutex_unlock(&st->transferLock);
+  free(lists);
+  if (! ret) {
+    sderror=SD_INTERNAL_ERROR;
+  }
+  return ret;
+}
+
+static int striped_read(SDDevice *dev, struct iovec *iov, int iovcnt,
+			unsigned long blocknum, unsigned long count) {
+
+  return striped_transfer(dev, iov, iovcnt, blocknum, count, 0);
+}
+
+static int striped_write(SDDevice *dev, struct iovec *iov, int iovcnt,
+			 unsigned long blocknum, unsigned long count) {
+
+  return striped_transfer(dev, iov, iovcnt, blocknum, count, 1);
+}
+
+static int striped_sync(SDDevice *dev) {
+  StripedDisk *st=dev->priv;
+  int i;
+
+  for (i=0; i < st->numMembers; i++) {
+    if (st->members[i].fd >= 0 && fdatasync(st->members[i].fd) != 0) {
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int striped_close(SDDevice *dev) {
+  StripedDisk *st=dev->priv;
+  int i, ret;
+
+  ret=striped_sync(dev);
+  for (i=0; i < st->numMembers; i++) {
+    if (st->members[i].fd >= 0) {
+      close(st->members[i].fd);
+      st->members[i].fd=-1;
+    }
+  }
+  return ret;
+}
+
+// creates every member file sparse, sized for its share of 'numblocks'
+static int striped_create(SDDevice *dev, unsigned long numblocks, unsigned long blocksize) {
+  StripedDisk *st=dev->priv;
+  int i, fd;
+
+  if (! striped_close(dev)) {
+    return 0;
+  }
+  dev->blockSize=blocksize;
+  dev->numBlocks=numblocks;
+  for (i=0; i < st->numMembers; i++) {
+    fd=open(st->members[i].path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+    if (ftruncate(fd, (off_t)stripe_member_blocks(st, i, numblocks) * blocksize) != 0) {
+      close(fd);
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+    close(fd);
+  }
+  return striped_size(dev) != 0;
+}
+
+static void striped_destroy(SDDevice *dev) {
+  StripedDisk *st=dev->priv;
+  int i;
+
+  striped_close(dev);
+  pthread_mutex_lock(&st->lock);
+  st->stopping=1;
+  pthread_cond_broadcast(&st->work);
+  pthread_mutex_unlock(&st->lock);
+  for (i=0; i < st->numMembers; i++) {
+    if (st->members[i].started) {
+      pthread_join(st->members[i].thread, NULL);
+    }
+    free(st->members[i].path);
+  }
+  pthread_mutex_destroy(&st->lock);
+  pthread_mutex_destroy(&st->transferLock);
+  pthread_cond_destroy(&st->work);
+  pthread_cond_destroy(&st->done);
+  free(st->members);
+  free(st);
+}
+
+static const SDDeviceOps striped_disk_ops = {
+  striped_read, striped_write, striped_sync, striped_size, striped_create, striped_close,
+  striped_destroy
+};
 
 //
-// GLOBALS
+// DISK HANDLES
 //
 
-static SoftwareDiskInternals sd;
+// returns a new disk of implementation 'ops' owning 'priv', or NULL
+static SDDevice *new_device(const SDDeviceOps *ops, void *priv, unsigned long blocksize) {
+  SDDevice *dev;
+
+  dev=malloc(sizeof(SDDevice));
+  if (! dev) {
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  dev->ops=ops;
+  dev->blockSize=blocksize;
+  dev->numBlocks=0;
+  dev->priv=priv;
+  return dev;
+}
+
+// creates a software disk of 'numblocks' zeroed blocks of 'blocksize' bytes
+// held in memory.  Returns NULL on failure.  Always sets global 'sderror'.
+SDDevice *create_ram_disk(unsigned long numblocks, unsigned long blocksize) {
+  RamDisk *r;
+  SDDevice *dev;
 
-// software disk error code set (set by each software disk function).
-SDError sderror;
+  sderror=SD_NONE;
+  if (! legal_block_size(blocksize) || numblocks == 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  r=calloc(1, sizeof(RamDisk));
+  if (! r) {
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  dev=new_device(&ram_disk_ops, r, blocksize);
+  if (! dev) {
+    free(r);
+    return NULL;
+  }
+  if (! ram_create(dev, numblocks, blocksize)) {
+    ram_destroy(dev);
+    free(dev);
+    return NULL;
+  }
+  return dev;
+}
 
+// returns a software disk backed by the image file 'path', accessed through
+// 'backend' and opened on first access.  Returns NULL on failure.  Always sets
+// global 'sderror'.
+SDDevice *open_file_disk(char *path, SDBackend backend) {
+  FileDisk *f;
+  SDDevice *dev;
 
-// initializes the software disk to all zeros, destroying any existing
-// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
-int init_software_disk() {
+  sderror=SD_NONE;
+  if (backend != SD_BACKEND_STDIO && backend != SD_BACKEND_MMAP &&
+      backend != SD_BACKEND_DIRECT) {
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  f=calloc(1, sizeof(FileDisk));
+  if (! f || ! (f->path=strdup(path))) {
+    free(f);
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  f->backend=backend;
+  f->memAlign=MIN_BLOCK_SIZE;
+  pthread_mutex_init(&f->lock, NULL);
+  dev=new_device(&file_disk_ops, f, DEFAULT_BLOCK_SIZE);
+  if (! dev) {
+    pthread_mutex_destroy(&f->lock);
+    free(f->path);
+    free(f);
+  }
+  return dev;
+}
+
+// returns a software disk striped across the 'members' image files in
+// 'paths', 'stripeblocks' blocks to a member at a time.  Returns NULL on
+// failure.  Always sets global 'sderror'.
+SDDevice *open_striped_disk(char **paths, int members, unsigned long stripeblocks) {
+  StripedDisk *st;
+  SDDevice *dev;
   int i;
-  char block[SOFTWARE_DISK_BLOCK_SIZE];
+
+  sderror=SD_NONE;
+  if (members < 1 || stripeblocks == 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  st=calloc(1, sizeof(StripedDisk));
+  if (! st || ! (st->members=calloc(members, sizeof(StripeMember)))) {
+    free(st);
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  st->numMembers=members;
+  st->stripeBlocks=stripeblocks;
+  pthread_mutex_init(&st->lock, NULL);
+  pthread_mutex_init(&st->transferLock, NULL);
+  pthread_cond_init(&st->work, NULL);
+  pthread_cond_init(&st->done, NULL);
+  for (i=0; i < members; i++) {
+    st->members[i].disk=st;
+    st->members[i].fd=-1;
+    st->members[i].path=strdup(paths[i]);
+  }
+  dev=new_device(&striped_disk_ops, st, DEFAULT_BLOCK_SIZE);
+  for (i=0; dev && i < members && st->members[i].path; i++)
+    ;
+  if (! dev || i < members) {
+    SDDevice failed = { &striped_disk_ops, DEFAULT_BLOCK_SIZE, 0, st };
+
+    striped_destroy(&failed);
+    free(dev);
+    sderror=SD_INTERNAL_ERROR;
+    return NULL;
+  }
+  return dev;
+}
+
+// makes 'dev' (NULL: the default image file) the selected software disk.
+// Returns the previously selected disk.
+SDDevice *select_software_disk(SDDevice *dev) {
+  SDDevice *prev=current;
+
+  wait_sd_requests();
+  current=dev ? dev : &defaultDisk;
+  return prev;
+}
+
+// returns the selected software disk
+SDDevice *software_disk_device(void) {
+
+  return current;
+}
+
+// syncs and frees 'dev'.  Returns 1 on success or 0 on failure.  Always sets
+// global 'sderror'.
+int destroy_software_disk(SDDevice *dev) {
+  int ret;
+
   sderror=SD_NONE;
-  sd.fp=fopen(BACKING_STORE, "w+");
-  if (! sd.fp) {
+  if (! dev || dev == &defaultDisk) {
     sderror=SD_INTERNAL_ERROR;
     return 0;
   }
-  
-  bzero(block, SOFTWARE_DISK_BLOCK_SIZE);
-  for (i=0; i < NUM_BLOCKS; i++) {
-    if (fwrite(block, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
-      fclose(sd.fp);
-      sd.fp=NULL;
-      sderror=SD_INTERNAL_ERROR;
-      return 0;
-    }
+  if (dev == current) {
+    select_software_disk(NULL);
+  }
+  ret=dev->ops->close(dev);
+  dev->ops->destroy(dev);
+  free(dev);
+  return ret;
+}
+
+//
+// SOFTWARE DISK API (selected disk)
+//
+
+// selects the backend used to access the backing store of the selected image
+// file disk.  If it is already open it is synced and closed first; the next
+// access reopens it with the new backend.  Returns 1 on success, otherwise 0.
+// Always sets global 'sderror'.
+int set_software_disk_backend(SDBackend backend) {
+
+  sderror=SD_NONE;
+  if (current->ops != &file_disk_ops ||
+      (backend != SD_BACKEND_STDIO && backend != SD_BACKEND_MMAP &&
+       backend != SD_BACKEND_DIRECT)) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (! close_software_disk()) {
+    return 0;
+  }
+  ((FileDisk *)current->priv)->backend=backend;
+  return 1;
+}
+
+// sets the block size used to address an existing software disk; the number
+// of blocks follows from the size of the backing store.  Returns 1 on success,
+// otherwise 0.  Always sets global 'sderror'.
+int set_software_disk_block_size(unsigned long blocksize) {
+
+  sderror=SD_NONE;
+  if (! legal_block_size(blocksize)) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  if (blocksize == current->blockSize) {
+    return 1;
   }
+  if (! close_software_disk()) {
+    return 0;
+  }
+  current->blockSize=blocksize;
+  current->numBlocks=0;
   return 1;
 }
 
+// initializes the software disk to all zeros, destroying any existing
+// data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
+int init_software_disk() {
+
+  return init_software_disk_geometry(DEFAULT_NUM_BLOCKS, DEFAULT_BLOCK_SIZE);
+}
+
+// initializes the software disk to 'numblocks' zeroed blocks of 'blocksize'
+// bytes each, destroying any existing data.  Returns 1 on success, otherwise 0.
+// Always sets global 'sderror'.
+int init_software_disk_geometry(unsigned long numblocks, unsigned long blocksize) {
+
+  sderror=SD_NONE;
+  if (! legal_block_size(blocksize) || numblocks == 0) {
+    sderror=SD_INTERNAL_ERROR;
+    return 0;
+  }
+  wait_sd_requests();
+  return current->ops->create(current, numblocks, blocksize);
+}
+
 // returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
 unsigned long software_disk_size() {
 
-  return NUM_BLOCKS;
+  return current->ops->size(current);
+}
+
+// returns the number of bytes in each block of the SoftwareDisk
+unsigned long software_disk_block_size() {
+
+  return current->blockSize;
+}
+
+// transfers 'count' consecutive blocks starting at 'blocknum' between the
+// selected disk and the iovecs in 'iov', which together cover count blocks.
+// 'write' selects the direction.  Returns 1 on success, otherwise 0 with
+// 'sderror' set.
+static int transfer_run(struct iovec *iov, int iovcnt, unsigned long blocknum,
+			unsigned long count, int write) {
+  unsigned long start=0;
+  int ret;
+
+  if (count == 0) {
+    return 1;
+  }
+  if (blocknum > current->numBlocks-1 || count > current->numBlocks - blocknum) {
+    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+    return 0;
+  }
+  if (observer) {
+    start=clock_ns();
+  }
+  if (write) {
+    ret=current->ops->write(current, iov, iovcnt, blocknum, count);
+  }
+  else {
+    ret=current->ops->read(current, iov, iovcnt, blocknum, count);
+  }
+  if (ret && observer) {
+    observer(write, blocknum, count, clock_ns() - start);
+  }
+  return ret;
 }
 
-// writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
+// writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered
 // from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
 // on success or 0 on failure.  Always sets global 'sderror'.
 int write_sd_block(void *buf, unsigned long blocknum) {
 
+  return write_sd_blocks(buf, blocknum, 1);
+}
+
+// reads a block of data into 'buf' from location 'blocknum'.  Blocks are numbered
+// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int read_sd_block(void *buf, unsigned long blocknum) {
+
+  return read_sd_blocks(buf, blocknum, 1);
+}
+
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf', which must
+// hold count * SOFTWARE_DISK_BLOCK_SIZE bytes.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int read_sd_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  struct iovec iov;
+
   sderror=SD_NONE;
-  if (! sd.fp) {
-    sd.fp=fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
-      sderror=SD_INTERNAL_ERROR;
+  if (! current->ops->size(current)) {
+    return 0;
+  }
+  iov.iov_base=buf;
+  iov.iov_len=count * current->blockSize;
+  return transfer_run(&iov, 1, blocknum, count, 0);
+}
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf', which must
+// hold count * SOFTWARE_DISK_BLOCK_SIZE bytes.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int write_sd_blocks(void *buf, unsigned long blocknum, unsigned long count) {
+  struct iovec iov;
+
+  sderror=SD_NONE;
+  if (! current->ops->size(current)) {
+    return 0;
+  }
+  iov.iov_base=buf;
+  iov.iov_len=count * current->blockSize;
+  return transfer_run(&iov, 1, blocknum, count, 1);
+}
+
+// splits a scatter-gather list into runs of consecutive block numbers and
+// transfers each run with a single device transfer.
+static int transfer_vec(SDBlockVec *vec, unsigned long count, int write) {
+  struct iovec iov[MAX_IOVECS];
+  unsigned long i, start;
+  int n;
+
+  sderror=SD_NONE;
+  if (! current->ops->size(current)) {
+    return 0;
+  }
+  i=0;
+  while (i < count) {
+    start=i;
+    n=0;
+    do {
+      iov[n].iov_base=vec[i].buf;
+      iov[n].iov_len=current->blockSize;
+      n++;
+      i++;
+    } while (i < count && n < MAX_IOVECS && vec[i].blocknum == vec[i-1].blocknum + 1);
+    if (! transfer_run(iov, n, vec[start].blocknum, n, write)) {
       return 0;
     }
-    else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp=0;
-	sderror=SD_NOT_INIT;
-	return 0;
-      }
-    }
   }
+  return 1;
+}
 
-  if (blocknum > NUM_BLOCKS-1) {
-    sderror=SD_ILLEGAL_BLOCK_NUMBER;
+// scatter-gather read of 'count' (block, buffer) pairs.  Entries whose block
+// numbers are consecutive are transferred together.  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int readv_sd_blocks(SDBlockVec *vec, unsigned long count) {
+
+  return transfer_vec(vec, count, 0);
+}
+
+// scatter-gather write of 'count' (block, buffer) pairs.  Entries whose block
+// numbers are consecutive are transferred together.  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int writev_sd_blocks(SDBlockVec *vec, unsigned long count) {
+
+  return transfer_vec(vec, count, 1);
+}
+
+//
+// ASYNCHRONOUS ENGINE
+//
+
+#ifndef SD_NO_IO_URING
+
+// io_uring submission/completion rings, mapped from the kernel
+typedef struct SDRing {
+  int fd;
+  unsigned entries;
+  unsigned inFlight;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sqRing, *cqRing;
+  size_t sqRingSize, cqRingSize;
+} SDRing;
+
+static SDRing ring = { .fd = -1 };
+
+// the rings are shared by every thread: held while queueing, reaping and
+// waiting
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void ring_teardown(void) {
+
+  if (ring.sqes) {
+    munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+  }
+  if (ring.cqRing && ring.cqRing != ring.sqRing) {
+    munmap(ring.cqRing, ring.cqRingSize);
+  }
+  if (ring.sqRing) {
+    munmap(ring.sqRing, ring.sqRingSize);
+  }
+  if (ring.fd >= 0) {
+    close(ring.fd);
+  }
+  memset(&ring, 0, sizeof(ring));
+  ring.fd=-1;
+}
+
+// creates the rings.  Returns 1 on success, 0 if io_uring is unavailable.
+static int ring_setup(void) {
+  struct io_uring_params p;
+  char *sq, *cq;
+
+  memset(&p, 0, sizeof(p));
+  ring.fd=syscall(__NR_io_uring_setup, SD_RING_ENTRIES, &p);
+  if (ring.fd < 0) {
+    ring.fd=-1;
     return 0;
   }
+  ring.entries=p.sq_entries;
+  ring.sqRingSize=p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  ring.cqRingSize=p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring.cqRingSize > ring.sqRingSize) {
+      ring.sqRingSize=ring.cqRingSize;
+    }
+    ring.cqRingSize=ring.sqRingSize;
+  }
+  ring.sqRing=mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  if (ring.sqRing == MAP_FAILED) {
+    ring.sqRing=NULL;
+    ring_teardown();
+    return 0;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    ring.cqRing=ring.sqRing;
+  }
+  else {
+    ring.cqRing=mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    if (ring.cqRing == MAP_FAILED) {
+      ring.cqRing=NULL;
+      ring_teardown();
+      return 0;
+    }
+  }
+  ring.sqes=mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (ring.sqes == MAP_FAILED) {
+    ring.sqes=NULL;
+    ring_teardown();
+    return 0;
+  }
+  sq=ring.sqRing;
+  cq=ring.cqRing;
+  ring.sqHead=(unsigned *)(sq + p.sq_off.head);
+  ring.sqTail=(unsigned *)(sq + p.sq_off.tail);
+  ring.sqMask=(unsigned *)(sq + p.sq_off.ring_mask);
+  ring.sqArray=(unsigned *)(sq + p.sq_off.array);
+  ring.cqHead=(unsigned *)(cq + p.cq_off.head);
+  ring.cqTail=(unsigned *)(cq + p.cq_off.tail);
+  ring.cqMask=(unsigned *)(cq + p.cq_off.ring_mask);
+  ring.cqes=(struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  return 1;
+}
+
+// reaps every available completion without blocking.  Returns the number of
+// requests completed.
+static unsigned long ring_reap(void) {
+  unsigned head, tail;
+  unsigned long n=0;
+  struct io_uring_cqe *cqe;
+  SDRequest *req;
+
+  head=*ring.cqHead;
+  tail=__atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    cqe=&ring.cqes[head & *ring.cqMask];
+    req=(SDRequest *)(unsigned long)cqe->user_data;
+    req->result=(cqe->res == (int)(req->count * current->blockSize));
+    if (req->result && observer) {
+      observer(req->write, req->blocknum, req->count, clock_ns() - req->started);
+    }
+    // last: a thread seeing it done may free the request
+    __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+    head++;
+    n++;
+  }
+  __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+  ring.inFlight -= n;
+  return n;
+}
+
+// waits until at least 'min' more requests complete, then reaps.  Returns the
+// number of requests completed.
+static unsigned long ring_wait(unsigned min) {
+  unsigned long n;
+
+  n=ring_reap();
+  while (n < min && ring.inFlight) {
+    if (syscall(__NR_io_uring_enter, ring.fd, 0, min - n, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      break;
+    }
+    n += ring_reap();
+  }
+  return n;
+}
+
+// queues 'req' for descriptor 'fd' on the submission ring; the caller makes
+// sure there is room.
+static void ring_queue(SDRequest *req, int fd) {
+  unsigned tail, idx;
+  struct io_uring_sqe *sqe;
+
+  tail=*ring.sqTail;
+  idx=tail & *ring.sqMask;
+  sqe=&ring.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode=req->write ? IORING_OP_WRITE : IORING_OP_READ;
+  sqe->fd=fd;
+  sqe->addr=(unsigned long)req->buf;
+  sqe->len=req->count * current->blockSize;
+  sqe->off=req->blocknum * current->blockSize;
+  sqe->user_data=(unsigned long)req;
+  req->started=observer ? clock_ns() : 0;
+  ring.sqArray[idx]=idx;
+  __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// hands the 'batch' requests queued last to the kernel, again while it takes
+// only part of them.  Those it refuses are taken back off the submission ring
+// and failed.  Returns 1 if all of them were submitted.
+static int ring_enter(unsigned batch) {
+  unsigned head, tail;
+  long n;
+  SDRequest *req;
+
+  while (batch) {
+    n=syscall(__NR_io_uring_enter, ring.fd, batch, 0, 0, NULL, 0);
+    if (n > 0) {
+      ring.inFlight += n;
+      batch -= n;
+    }
+    // out of resources for now: let some requests finish first
+    else if (n < 0 && (errno == EAGAIN || errno == EBUSY) && ring.inFlight) {
+      ring_wait(1);
+    }
+    else if (! (n < 0 && errno == EINTR)) {
+      break;
+    }
+  }
+  if (! batch) {
+    return 1;
+  }
+  head=__atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+  tail=*ring.sqTail;
+  for (; head != tail; head++) {
+    req=(SDRequest *)(unsigned long)ring.sqes[ring.sqArray[head & *ring.sqMask]].user_data;
+    req->result=0;
+    __atomic_store_n(&req->done, 1, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(ring.sqTail, *ring.sqHead, __ATOMIC_RELEASE);
+  sderror=SD_INTERNAL_ERROR;
+  return 0;
+}
+
+#endif
+
+#ifndef SD_NO_IO_URING
+
+// submit_sd_requests() for SD_ENGINE_IO_URING on an image file disk.  Called
+// with the ring lock held.
+static int ring_submit(SDRequest *reqs, unsigned long count) {
+  FileDisk *f=current->priv;
+  unsigned long i;
+  unsigned batch;
+
+  // the engine reads and writes the descriptor directly
+  if (! f->map) {
+    fflush(f->fp);
+  }
+  i=0;
+  while (i < count) {
+    if (ring.inFlight == ring.entries) {
+      ring_wait(1);
+    }
+    batch=0;
+    while (i < count && ring.inFlight + batch < ring.entries) {
+      if (f->backend == SD_BACKEND_DIRECT && ! buffer_aligned(f, reqs[i].buf)) {
+	// O_DIRECT rejects unaligned memory; bounce this one synchronously
+	reqs[i].result=reqs[i].write ? write_sd_blocks(reqs[i].buf, reqs[i].blocknum, reqs[i].count)
+	  : read_sd_blocks(reqs[i].buf, reqs[i].blocknum, reqs[i].count);
+	reqs[i].done=1;
+	i++;
+	continue;
+      }
+      ring_queue(&reqs[i], fileno(f->fp));
+      batch++;
+      i++;
+    }
+    if (batch && ! ring_enter(batch)) {
+      // the rest is never submitted
+      for (; i < count; i++) {
+	reqs[i].done=1;
+      }
+      return 0;
+    }
+  }
+  return 1;
+}
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fwrite(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
+#endif
+
+// selects the engine used by submit_sd_requests().  Selecting
+// SD_ENGINE_IO_URING fails (leaving SD_ENGINE_SYNC in place) when io_uring is
+// unavailable.  Outstanding requests are completed first.  Returns 1 on
+// success, otherwise 0.  Always sets global 'sderror'.
+int set_software_disk_engine(SDEngine newEngine) {
+
+  sderror=SD_NONE;
+  wait_sd_requests();
+#ifndef SD_NO_IO_URING
+  if (newEngine == SD_ENGINE_IO_URING) {
+    if (ring.fd < 0 && ! ring_setup()) {
+      sderror=SD_INTERNAL_ERROR;
+      return 0;
+    }
+    engine=newEngine;
+    return 1;
+  }
+  ring_teardown();
+#endif
+  if (newEngine != SD_ENGINE_SYNC) {
     sderror=SD_INTERNAL_ERROR;
     return 0;
   }
-  fflush(sd.fp);
+  engine=newEngine;
   return 1;
 }
 
-// reads a block of data into 'buf' from location 'blocknum'.  Blocks are numbered 
-// from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
-// on success or 0 on failure.  Always sets global 'sderror'.
-int read_sd_block(void *buf, unsigned long blocknum) {
+// returns the engine currently used by submit_sd_requests()
+SDEngine software_disk_engine(void) {
+
+  return engine;
+}
+
+// submits 'count' requests.  With SD_ENGINE_SYNC every request is carried out
+// before this returns; with SD_ENGINE_IO_URING they are handed to the kernel
+// in batches and complete later (see poll_sd_requests/wait_sd_requests).
+// RAM disks and striped disks always complete requests synchronously.  The
+// requests and their buffers must stay valid until they are done, even when
+// this fails: requests the kernel took complete as usual, the rest are done
+// and failed.  Returns 1 if all requests were accepted, otherwise 0.  Always
+// sets global 'sderror'.
+int submit_sd_requests(SDRequest *reqs, unsigned long count) {
+  unsigned long i;
+  int ret;
 
   sderror=SD_NONE;
-  if (! sd.fp) {
-    sd.fp=fopen(BACKING_STORE, "r+");
-    if (! sd.fp) {             
-      sderror=SD_INTERNAL_ERROR;
+  if (! current->ops->size(current)) {
+    return 0;
+  }
+  for (i=0; i < count; i++) {
+    reqs[i].done=0;
+    reqs[i].result=0;
+    if (reqs[i].count == 0 || reqs[i].blocknum > current->numBlocks-1 ||
+	reqs[i].count > current->numBlocks - reqs[i].blocknum) {
+      sderror=SD_ILLEGAL_BLOCK_NUMBER;
       return 0;
     }
+  }
+
+#ifndef SD_NO_IO_URING
+  if (engine == SD_ENGINE_IO_URING && current->ops == &file_disk_ops) {
+    pthread_mutex_lock(&ringLock);
+    ret=ring_submit(reqs, count);
+    pthread_mutex_unlock(&ringLock);
+    return ret;
+  }
+#endif
+
+  for (i=0; i < count; i++) {
+    if (reqs[i].write) {
+      reqs[i].result=write_sd_blocks(reqs[i].buf, reqs[i].blocknum, reqs[i].count);
+    }
     else {
-      fseek(sd.fp, 0L, SEEK_END);
-      if (ftell(sd.fp) != NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE) {
-	fclose(sd.fp);
-	sd.fp=0;
-	sderror=SD_NOT_INIT;
-	return 0;
-      }
+      reqs[i].result=read_sd_blocks(reqs[i].buf, reqs[i].blocknum, reqs[i].count);
     }
+    reqs[i].done=1;
   }
+  return 1;
+}
 
-  if (blocknum > NUM_BLOCKS-1) {
-    sderror=SD_ILLEGAL_BLOCK_NUMBER;
-    return 0;
+// reaps completed requests without blocking, setting their 'done' and
+// 'result' fields.  Returns the number of requests completed by this call.
+unsigned long poll_sd_requests(void) {
+  unsigned long n=0;
+
+#ifndef SD_NO_IO_URING
+  pthread_mutex_lock(&ringLock);
+  if (ring.fd >= 0) {
+    n=ring_reap();
   }
+  pthread_mutex_unlock(&ringLock);
+#endif
+  return n;
+}
 
-  fseek(sd.fp, blocknum * SOFTWARE_DISK_BLOCK_SIZE, SEEK_SET);
-  if (fread(buf, SOFTWARE_DISK_BLOCK_SIZE, 1, sd.fp) != 1) {
-    sderror=SD_INTERNAL_ERROR;
-    return 0;
+// blocks until every submitted request is done.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int wait_sd_requests(void) {
+  int ret=1;
+
+  sderror=SD_NONE;
+#ifndef SD_NO_IO_URING
+  pthread_mutex_lock(&ringLock);
+  if (ring.fd >= 0) {
+    FileDisk *f=current->ops == &file_disk_ops ? current->priv : NULL;
+
+    ring_wait(ring.inFlight);
+    if (ring.inFlight) {
+      sderror=SD_INTERNAL_ERROR;
+      ret=0;
+    }
+    // later stdio reads must not see stale buffered data
+    else if (f && f->fp && ! f->map) {
+      fflush(f->fp);
+    }
   }
-  fflush(sd.fp);
-  return 1;
+  pthread_mutex_unlock(&ringLock);
+#endif
+  return ret;
+}
+
+// installs 'observer' (NULL removes it).  Returns the previous one.
+SDObserver set_software_disk_observer(SDObserver newObserver) {
+  SDObserver prev=observer;
+
+  observer=newObserver;
+  return prev;
+}
+
+// forces all blocks written so far out to the backing store (msync for the
+// mmap backend, fflush for stdio, fdatasync for direct, nothing for a RAM
+// disk).  This is the durability point: with the mmap backend, writes are
+// only guaranteed on disk once this returns.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int sync_software_disk(void) {
+
+  sderror=SD_NONE;
+  return current->ops->sync(current);
+}
+
+// syncs and closes the backing store.  The next software disk access reopens
+// it.  Returns 1 on success or 0 on failure.  Always sets global 'sderror'.
+int close_software_disk(void) {
+
+  wait_sd_requests();
+  sderror=SD_NONE;
+  return current->ops->close(current);
 }
 
 // describe current software disk error code by printing a descriptive message to
@@ -151,5 +1718,3 @@ void sd_print_error(void) {
   }
 }
 
-// software disk  error code set (set by each software disk function).
-SDError sderror;
@@ -3,7 +3,20 @@
 // Written by Golden G. Richard III (@nolaforensix), 10/2017.
 //
 
-#define SOFTWARE_DISK_BLOCK_SIZE 512
+// geometry of a software disk created by init_software_disk()
+#define DEFAULT_BLOCK_SIZE 512
+#define DEFAULT_NUM_BLOCKS 5000
+
+// legal block sizes are powers of two in this range
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+
+// alignment of buffers from sd_alloc_buffer(); covers the memory and offset
+// alignment O_DIRECT asks for on common devices
+#define SD_BUFFER_ALIGN 4096
+
+// bytes per block of the current software disk (chosen when it is initialized)
+#define SOFTWARE_DISK_BLOCK_SIZE (software_disk_block_size())
 
 // software disk error codes
 typedef enum  {
@@ -13,15 +26,147 @@ typedef enum  {
   SD_INTERNAL_ERROR          // the software disk has failed
 } SDError;
 
+// one (block, buffer) pair of a scatter-gather transfer
+typedef struct SDBlockVec {
+  unsigned long blocknum;
+  void *buf;                 // SOFTWARE_DISK_BLOCK_SIZE bytes
+} SDBlockVec;
+
+// ways of accessing the backing store
+typedef enum {
+  SD_BACKEND_STDIO,          // stdio FILE*, one fseek and fread/fwrite per block
+  SD_BACKEND_MMAP,           // image mapped once, blocks served as memory copies (default)
+  SD_BACKEND_DIRECT          // O_DIRECT descriptor, bypassing libc and the page cache
+} SDBackend;
+
+// engines carrying out submit_sd_requests()
+typedef enum {
+  SD_ENGINE_SYNC,            // each request is done before submit returns (default)
+  SD_ENGINE_IO_URING         // requests go to the kernel in batches and complete later
+} SDEngine;
+
+// a software disk: an image file, a RAM disk or files striped together (see
+// open_file_disk, create_ram_disk, open_striped_disk).  The functions below
+// act on the selected one.
+typedef struct SDDevice SDDevice;
+
+struct iovec;
+
+// operations implementing one kind of software disk.  Transfers are range
+// checked before they get here.  Each returns 1 (size: the number of blocks)
+// on success or 0 on failure with 'sderror' set.
+typedef struct SDDeviceOps {
+  // moves 'count' blocks from 'blocknum' between the disk and 'iov'
+  int (*read)(SDDevice *dev, struct iovec *iov, int iovcnt, unsigned long blocknum,
+	      unsigned long count);
+  int (*write)(SDDevice *dev, struct iovec *iov, int iovcnt, unsigned long blocknum,
+	       unsigned long count);
+  // makes every completed write durable
+  int (*sync)(SDDevice *dev);
+  // number of blocks, acquiring the disk on first use
+  unsigned long (*size)(SDDevice *dev);
+  // replaces the contents with 'numblocks' zeroed blocks of 'blocksize'
+  int (*create)(SDDevice *dev, unsigned long numblocks, unsigned long blocksize);
+  // syncs and lets go of what the next access can reacquire
+  int (*close)(SDDevice *dev);
+  // frees everything the disk holds
+  void (*destroy)(SDDevice *dev);
+} SDDeviceOps;
+
+// one asynchronous transfer of 'count' consecutive blocks
+typedef struct SDRequest {
+  int write;                 // 0 reads into 'buf', 1 writes from it
+  unsigned long blocknum;
+  unsigned long count;
+  void *buf;                 // count * SOFTWARE_DISK_BLOCK_SIZE bytes
+  int done;                  // set once the request has completed (atomically,
+                             //  after 'result': read it with acquire)
+  int result;                // 1 on success, 0 on failure (valid once done)
+  unsigned long started;     // internal: submission time for the observer
+} SDRequest;
+
+// called after every completed transfer between the software disk and memory
+// with its direction, first block, number of blocks and duration
+typedef void (*SDObserver)(int write, unsigned long blocknum, unsigned long count,
+			   unsigned long nanoseconds);
+
 // function prototypes for software disk API
 
+// creates a software disk of 'numblocks' zeroed blocks of 'blocksize' bytes
+// held in memory.  Nothing reaches a file, so it suits tests and measuring CPU
+// cost apart from I/O.  Returns NULL on failure.  Always sets global 'sderror'.
+SDDevice *create_ram_disk(unsigned long numblocks, unsigned long blocksize);
+
+// returns a software disk backed by the image file 'path', accessed through
+// 'backend'.  The file is opened on first access; init_software_disk_geometry()
+// creates it while the disk is selected.  Returns NULL on failure.  Always sets
+// global 'sderror'.
+SDDevice *open_file_disk(char *path, SDBackend backend);
+
+// returns a software disk striped RAID-0 style across the 'members' image
+// files in 'paths': blocks go to the members round-robin, 'stripeblocks' at a
+// time.  Transfers touching several members run in parallel, one worker thread
+// per member.  The same paths and stripe width must be used every time.  The
+// files are opened on first access; init_software_disk_geometry() creates them
+// while the disk is selected.  Returns NULL on failure.  Always sets global
+// 'sderror'.
+SDDevice *open_striped_disk(char **paths, int members, unsigned long stripeblocks);
+
+// makes 'dev' the software disk every function below acts on; NULL selects
+// the default image file.  Outstanding requests are completed first.  The
+// selection is shared by all threads: transfers may run in several threads at
+// once, but switching disks, engines or backends, creating and closing must
+// not overlap them (the filesystem takes turns with its own switching; a
+// program switching directly must not overlap filesystem calls either).
+// Returns the previously selected disk.
+SDDevice *select_software_disk(SDDevice *dev);
+
+// returns the selected software disk
+SDDevice *software_disk_device(void);
+
+// syncs and frees 'dev'; the default image file disk cannot be destroyed.  If
+// 'dev' is selected the default becomes selected.  Blocks cached above the
+// software disk must be flushed first.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int destroy_software_disk(SDDevice *dev);
+
 // initializes the software disk to all zeros, destroying any existing
 // data.  Returns 1 on success, otherwise 0. Always sets global 'sderror'.
 int init_software_disk();
 
+// initializes the software disk to 'numblocks' zeroed blocks of 'blocksize'
+// bytes each, destroying any existing data.  The image is created sparse, so
+// this takes the same time for any size.  Returns 1 on success, otherwise 0.
+// Always sets global 'sderror'.
+int init_software_disk_geometry(unsigned long numblocks, unsigned long blocksize);
+
+// sets the block size used to address an existing software disk; the number
+// of blocks follows from the size of the backing store.  An open disk is synced
+// and closed first.  Returns 1 on success, otherwise 0.  Always sets global
+// 'sderror'.
+int set_software_disk_block_size(unsigned long blocksize);
+
+// selects the backend used to access the backing store of the selected image
+// file disk.  If it is already open it is synced and closed first.  Fails for a
+// RAM disk.  Returns 1 on success, otherwise 0.  Always sets global 'sderror'.
+int set_software_disk_backend(SDBackend backend);
+
+// returns a zeroed buffer of 'size' bytes aligned to SD_BUFFER_ALIGN, reused
+// from a pool when one of that size was freed earlier.  Block buffers from here
+// go to SD_BACKEND_DIRECT without a bounce copy.  Returns NULL when out of
+// memory.
+void *sd_alloc_buffer(unsigned long size);
+
+// returns 'buf', allocated by sd_alloc_buffer() with the same 'size', to the
+// pool.
+void sd_free_buffer(void *buf, unsigned long size);
+
 // returns the size of the SoftwareDisk in multiples of SOFTWARE_DISK_BLOCK_SIZE
 unsigned long software_disk_size();
 
+// returns the number of bytes in each block of the SoftwareDisk
+unsigned long software_disk_block_size();
+
 // writes a block of data from 'buf' at location 'blocknum'.  Blocks are numbered 
 // from 0.  The buffer 'buf' must be of size SOFTWARE_DISK_BLOCK_SIZE.  Returns 1
 // on success or 0 on failure.  Always sets global 'sderror'.
@@ -32,9 +177,69 @@ int write_sd_block(void *buf, unsigned long blocknum);
 // on success or 0 on failure.  Always sets global 'sderror'.
 int read_sd_block(void *buf, unsigned long blocknum);
 
+// reads 'count' consecutive blocks starting at 'blocknum' into 'buf', which must
+// hold count * SOFTWARE_DISK_BLOCK_SIZE bytes.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int read_sd_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// writes 'count' consecutive blocks starting at 'blocknum' from 'buf', which must
+// hold count * SOFTWARE_DISK_BLOCK_SIZE bytes.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int write_sd_blocks(void *buf, unsigned long blocknum, unsigned long count);
+
+// scatter-gather read of 'count' (block, buffer) pairs.  Entries whose block
+// numbers are consecutive are transferred together.  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int readv_sd_blocks(SDBlockVec *vec, unsigned long count);
+
+// scatter-gather write of 'count' (block, buffer) pairs.  Entries whose block
+// numbers are consecutive are transferred together.  Returns 1 on success or
+// 0 on failure.  Always sets global 'sderror'.
+int writev_sd_blocks(SDBlockVec *vec, unsigned long count);
+
+// selects the engine used by submit_sd_requests().  Selecting
+// SD_ENGINE_IO_URING fails, leaving SD_ENGINE_SYNC in place, when io_uring is
+// unavailable.  Returns 1 on success, otherwise 0.  Always sets global 'sderror'.
+int set_software_disk_engine(SDEngine engine);
+
+// returns the engine currently used by submit_sd_requests()
+SDEngine software_disk_engine(void);
+
+// submits 'count' requests.  The synchronous engine completes each one before
+// returning; io_uring completes them later, except on RAM and striped disks,
+// which always complete them synchronously.  Requests and buffers must stay
+// valid until done, also when this fails: wait_sd_requests() for those the
+// kernel took, the others are done and failed.  Returns 1 if all were
+// accepted, otherwise 0.  Always sets global 'sderror'.
+int submit_sd_requests(SDRequest *reqs, unsigned long count);
+
+// reaps completed requests without blocking.  Returns the number completed
+// by this call.
+unsigned long poll_sd_requests(void);
+
+// blocks until every submitted request is done, those of other threads
+// included.  Returns 1 on success or 0 on failure.  Always sets global
+// 'sderror'.
+int wait_sd_requests(void);
+
+// installs 'observer' to be told about every transfer (NULL removes it).
+// Transfers are only timed while an observer is installed.  Returns the
+// previous observer.
+SDObserver set_software_disk_observer(SDObserver observer);
+
+// forces all blocks written so far out to the backing store.  With the mmap
+// backend this is the only durability point.  Returns 1 on success or 0 on
+// failure.  Always sets global 'sderror'.
+int sync_software_disk(void);
+
+// syncs and closes the backing store; the next access reopens it.  Returns 1
+// on success or 0 on failure.  Always sets global 'sderror'.
+int close_software_disk(void);
+
 // describe current software disk error code by printing a descriptive message to
 // standard error.
 void sd_print_error(void);
 
-// software disk  error code set (set by each software disk function).
-extern SDError sderror;
+// software disk error code set (set by each software disk function), one per
+// thread.
+extern _Thread_local SDError sderror;
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+// RUN formatfs with room for two files of the benchmark size before
+// conducting this test, e.g. ./formatfs 40000 4096 for the default 32MB.
+//
+//   benchio [megabytes [members [stripeblocks]]]
+//
+// Writes and reads back one file per software disk engine with a small block
+// cache, so nearly every transfer reaches the software disk, and prints the
+// throughput of each.  With 'members', the formatted image is first copied to
+// a disk striped across that many files (sdstripeN.sd, 'stripeblocks' blocks
+// per member at a time, default 16) and the benchmark runs there.
+
+#define CHUNK (1024 * 1024)
+#define BENCH_CACHE_BLOCKS 64
+#define COPY_BLOCKS 256
+#define MAX_MEMBERS 16
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// copies the selected disk to a new disk striped across 'members' files and
+// selects it
+static SDDevice *striped_copy(int members, unsigned long stripeblocks) {
+  static char names[MAX_MEMBERS][32];
+  char *paths[MAX_MEMBERS];
+  unsigned long i, n, blocks=software_disk_size();
+  unsigned long blockSize=software_disk_block_size();
+  SDDevice *image, *striped;
+  char *buf;
+  int m;
+
+  for (m=0; m < members; m++) {
+    sprintf(names[m], "sdstripe%d.sd", m);
+    paths[m]=names[m];
+  }
+  striped=open_striped_disk(paths, members, stripeblocks);
+  if (! striped) {
+    return NULL;
+  }
+  image=select_software_disk(striped);
+  if (! init_software_disk_geometry(blocks, blockSize)) {
+    select_software_disk(image);
+    destroy_software_disk(striped);
+    return NULL;
+  }
+  buf=sd_alloc_buffer(COPY_BLOCKS * blockSize);
+  for (i=0; i < blocks; i += n) {
+    n=blocks - i < COPY_BLOCKS ? blocks - i : COPY_BLOCKS;
+    select_software_disk(image);
+    read_sd_blocks(buf, i, n);
+    select_software_disk(striped);
+    write_sd_blocks(buf, i, n);
+  }
+  sd_free_buffer(buf, COPY_BLOCKS * blockSize);
+  return striped;
+}
+
+static int bench(SDEngine engine, char *name, unsigned long megabytes) {
+  File f;
+  char *buf, *buf2;
+  unsigned long i, j;
+  double start, wtime, rtime;
+
+  if (! set_software_disk_engine(engine)) {
+    printf("%-10s engine unavailable\n", name);
+    sd_print_error();
+    return 0;
+  }
+  fs_set_cache_capacity(BENCH_CACHE_BLOCKS);
+
+  buf=malloc(CHUNK);
+  buf2=malloc(CHUNK);
+  for (i=0; i < CHUNK; i++) {
+    buf[i]='A' + (i % 26);
+  }
+
+  f=create_file(name, READ_WRITE);
+  if (! f) {
+    fs_print_error();
+    free(buf);
+    free(buf2);
+    return 0;
+  }
+
+  start=now();
+  for (i=0; i < megabytes; i++) {
+    if (write_file(f, buf, CHUNK) != CHUNK) {
+      fs_print_error();
+      break;
+    }
+  }
+  fs_sync();
+  wtime=now() - start;
+  close_file(f);
+
+  // drop everything cached so the reads go to the software disk
+  fs_set_cache_capacity(BENCH_CACHE_BLOCKS);
+
+  f=open_file(name, READ_ONLY);
+  start=now();
+  for (j=0; j < i; j++) {
+    if (read_file(f, buf2, CHUNK) != CHUNK || memcmp(buf, buf2, CHUNK)) {
+      printf("%-10s read back mismatch at chunk %lu\n", name, j);
+      break;
+    }
+  }
+  rtime=now() - start;
+  close_file(f);
+
+  printf("%-10s %4lu MB  write %8.1f MB/s  read %8.1f MB/s\n", name, i,
+	 i / wtime, j / rtime);
+
+  free(buf);
+  free(buf2);
+  return i == megabytes && j == i;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long megabytes=32, stripeblocks=16;
+  int members=0, ok;
+  SDDevice *striped=NULL;
+  Volume *volume=NULL;
+
+  if (argc > 1) {
+    megabytes=strtoul(argv[1], NULL, 0);
+  }
+  if (argc > 2) {
+    members=atoi(argv[2]);
+  }
+  if (argc > 3) {
+    stripeblocks=strtoul(argv[3], NULL, 0);
+  }
+  if (members > MAX_MEMBERS) {
+    members=MAX_MEMBERS;
+  }
+  if (members > 0) {
+    // stripes are counted in blocks: copy with the block size the image was
+    // formatted with, which mounting it switches to
+    if (! fs_mount(NULL)) {
+      fs_print_error();
+      return 1;
+    }
+    striped=striped_copy(members, stripeblocks);
+    if (! striped) {
+      sd_print_error();
+      return 1;
+    }
+    volume=fs_mount(striped);
+    if (! volume) {
+      fs_print_error();
+      return 1;
+    }
+    printf("striped across %d files, %lu blocks per member at a time\n", members, stripeblocks);
+  }
+
+  ok=bench(SD_ENGINE_SYNC, "sync", megabytes);
+  ok=bench(SD_ENGINE_IO_URING, "io_uring", megabytes) && ok;
+
+  if (striped) {
+    fs_unmount(volume);
+    destroy_software_disk(striped);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+// RUN formatfs before conducting this test!
+//
+//   benchmeta [files]
+//
+// Times metadata operations (create_file, file_exists, block allocation by
+// write_file) on the formatted image and on a RAM disk copy of it.  The block
+// cache is kept small so both runs reach their disk; the difference between
+// the two is the I/O cost, the RAM disk time is the CPU cost.  The block I/O
+// statistics of each run are printed before its timings.
+
+#define BENCH_CACHE_BLOCKS 16
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// copies the selected disk into a new RAM disk
+static SDDevice *ram_copy(void) {
+  unsigned long i, blocks=software_disk_size();
+  unsigned long blockSize=software_disk_block_size();
+  SDDevice *file, *ram;
+  char *buf;
+
+  ram=create_ram_disk(blocks, blockSize);
+  if (! ram) {
+    return NULL;
+  }
+  buf=sd_alloc_buffer(blockSize);
+  for (i=0; i < blocks; i++) {
+    read_sd_block(buf, i);
+    file=select_software_disk(ram);
+    write_sd_block(buf, i);
+    select_software_disk(file);
+  }
+  sd_free_buffer(buf, blockSize);
+  return ram;
+}
+
+static void bench(char *name, unsigned long files) {
+  char fname[32];
+  char c='A';
+  unsigned long i;
+  double start, tcreate, texists, twrite;
+  File f;
+
+  fs_set_cache_capacity(BENCH_CACHE_BLOCKS);
+
+  start=now();
+  for (i=0; i < files; i++) {
+    sprintf(fname, "file%05lu", i);
+    f=create_file(fname, READ_WRITE);
+    if (! f) {
+      fs_print_error();
+      break;
+    }
+    close_file(f);
+  }
+  files=i;
+  tcreate=now() - start;
+
+  start=now();
+  for (i=0; i < files; i++) {
+    sprintf(fname, "file%05lu", i);
+    file_exists(fname);
+  }
+  texists=now() - start;
+
+  // every write past the first block allocates one
+  f=create_file("grow", READ_WRITE);
+  start=now();
+  for (i=0; i < files; i++) {
+    seek_file(f, (i + 1) * SOFTWARE_DISK_BLOCK_SIZE);
+    write_file(f, &c, 1);
+  }
+  twrite=now() - start;
+  close_file(f);
+
+  fs_sync();
+  fs_print_stats();
+  fs_reset_stats();
+  printf("%-6s %6lu files  create %8.2f us  exists %8.2f us  allocate %8.2f us\n",
+	 name, files, tcreate * 1e6 / files, texists * 1e6 / files, twrite * 1e6 / files);
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long files=200;
+  SDDevice *ram;
+  Volume *volume;
+
+  if (argc > 1) {
+    files=strtoul(argv[1], NULL, 0);
+  }
+
+  // copy the freshly formatted image before the file run changes it
+  ram=ram_copy();
+  if (! ram) {
+    sd_print_error();
+    return 1;
+  }
+  fs_reset_stats();
+
+  bench("file", files);
+
+  volume=fs_mount(ram);
+  if (! volume) {
+    fs_print_error();
+    return 1;
+  }
+  bench("ram", files);
+
+  fs_unmount(volume);
+  destroy_software_disk(ram);
+  return 0;
+}
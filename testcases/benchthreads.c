@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+// RUN formatfs with room for one file of the benchmark size per thread before
+// conducting this test, e.g. ./formatfs 40000 4096 for the default 8 x 16MB.
+//
+//   benchthreads [megabytes [threads]]
+//
+// Writes one file per thread, then reads them back with 1, 2, 4, ... up to
+// 'threads' threads at once, each reading its own file with read_file_at, and
+// prints the aggregate throughput of each run.  Readers of different files
+// share no lock but the block cache's, so the throughput should grow with the
+// threads until the disk or the memory bus is saturated.  Link with -lpthread.
+
+#define CHUNK (1024 * 1024)
+#define BENCH_CACHE_BLOCKS 64
+#define MAX_THREADS 64
+
+typedef struct {
+  int index;
+  unsigned long megabytes;
+  unsigned long chunks;         // chunks read back intact
+} Reader;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// the contents of chunk 'chunk' of file 'index'
+static void fill(char *buf, int index, unsigned long chunk) {
+  unsigned long i;
+
+  for (i=0; i < CHUNK; i++) {
+    buf[i]='A' + ((i + index + chunk) % 26);
+  }
+}
+
+static void name_of(char *name, int index) {
+  sprintf(name, "bthread%02d", index);
+}
+
+static int write_one(int index, unsigned long megabytes) {
+  char name[32];
+  char *buf=malloc(CHUNK);
+  unsigned long i;
+  File f;
+
+  name_of(name, index);
+  f=create_file(name, READ_WRITE);
+  if (! f) {
+    fs_print_error();
+    free(buf);
+    return 0;
+  }
+  for (i=0; i < megabytes; i++) {
+    fill(buf, index, i);
+    if (write_file(f, buf, CHUNK) != CHUNK) {
+      fs_print_error();
+      break;
+    }
+  }
+  close_file(f);
+  free(buf);
+  return i == megabytes;
+}
+
+static void *read_one(void *arg) {
+  Reader *r=arg;
+  char name[32];
+  char *buf=malloc(CHUNK), *expect=malloc(CHUNK);
+  unsigned long i;
+  File f;
+
+  name_of(name, r->index);
+  r->chunks=0;
+  f=open_file(name, READ_ONLY);
+  if (f) {
+    for (i=0; i < r->megabytes; i++) {
+      fill(expect, r->index, i);
+      if (read_file_at(f, buf, CHUNK, i * CHUNK) != CHUNK || memcmp(buf, expect, CHUNK)) {
+	printf("file %d: read back mismatch at chunk %lu\n", r->index, i);
+	break;
+      }
+      r->chunks++;
+    }
+    close_file(f);
+  }
+  free(buf);
+  free(expect);
+  return NULL;
+}
+
+// reads back the first 'threads' files in parallel.  Returns 1 if all of
+// them were read back intact.
+static int bench(int threads, unsigned long megabytes) {
+  pthread_t tid[MAX_THREADS];
+  Reader readers[MAX_THREADS];
+  unsigned long total=0;
+  double start, elapsed;
+  int i;
+
+  // drop everything cached so the reads go to the software disk
+  fs_set_cache_capacity(BENCH_CACHE_BLOCKS);
+
+  start=now();
+  for (i=0; i < threads; i++) {
+    readers[i].index=i;
+    readers[i].megabytes=megabytes;
+    pthread_create(&tid[i], NULL, read_one, &readers[i]);
+  }
+  for (i=0; i < threads; i++) {
+    pthread_join(tid[i], NULL);
+    total += readers[i].chunks;
+  }
+  elapsed=now() - start;
+
+  printf("%2d threads %5lu MB  read %8.1f MB/s  (%8.1f MB/s per thread)\n", threads,
+	 total, total / elapsed, total / elapsed / threads);
+  return total == threads * megabytes;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long megabytes=16;
+  int threads=8, i, n, ok=1;
+
+  if (argc > 1) {
+    megabytes=strtoul(argv[1], NULL, 0);
+  }
+  if (argc > 2) {
+    threads=atoi(argv[2]);
+  }
+  if (threads < 1) {
+    threads=1;
+  }
+  if (threads > MAX_THREADS) {
+    threads=MAX_THREADS;
+  }
+
+  for (i=0; i < threads; i++) {
+    if (! write_one(i, megabytes)) {
+      return 1;
+    }
+  }
+  fs_sync();
+
+  for (n=1; n < threads; n *= 2) {
+    ok=bench(n, megabytes) && ok;
+  }
+  ok=bench(threads, megabytes) && ok;
+
+  return ok ? 0 : 1;
+}
@@ -1,7 +1,12 @@
 #!/bin/bash
-gcc -g -o formatfs formatfs.c softwaredisk.c
-gcc -g -o testfs0 testfs0.c filesystem.c softwaredisk.c && ./formatfs && ./testfs0
-gcc -g -o testfs1 testfs1.c filesystem.c softwaredisk.c && ./formatfs && ./testfs1
-gcc -g -o testfs2 testfs2.c filesystem.c softwaredisk.c && ./formatfs && ./testfs2
-gcc -g -o testfs3 testfs3.c filesystem.c softwaredisk.c && ./formatfs && ./testfs3
-gcc -g -o testfs4a testfs4a.c filesystem.c softwaredisk.c && gcc -g -o testfs4b testfs4b.c filesystem.c softwaredisk.c && ./formatfs && ./testfs4a && ./testfs4b
+gcc -g -o formatfs formatfs.c softwaredisk.c -lm -lpthread
+gcc -g -o testfs0 testfs0.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs && ./testfs0
+gcc -g -o testfs1 testfs1.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs && ./testfs1
+gcc -g -o testfs2 testfs2.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs && ./testfs2
+gcc -g -o testfs3 testfs3.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs && ./testfs3
+gcc -g -o testfs4 testfs4.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs && ./testfs4 && ./formatfs -e && ./testfs4
+gcc -g -o testfs5 testfs5.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs && ./testfs5
+gcc -g -o testfs6 testfs6.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs -e && ./testfs6
+gcc -g -o testfs7 testfs7.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs && ./testfs7
+gcc -g -o testfs8 testfs8.c filesystem.c blockcache.c softwaredisk.c -lm -lpthread && ./formatfs && ./testfs8 && ./formatfs -e && ./testfs8
+gcc -g -o testcache testcache.c blockcache.c softwaredisk.c -lm -lpthread && ./testcache
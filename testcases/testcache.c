@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "softwaredisk.h"
+#include "blockcache.h"
+
+// Needs no formatted filesystem: runs on a RAM disk of its own.
+//
+// One thread reads block WATCHED with cache_read_runs while another writes
+// it.  The reader is held, through the software disk observer, right after it
+// took the old contents off the disk with the cache lock dropped; meanwhile
+// the writer writes the block and pushes it out of the cache, so it is written
+// back.  Once the reader is done, reading the block must give what the writer
+// wrote, not the contents the reader took off the disk.  Link with -lpthread.
+
+#define NUM_BLOCKS 64
+#define CACHE_BLOCKS 4
+#define WATCHED 5
+#define OTHERS 10
+#define ROUNDS 100
+
+static pthread_mutex_t lock=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond=PTHREAD_COND_INITIALIZER;
+static __thread int isReader;
+static int readDone, writeDone;
+
+// holds the reader once its read of WATCHED is off the disk until the writer
+// is done
+static void hold_reader(int write, unsigned long blocknum, unsigned long count,
+			unsigned long nanoseconds) {
+
+  (void)count;
+  (void)nanoseconds;
+  if (write || blocknum != WATCHED || ! isReader) {
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  readDone=1;
+  pthread_cond_broadcast(&cond);
+  while (! writeDone) {
+    pthread_cond_wait(&cond, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void *reader(void *arg) {
+  char buf[DEFAULT_BLOCK_SIZE];
+  SDRequest run;
+
+  isReader=1;
+  run.write=0;
+  run.blocknum=WATCHED;
+  run.count=1;
+  run.buf=buf;
+  if (! cache_read_runs(&run, 1)) {
+    printf("cache_read_runs failed\n");
+  }
+  return arg;
+}
+
+// writes 'v' at the start of block 'blocknum'
+static void write_value(unsigned long blocknum, unsigned long v) {
+  char buf[DEFAULT_BLOCK_SIZE];
+
+  memset(buf, 0, sizeof(buf));
+  memcpy(buf, &v, sizeof(v));
+  cache_write_block(buf, blocknum);
+}
+
+// returns the value at the start of block 'blocknum'
+static unsigned long read_value(unsigned long blocknum) {
+  char buf[DEFAULT_BLOCK_SIZE];
+  unsigned long v;
+
+  cache_read_block(buf, blocknum);
+  memcpy(&v, buf, sizeof(v));
+  return v;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long round, i, got, stale=0;
+  pthread_t thread;
+  SDDevice *disk;
+
+  disk=create_ram_disk(NUM_BLOCKS, DEFAULT_BLOCK_SIZE);
+  if (! disk) {
+    printf("create_ram_disk failed\n");
+    return 1;
+  }
+  select_software_disk(disk);
+  init_block_cache(CACHE_BLOCKS);
+  set_software_disk_observer(hold_reader);
+
+  for (round=1; round <= ROUNDS; round++) {
+    // the old contents, on the disk only
+    write_value(WATCHED, 2 * round - 1);
+    init_block_cache(CACHE_BLOCKS);
+
+    readDone=writeDone=0;
+    pthread_create(&thread, NULL, reader, NULL);
+    pthread_mutex_lock(&lock);
+    while (! readDone) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    // write the block and evict it while the reader's copy is in its hands
+    write_value(WATCHED, 2 * round);
+    for (i=0; i < CACHE_BLOCKS; i++) {
+      write_value(OTHERS + i, 0);
+    }
+
+    pthread_mutex_lock(&lock);
+    writeDone=1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+
+    got=read_value(WATCHED);
+    if (got != 2 * round) {
+      printf("round %lu: read %lu after writing %lu\n", round, got, 2 * round);
+      stale++;
+    }
+  }
+
+  printf("%lu rounds, %lu stale reads\n", (unsigned long)ROUNDS, stale);
+  set_software_disk_observer(NULL);
+  flush_block_cache();
+  select_software_disk(NULL);
+  destroy_software_disk(disk);
+  return stale != 0;
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesystem.h"
+
+// RUN formatfs before conducting this test!  Run it after both formatfs and
+// formatfs -e: either file layout is sparse.
+//
+// Seeks far past the end of a file, beyond the size of the whole disk, and
+// writes there and in the middle of the hole.  The skipped bytes read as zeros
+// and take no blocks, and all of it is the same after the volume is unmounted
+// and mounted again.
+
+#define FAR (64UL * 1024 * 1024)
+#define MIDDLE (1024UL * 1024 + 100)
+#define FILLER (256UL * 1024)
+
+static int failures=0;
+
+static void check(int ok, char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (! ok) {
+    failures++;
+  }
+}
+
+// 1 if 'len' bytes of 'f' at 'offset' are all zero
+static int reads_zeros(File f, unsigned long offset, unsigned long len) {
+  char *buf=malloc(len);
+  unsigned long i, ret;
+
+  memset(buf, 1, len);
+  ret=read_file_at(f, buf, len, offset);
+  fs_print_error();
+  for (i=0; i < ret && buf[i] == 0; i++)
+    ;
+  free(buf);
+  return ret == len && i == len;
+}
+
+// 1 if 'f' holds 'expect' at 'offset'
+static int reads_back(File f, unsigned long offset, char *expect) {
+  char buf[100];
+  unsigned long len=strlen(expect);
+
+  memset(buf, 0, sizeof(buf));
+  return read_file_at(f, buf, len, offset) == len && ! memcmp(buf, expect, len);
+}
+
+static void check_contents(File f) {
+  check(file_length(f) == FAR + strlen("tail"), "length reaches past the far write");
+  check(reads_back(f, 0, "head"), "head reads back");
+  check(reads_zeros(f, 4, 100000), "hole after the head reads as zeros");
+  check(reads_zeros(f, MIDDLE - 5000, 5000), "hole before the middle reads as zeros");
+  check(reads_back(f, MIDDLE, "middle"), "middle reads back");
+  check(reads_zeros(f, MIDDLE + 6, 5000), "hole after the middle reads as zeros");
+  check(reads_zeros(f, FAR - 3000, 3000), "hole before the tail reads as zeros");
+  check(reads_back(f, FAR, "tail"), "tail reads back");
+}
+
+int main(int argc, char *argv[]) {
+  File f;
+  char *filler;
+  unsigned long ret;
+
+  f=create_file("sparse", READ_WRITE);
+  printf("ret from create_file(\"sparse\", READ_WRITE) = %p\n", f);
+  fs_print_error();
+
+  ret=write_file(f, "head", strlen("head"));
+  printf("ret from write_file(f, \"head\", 4) = %lu\n", ret);
+  fs_print_error();
+
+  // past the end of the disk: only a hole can get there
+  seek_file(f, FAR);
+  printf("Seeking to %lu.\n", FAR);
+  fs_print_error();
+  check(file_length(f) == FAR, "seek past the end of the disk extends the file");
+
+  ret=write_file(f, "tail", strlen("tail"));
+  printf("ret from write_file(f, \"tail\", 4) = %lu\n", ret);
+  fs_print_error();
+
+  // fills a block in the middle of the hole
+  ret=write_file_at(f, "middle", strlen("middle"), MIDDLE);
+  printf("ret from write_file_at(f, \"middle\", 6, %lu) = %lu\n", MIDDLE, ret);
+  fs_print_error();
+
+  check_contents(f);
+  close_file(f);
+  printf("Executed close_file(f).\n");
+  fs_print_error();
+
+  // the hole took no space from other files
+  filler=calloc(1, FILLER);
+  f=create_file("filler", READ_WRITE);
+  ret=write_file(f, filler, FILLER);
+  check(ret == FILLER, "the disk still has room for another file");
+  close_file(f);
+  free(filler);
+
+  // the same after mounting the volume again
+  check(fs_unmount(fs_mount(NULL)) == 1, "volume unmounts");
+  fs_print_error();
+  f=open_file("sparse", READ_ONLY);
+  fs_print_error();
+  check_contents(f);
+  close_file(f);
+
+  delete_file("filler");
+  delete_file("sparse");
+  fs_print_error();
+
+  printf("%d checks failed\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filesystem.h"
+
+// RUN formatfs before conducting this test!
+//
+// Looks files up by name through the name index: many short names, names
+// spread over several records up to the longest one allowed, and names that
+// only differ in their last byte.  Every file holds its own name, so opening
+// the wrong record shows.  Half of the files are deleted and created again,
+// and all of it is looked up once more after the volume is unmounted and
+// mounted again.
+
+#define NUM_SHORT 300
+#define NUM_LONG 6
+#define LONGEST 449
+
+static int failures=0;
+static char names[NUM_SHORT + 2 * NUM_LONG][LONGEST + 1];
+static int numNames=0;
+
+static void check(int ok, char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (! ok) {
+    failures++;
+  }
+}
+
+// creates file 'name' holding its name; returns 1 on success
+static int create_named(char *name) {
+  File f=create_file(name, READ_WRITE);
+  unsigned long ret;
+
+  if (! f) {
+    fs_print_error();
+    return 0;
+  }
+  ret=write_file(f, name, strlen(name));
+  close_file(f);
+  return ret == strlen(name);
+}
+
+// 1 if file 'name' exists and holds its name
+static int holds_name(char *name) {
+  char buf[LONGEST + 1];
+  unsigned long len=strlen(name), ret;
+  File f;
+
+  if (! file_exists(name)) {
+    return 0;
+  }
+  f=open_file(name, READ_ONLY);
+  if (! f) {
+    fs_print_error();
+    return 0;
+  }
+  memset(buf, 0, sizeof(buf));
+  ret=read_file(f, buf, sizeof(buf));
+  close_file(f);
+  return ret == len && ! memcmp(buf, name, len);
+}
+
+// checks every name, expecting the odd ones deleted if 'skipOdd'
+static void check_all(int skipOdd, char *what) {
+  int i, found=0, expected=0, stray=0;
+
+  for (i=0; i < numNames; i++) {
+    if (skipOdd && i % 2) {
+      stray += file_exists(names[i]);
+      continue;
+    }
+    expected++;
+    found += holds_name(names[i]);
+  }
+  printf("%d of %d names found, %d deleted ones still there\n", found, expected, stray);
+  check(found == expected && stray == 0, what);
+}
+
+int main(int argc, char *argv[]) {
+  static int lengths[NUM_LONG]={ 15, 16, 46, 47, 200, LONGEST };
+  char tooLong[LONGEST + 2];
+  int i, created=0;
+  File f;
+
+  for (i=0; i < NUM_SHORT; i++) {
+    sprintf(names[numNames++], "name-%d", i);
+  }
+  // names over several records, in pairs differing in the last byte only
+  for (i=0; i < NUM_LONG; i++) {
+    memset(names[numNames], 'a' + i, lengths[i]);
+    names[numNames][lengths[i]]='\0';
+    strcpy(names[numNames + 1], names[numNames]);
+    names[numNames + 1][lengths[i] - 1]='z';
+    numNames += 2;
+  }
+
+  for (i=0; i < numNames; i++) {
+    created += create_named(names[i]);
+  }
+  printf("%d of %d files created\n", created, numNames);
+  check(created == numNames, "every file is created");
+  check_all(0, "every name finds its own file");
+
+  check(! file_exists("name-"), "a prefix of a name is not found");
+  check(! file_exists("name-3000"), "a longer name is not found");
+
+  f=create_file("name-7", READ_WRITE);
+  check(f == NULL && fserror == FS_FILE_ALREADY_EXISTS, "a name is not created twice");
+
+  memset(tooLong, 'q', LONGEST + 1);
+  tooLong[LONGEST + 1]='\0';
+  f=create_file(tooLong, READ_WRITE);
+  check(f == NULL && ! file_exists(tooLong), "a name longer than the records hold is refused");
+
+  // lookups probe past the slots freed by deletes
+  for (i=1; i < numNames; i += 2) {
+    delete_file(names[i]);
+  }
+  fs_print_error();
+  check_all(1, "deleted names are gone, the others still found");
+
+  created=0;
+  for (i=1; i < numNames; i += 2) {
+    created += create_named(names[i]);
+  }
+  check(created == numNames / 2, "deleted names are created again");
+  check_all(0, "every name finds its own file after the deletes");
+
+  check(fs_unmount(fs_mount(NULL)) == 1, "volume unmounts");
+  fs_print_error();
+  check_all(0, "every name finds its own file after mounting again");
+
+  created=0;
+  for (i=0; i < numNames; i++) {
+    delete_file(names[i]);
+    created += file_exists(names[i]);
+  }
+  check(created == 0, "every file is deleted");
+  printf("%d checks failed\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+// RUN formatfs -e before conducting this test!
+//
+// Grows two files a block at a time in turn, so each block of either is an
+// extent of its own and their extent trees need more than one level.  Both
+// read back whole and from scattered positions, the same after the volume is
+// unmounted and mounted again (the trees are read back from the disk).
+// Deleting them gives back every block, tree nodes included.
+
+#define NUM_BLOCKS 600
+#define PROBES 200
+
+static int failures=0;
+
+static void check(int ok, char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (! ok) {
+    failures++;
+  }
+}
+
+// byte 'i' of file 'which'
+static char content(int which, unsigned long i) {
+  return (char)((i * 31 + i / 512 + which * 101) % 251 + 1);
+}
+
+// bytes a new file can take before the disk is full
+static unsigned long free_bytes(void) {
+  static char buf[4096];
+  unsigned long total=0, ret;
+  File f=create_file("filler", READ_WRITE);
+
+  while ((ret=write_file(f, buf, sizeof(buf))) > 0) {
+    total += ret;
+  }
+  close_file(f);
+  delete_file("filler");
+  return total;
+}
+
+// 1 if 'f' holds file 'which' of 'length' bytes, read whole and at scattered
+// positions
+static int holds(File f, int which, unsigned long length) {
+  char *buf=malloc(length);
+  unsigned long i, pos, n, ok;
+  unsigned int seed=which + 1;
+
+  ok=(file_length(f) == length && read_file_at(f, buf, length, 0) == length);
+  for (i=0; ok && i < length; i++) {
+    ok=(buf[i] == content(which, i));
+  }
+  for (i=0; ok && i < PROBES; i++) {
+    pos=rand_r(&seed) % length;
+    n=1 + rand_r(&seed) % 3000;
+    if (pos + n > length) {
+      n=length - pos;
+    }
+    seek_file(f, pos);
+    ok=(read_file(f, buf, n) == n);
+    for (; ok && n > 0; n--) {
+      ok=(buf[n - 1] == content(which, pos + n - 1));
+    }
+  }
+  free(buf);
+  return ok;
+}
+
+int main(int argc, char *argv[]) {
+  char *block=malloc(SOFTWARE_DISK_BLOCK_SIZE);
+  unsigned long before, after, length, i, b;
+  int which, written=1;
+  File f[2];
+
+  before=free_bytes();
+  printf("%lu bytes free\n", before);
+
+  f[0]=create_file("extents-a", READ_WRITE);
+  f[1]=create_file("extents-b", READ_WRITE);
+  fs_print_error();
+
+  // a block each in turn: neither file gets two neighbouring blocks
+  length=NUM_BLOCKS * SOFTWARE_DISK_BLOCK_SIZE;
+  for (b=0; written && b < NUM_BLOCKS; b++) {
+    for (which=0; which < 2; which++) {
+      for (i=0; i < SOFTWARE_DISK_BLOCK_SIZE; i++) {
+	block[i]=content(which, b * SOFTWARE_DISK_BLOCK_SIZE + i);
+      }
+      written=(write_file_at(f[which], block, SOFTWARE_DISK_BLOCK_SIZE, b * SOFTWARE_DISK_BLOCK_SIZE) == SOFTWARE_DISK_BLOCK_SIZE);
+      flush_file(f[which]);
+    }
+  }
+  fs_print_error();
+  check(written, "interleaved blocks are written");
+  check(holds(f[0], 0, length), "first file reads back");
+  check(holds(f[1], 1, length), "second file reads back");
+
+  // a write in the middle goes to the block already there
+  for (i=0; i < SOFTWARE_DISK_BLOCK_SIZE; i++) {
+    block[i]=content(0, 300 * SOFTWARE_DISK_BLOCK_SIZE + 17 + i);
+  }
+  check(write_file_at(f[0], block, SOFTWARE_DISK_BLOCK_SIZE, 300 * SOFTWARE_DISK_BLOCK_SIZE + 17) == SOFTWARE_DISK_BLOCK_SIZE &&
+	file_length(f[0]) == length, "an overwrite across two extents keeps the length");
+  check(holds(f[0], 0, length), "first file reads back after the overwrite");
+
+  close_file(f[0]);
+  close_file(f[1]);
+  fs_print_error();
+
+  check(fs_unmount(fs_mount(NULL)) == 1, "volume unmounts");
+  f[0]=open_file("extents-a", READ_ONLY);
+  f[1]=open_file("extents-b", READ_WRITE);
+  fs_print_error();
+  check(holds(f[0], 0, length), "first file reads back after mounting again");
+  check(holds(f[1], 1, length), "second file reads back after mounting again");
+
+  // appends after reloading the tree continue it
+  for (i=0; i < SOFTWARE_DISK_BLOCK_SIZE; i++) {
+    block[i]=content(1, length + i);
+  }
+  seek_file(f[1], length);
+  check(write_file(f[1], block, SOFTWARE_DISK_BLOCK_SIZE) == SOFTWARE_DISK_BLOCK_SIZE, "append to the reloaded tree");
+  check(holds(f[1], 1, length + SOFTWARE_DISK_BLOCK_SIZE), "second file reads back after the append");
+  close_file(f[0]);
+  close_file(f[1]);
+
+  delete_file("extents-a");
+  delete_file("extents-b");
+  fs_print_error();
+  after=free_bytes();
+  printf("%lu bytes free after deleting them\n", after);
+  check(after == before, "deleting the files frees their blocks and tree nodes");
+
+  free(block);
+  printf("%d checks failed\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "softwaredisk.h"
+#include "filesystem.h"
+
+// RUN formatfs before conducting this test!
+//
+// Small files live in the records after their name and take no data block:
+// they are written in pieces, overwritten, reopened and appended to.  Files
+// outgrowing their records, blocked by the records of the next file, or seeked
+// past what the records hold move to a data block with their bytes intact.
+// All of it reads the same after the volume is unmounted and mounted again.
+
+#define NUM_SMALL 40
+#define INLINE_MAX (INLINE_RECORDS * RECORD_INLINE_DATA_LENGTH)
+
+static int failures=0;
+
+static void check(int ok, char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (! ok) {
+    failures++;
+  }
+}
+
+// byte 'i' of the file named 'name'
+static char content(char *name, unsigned long i) {
+  return (char)('a' + (i + strlen(name) * 7) % 26);
+}
+
+// bytes a new file can take before the disk is full
+static unsigned long free_bytes(void) {
+  static char buf[4096];
+  unsigned long total=0, ret;
+  File f=create_file("filler", READ_WRITE);
+
+  while ((ret=write_file(f, buf, sizeof(buf))) > 0) {
+    total += ret;
+  }
+  close_file(f);
+  delete_file("filler");
+  return total;
+}
+
+// writes bytes 'from' to 'to' - 1 of 'name' at the position of 'f'
+static int write_range(File f, char *name, unsigned long from, unsigned long to) {
+  char buf[4096];
+  unsigned long i;
+
+  for (i=from; i < to; i++) {
+    buf[i - from]=content(name, i);
+  }
+  return write_file(f, buf, to - from) == to - from;
+}
+
+// 1 if file 'name' holds 'length' bytes of its content
+static int holds(char *name, unsigned long length) {
+  char buf[4096];
+  unsigned long i, ret;
+  File f=open_file(name, READ_ONLY);
+
+  if (! f) {
+    fs_print_error();
+    return 0;
+  }
+  ret=read_file(f, buf, sizeof(buf));
+  close_file(f);
+  for (i=0; i < ret && buf[i] == content(name, i); i++)
+    ;
+  return ret == length && i == length;
+}
+
+// 1 if file 'name' holds 'length' bytes of its content and zeros up to 'size'
+static int holds_then_zeros(char *name, unsigned long length, unsigned long size) {
+  char buf[4096];
+  unsigned long i, ret;
+  File f=open_file(name, READ_ONLY);
+
+  if (! f) {
+    fs_print_error();
+    return 0;
+  }
+  ret=read_file(f, buf, sizeof(buf));
+  close_file(f);
+  for (i=0; i < length && buf[i] == content(name, i); i++)
+    ;
+  for (; i < ret && buf[i] == 0; i++)
+    ;
+  return ret == size && i == size;
+}
+
+int main(int argc, char *argv[]) {
+  char name[32];
+  unsigned long before, i, lengths[NUM_SMALL];
+  int ok;
+  File f, g;
+
+  before=free_bytes();
+
+  // small files written in pieces of up to a record and a half
+  ok=1;
+  for (i=0; i < NUM_SMALL; i++) {
+    sprintf(name, "small-%lu", i);
+    lengths[i]=i * INLINE_MAX / (NUM_SMALL - 1);
+    f=create_file(name, READ_WRITE);
+    ok=ok && f && write_range(f, name, 0, lengths[i] / 3) &&
+      write_range(f, name, lengths[i] / 3, lengths[i]);
+    close_file(f);
+  }
+  check(ok, "small files are written in pieces");
+  for (i=0, ok=1; i < NUM_SMALL; i++) {
+    sprintf(name, "small-%lu", i);
+    ok=ok && holds(name, lengths[i]);
+  }
+  check(ok, "small files read back");
+  check(free_bytes() == before, "small files take no data block");
+
+  // an overwrite in the middle, an append after reopening
+  f=open_file("small-20", READ_WRITE);
+  {
+    char buf[20];
+
+    memset(buf, 'X', sizeof(buf));
+    ok=write_file_at(f, buf, sizeof(buf), 5) == sizeof(buf);
+    memset(buf, 0, sizeof(buf));
+    ok=ok && read_file_at(f, buf, sizeof(buf), 5) == sizeof(buf) && buf[0] == 'X' && buf[19] == 'X';
+  }
+  seek_file(f, 5);
+  ok=ok && write_range(f, "small-20", 5, 25);
+  seek_file(f, lengths[20]);
+  ok=ok && write_range(f, "small-20", lengths[20], lengths[20] + 10);
+  close_file(f);
+  lengths[20] += 10;
+  check(ok && holds("small-20", lengths[20]), "overwrite and append of a reopened small file");
+
+  // outgrowing the records
+  f=open_file("small-30", READ_WRITE);
+  seek_file(f, lengths[30]);
+  ok=write_range(f, "small-30", lengths[30], 3000);
+  close_file(f);
+  lengths[30]=3000;
+  check(ok && holds("small-30", lengths[30]), "a file outgrowing its records keeps its bytes");
+
+  // a file created right after another usually takes the records following it
+  f=create_file("blocked", READ_WRITE);
+  g=create_file("neighbour", READ_WRITE);
+  ok=f && g && write_range(g, "neighbour", 0, 50) && write_range(f, "blocked", 0, 60);
+  close_file(f);
+  close_file(g);
+  check(ok && holds("blocked", 60) && holds("neighbour", 50), "a file blocked by its neighbour's records moves out");
+
+  // a seek past what the records hold
+  f=create_file("seeker", READ_WRITE);
+  ok=write_range(f, "seeker", 0, 10);
+  seek_file(f, 2000);
+  ok=ok && file_length(f) == 2000;
+  close_file(f);
+  check(ok && holds_then_zeros("seeker", 10, 2000), "a seek past the records keeps the bytes and reads zeros after them");
+
+  check(fs_unmount(fs_mount(NULL)) == 1, "volume unmounts");
+  for (i=0, ok=1; i < NUM_SMALL; i++) {
+    sprintf(name, "small-%lu", i);
+    ok=ok && holds(name, lengths[i]);
+  }
+  ok=ok && holds("blocked", 60) && holds("neighbour", 50) &&
+    holds_then_zeros("seeker", 10, 2000);
+  check(ok, "every file reads back after mounting again");
+
+  for (i=0; i < NUM_SMALL; i++) {
+    sprintf(name, "small-%lu", i);
+    delete_file(name);
+  }
+  delete_file("blocked");
+  delete_file("neighbour");
+  delete_file("seeker");
+  check(free_bytes() == before, "deleting the files frees what they took");
+
+  printf("%d checks failed\n", failures);
+  return failures != 0;
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "filesystem.h"
+
+// RUN formatfs before conducting this test!  Link with -lpthread.
+//
+// Reads and writes files with read_file_at and write_file_at, which take an
+// offset of their own and leave the file position alone: overwrites of bytes
+// still buffered by write_file, reads clipped at the end of the file, writes
+// past the end leaving a hole, and the same on a file small enough to stay in
+// its records.  Several threads read one handle at once, and all of it reads
+// the same after the volume is unmounted and mounted again.
+
+#define LENGTH 20000
+#define PATCH_AT 3000
+#define PATCH 700
+#define FAR 200000
+#define NUM_THREADS 4
+#define PROBES 500
+
+static int failures=0;
+static File shared;
+
+static void check(int ok, char *what) {
+  printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+  if (! ok) {
+    failures++;
+  }
+}
+
+// byte 'i' of file "positional"
+static char content(unsigned long i) {
+  if (i >= PATCH_AT && i < PATCH_AT + PATCH) {
+    return 'P';
+  }
+  if (i >= FAR) {
+    return "end"[i - FAR];
+  }
+  if (i >= LENGTH) {
+    return 0;
+  }
+  return (char)((i * 13 + i / 512) % 251 + 1);
+}
+
+// bytes a new file can take before the disk is full
+static unsigned long free_bytes(void) {
+  static char buf[4096];
+  unsigned long total=0, ret;
+  File f=create_file("filler", READ_WRITE);
+
+  while ((ret=write_file(f, buf, sizeof(buf))) > 0) {
+    total += ret;
+  }
+  close_file(f);
+  delete_file("filler");
+  return total;
+}
+
+// 1 if 'n' bytes of 'f' at 'offset' are those of "positional"
+static int reads_back(File f, unsigned long offset, unsigned long n) {
+  char *buf=malloc(n);
+  unsigned long i, ret;
+
+  ret=read_file_at(f, buf, n, offset);
+  for (i=0; i < ret && buf[i] == content(offset + i); i++)
+    ;
+  free(buf);
+  return ret == n && i == n;
+}
+
+// reads scattered pieces of the shared handle; returns how many were wrong
+static void *reader(void *arg) {
+  unsigned int seed=(unsigned int)(unsigned long)arg;
+  unsigned long i, pos, n, wrong=0;
+
+  for (i=0; i < PROBES; i++) {
+    pos=rand_r(&seed) % (FAR + 3);
+    n=1 + rand_r(&seed) % 5000;
+    if (pos + n > FAR + 3) {
+      n=FAR + 3 - pos;
+    }
+    wrong += ! reads_back(shared, pos, n);
+  }
+  return (void *)wrong;
+}
+
+static void check_contents(File f, File tiny) {
+  char buf[16];
+
+  check(file_length(f) == FAR + 3, "length reaches past the far write");
+  check(reads_back(f, 0, FAR + 3), "positional reads back whole");
+  check(reads_back(f, PATCH_AT - 10, PATCH + 20), "the overwrite reads back with its edges");
+  check(reads_back(f, LENGTH - 5, 5000), "the hole reads as zeros");
+  memset(buf, 0, sizeof(buf));
+  check(read_file_at(tiny, buf, sizeof(buf), 0) == 4 && ! memcmp(buf, "zXYd", 4), "tiny reads back");
+}
+
+int main(int argc, char *argv[]) {
+  char *buf=malloc(LENGTH);
+  unsigned long before, i, ret;
+  void *wrong;
+  pthread_t threads[NUM_THREADS];
+  File f, tiny;
+  int ok;
+
+  before=free_bytes();
+
+  f=create_file("positional", READ_WRITE);
+  fs_print_error();
+
+  // the first half is still in the write buffer when it is overwritten
+  for (i=0; i < LENGTH; i++) {
+    buf[i]=content(i);
+  }
+  ret=write_file(f, buf, LENGTH / 2);
+  check(ret == LENGTH / 2, "first half is written");
+  memset(buf + PATCH_AT, 'P', PATCH);
+  check(write_file_at(f, buf + PATCH_AT, PATCH, PATCH_AT) == PATCH, "overwrite of buffered bytes");
+  check(reads_back(f, PATCH_AT - 10, PATCH + 20), "the overwrite reads back before a flush");
+
+  // write_file goes on where it stopped
+  ret=write_file(f, buf + LENGTH / 2, LENGTH / 2);
+  check(ret == LENGTH / 2 && file_length(f) == LENGTH, "second half goes on after the first");
+  check(reads_back(f, 0, LENGTH), "positional reads back whole");
+
+  // reads stop at the end of the file
+  check(read_file_at(f, buf, 1000, LENGTH - 100) == 100, "a read over the end is cut short");
+  check(read_file_at(f, buf, 1000, LENGTH) == 0, "a read at the end reads nothing");
+  check(read_file_at(f, buf, 1000, LENGTH + 5000) == 0, "a read past the end reads nothing");
+
+  // a write past the end leaves a hole
+  check(write_file_at(f, "end", 3, FAR) == 3 && file_length(f) == FAR + 3, "a write past the end extends the file");
+  check(reads_back(f, LENGTH - 5, 5000) && reads_back(f, FAR - 100, 103), "the hole reads as zeros");
+
+  // none of it moved the position
+  seek_file(f, 10);
+  read_file_at(f, buf, 500, 7000);
+  write_file_at(f, "", 0, 5);
+  ret=read_file(f, buf, 20);
+  for (i=0; i < ret && buf[i] == content(10 + i); i++)
+    ;
+  check(ret == 20 && i == 20, "positional calls leave the file position alone");
+
+  // a file small enough to stay in its records
+  tiny=create_file("tiny", READ_WRITE);
+  ok=(write_file_at(tiny, "abcd", 4, 0) == 4 && write_file_at(tiny, "XY", 2, 1) == 2 &&
+      write_file(tiny, "z", 1) == 1);
+  memset(buf, 0, 16);
+  check(ok && read_file_at(tiny, buf, 16, 1) == 3 && ! memcmp(buf, "XYd", 3), "tiny file overwrites in place");
+
+  // several readers on one handle
+  shared=f;
+  ok=1;
+  for (i=0; i < NUM_THREADS; i++) {
+    ok=ok && ! pthread_create(&threads[i], NULL, reader, (void *)(i + 1));
+  }
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], &wrong);
+    ok=ok && wrong == NULL;
+  }
+  check(ok, "threads reading one handle all read the right bytes");
+
+  check_contents(f, tiny);
+  close_file(f);
+  close_file(tiny);
+  fs_print_error();
+
+  check(fs_unmount(fs_mount(NULL)) == 1, "volume unmounts");
+  f=open_file("positional", READ_ONLY);
+  tiny=open_file("tiny", READ_ONLY);
+  fs_print_error();
+  check_contents(f, tiny);
+  close_file(f);
+  close_file(tiny);
+
+  delete_file("positional");
+  delete_file("tiny");
+  fs_print_error();
+  check(free_bytes() == before, "deleting the files frees what they took");
+
+  free(buf);
+  printf("%d checks failed\n", failures);
+  return failures != 0;
+}